@@ -0,0 +1,330 @@
+#include <stdlib.h>
+#include <string.h> // memcpy
+#include "cache.h"
+
+// Hash a (handle, block) key into a bucket index
+static uint32_t vdisk_cache_hash(VDISK_CACHE *c, const void *owner, uint64_t block) {
+	uint64_t h = ((uint64_t)(uintptr_t)owner ^ block) * 0x9E3779B97F4A7C15ULL;
+	return (uint32_t)(h >> 32) & c->mask;
+}
+
+// Find the entry of a key, resident or ghost, or -1
+static int32_t vdisk_cache_find(VDISK_CACHE *c, const void *owner, uint64_t block) {
+	int32_t i = c->buckets[vdisk_cache_hash(c, owner, block)];
+	while (i >= 0) {
+		VDISK_CACHE_ENTRY *e = c->entries + i;
+		if (e->block == block && e->owner == owner)
+			return i;
+		i = e->hnext;
+	}
+	return -1;
+}
+
+// Remove an entry from its hash chain
+static void vdisk_cache_unhash(VDISK_CACHE *c, int32_t i) {
+	int32_t *p = c->buckets + vdisk_cache_hash(c, c->entries[i].owner, c->entries[i].block);
+	while (*p != i)
+		p = &c->entries[*p].hnext;
+	*p = c->entries[i].hnext;
+}
+
+// Remove an entry from its list
+static void vdisk_cache_unlink(VDISK_CACHE *c, int32_t i) {
+	VDISK_CACHE_ENTRY *e = c->entries + i;
+	if (e->prev >= 0)
+		c->entries[e->prev].next = e->next;
+	else
+		c->lists[e->list].head = e->next;
+	if (e->next >= 0)
+		c->entries[e->next].prev = e->prev;
+	else
+		c->lists[e->list].tail = e->prev;
+	--c->lists[e->list].size;
+}
+
+// Insert an entry at the head of a list
+static void vdisk_cache_link(VDISK_CACHE *c, int32_t i, uint32_t list) {
+	VDISK_CACHE_ENTRY *e = c->entries + i;
+	e->list = list;
+	e->prev = -1;
+	e->next = c->lists[list].head;
+	if (e->next >= 0)
+		c->entries[e->next].prev = i;
+	else
+		c->lists[list].tail = i;
+	c->lists[list].head = i;
+	++c->lists[list].size;
+}
+
+// Unhash an entry and return it to the free entry list
+static void vdisk_cache_release(VDISK_CACHE *c, int32_t i) {
+	vdisk_cache_unhash(c, i);
+	c->entries[i].list = VDISK_CACHE_FREE;
+	c->entries[i].next = c->unused;
+	c->unused = i;
+}
+
+// Get a free data slot, evicting a block if needed. A1in is evicted first
+// while it is over its target size, keeping the key of the block as a ghost.
+static uint32_t vdisk_cache_reclaim(VDISK_CACHE *c) {
+	if (c->available)
+		return c->slots[--c->available];
+
+	++c->evictions;
+	int32_t i;
+	if (c->lists[VDISK_CACHE_A1IN].size > c->kin ||
+		c->lists[VDISK_CACHE_AM].size == 0) {
+		i = c->lists[VDISK_CACHE_A1IN].tail;
+		vdisk_cache_unlink(c, i);
+		if (c->lists[VDISK_CACHE_A1OUT].size >= c->kout) {
+			int32_t g = c->lists[VDISK_CACHE_A1OUT].tail;
+			vdisk_cache_unlink(c, g);
+			vdisk_cache_release(c, g);
+		}
+		vdisk_cache_link(c, i, VDISK_CACHE_A1OUT);
+	} else {
+		i = c->lists[VDISK_CACHE_AM].tail;
+		vdisk_cache_unlink(c, i);
+		vdisk_cache_release(c, i);
+	}
+	return c->entries[i].slot;
+}
+
+//
+// vdisk_cache_init
+//
+
+int vdisk_cache_init(VDISK_CACHE *c, uint64_t memory) {
+	uint64_t count = memory / VDISK_CACHE_BLOCKSIZE;
+	if (count == 0 || count > INT32_MAX / 4)
+		return 1;
+
+	c->count = (uint32_t)count;
+	c->kin = c->count / 4 ? c->count / 4 : 1;
+	c->kout = c->count / 2 ? c->count / 2 : 1;
+
+	uint32_t entries = c->count + c->kout;
+	uint32_t buckets = 1;
+	while (buckets < entries)
+		buckets <<= 1;
+	c->mask = buckets - 1;
+
+	c->data = malloc((size_t)c->count * VDISK_CACHE_BLOCKSIZE);
+	c->entries = malloc((size_t)entries * sizeof(VDISK_CACHE_ENTRY));
+	c->buckets = malloc((size_t)buckets * sizeof(int32_t));
+	c->slots = malloc((size_t)c->count * sizeof(uint32_t));
+	if (c->data == NULL || c->entries == NULL ||
+		c->buckets == NULL || c->slots == NULL) {
+		vdisk_cache_free(c);
+		return 1;
+	}
+
+	memset(c->buckets, 0xFF, (size_t)buckets * sizeof(int32_t));
+	for (uint32_t i = 0; i < entries; ++i) {
+		c->entries[i].list = VDISK_CACHE_FREE;
+		c->entries[i].next = i + 1 < entries ? (int32_t)i + 1 : -1;
+	}
+	c->unused = 0;
+	for (uint32_t i = 0; i < c->count; ++i)
+		c->slots[i] = c->count - 1 - i;
+	c->available = c->count;
+	for (int l = 0; l < 4; ++l) {
+		c->lists[l].head = c->lists[l].tail = -1;
+		c->lists[l].size = 0;
+	}
+	c->hits = c->misses = c->promotions = c->evictions = 0;
+
+	os_mutex_init(&c->mutex);
+	return 0;
+}
+
+//
+// vdisk_cache_free
+//
+
+void vdisk_cache_free(VDISK_CACHE *c) {
+	if (c->data && c->entries && c->buckets && c->slots)
+		os_mutex_destroy(&c->mutex);
+	free(c->data);
+	free(c->entries);
+	free(c->buckets);
+	free(c->slots);
+	c->data = NULL;
+	c->entries = NULL;
+	c->buckets = NULL;
+	c->slots = NULL;
+	c->count = 0;
+}
+
+//
+// vdisk_cache_read
+//
+
+int vdisk_cache_read(VDISK_CACHE *c, const void *owner, uint64_t block,
+	void *buffer, uint32_t offset, uint32_t length) {
+	os_mutex_lock(&c->mutex);
+
+	int32_t i = vdisk_cache_find(c, owner, block);
+	if (i < 0 || c->entries[i].list == VDISK_CACHE_A1OUT) {
+		++c->misses;
+		os_mutex_unlock(&c->mutex);
+		return 0;
+	}
+
+	// A1in is left in insertion order, so a burst of accesses to a new
+	// block does not promote it
+	if (c->entries[i].list == VDISK_CACHE_AM && c->lists[VDISK_CACHE_AM].head != i) {
+		vdisk_cache_unlink(c, i);
+		vdisk_cache_link(c, i, VDISK_CACHE_AM);
+	}
+
+	++c->hits;
+	memcpy(buffer,
+		c->data + (size_t)c->entries[i].slot * VDISK_CACHE_BLOCKSIZE + offset,
+		length);
+
+	os_mutex_unlock(&c->mutex);
+	return 1;
+}
+
+//
+// vdisk_cache_insert
+//
+
+void vdisk_cache_insert(VDISK_CACHE *c, const void *owner, uint64_t block, const void *data) {
+	os_mutex_lock(&c->mutex);
+
+	uint32_t list = VDISK_CACHE_A1IN;
+	int32_t i = vdisk_cache_find(c, owner, block);
+	if (i >= 0) {
+		if (c->entries[i].list != VDISK_CACHE_A1OUT) {
+			// Inserted by another thread in the meantime
+			os_mutex_unlock(&c->mutex);
+			return;
+		}
+		// Seen recently enough, this block is worth keeping
+		vdisk_cache_unlink(c, i);
+		vdisk_cache_unhash(c, i);
+		list = VDISK_CACHE_AM;
+		++c->promotions;
+	}
+
+	uint32_t slot = vdisk_cache_reclaim(c);
+
+	if (i < 0) {
+		i = c->unused;
+		c->unused = c->entries[i].next;
+	}
+
+	VDISK_CACHE_ENTRY *e = c->entries + i;
+	e->owner = owner;
+	e->block = block;
+	e->slot = slot;
+	uint32_t h = vdisk_cache_hash(c, owner, block);
+	e->hnext = c->buckets[h];
+	c->buckets[h] = i;
+	vdisk_cache_link(c, i, list);
+
+	memcpy(c->data + (size_t)slot * VDISK_CACHE_BLOCKSIZE, data, VDISK_CACHE_BLOCKSIZE);
+
+	os_mutex_unlock(&c->mutex);
+}
+
+//
+// vdisk_cache_drop
+//
+
+void vdisk_cache_drop(VDISK_CACHE *c, const void *owner, uint64_t block, uint64_t count) {
+	os_mutex_lock(&c->mutex);
+
+	uint32_t entries = c->count + c->kout;
+	for (uint32_t i = 0; i < entries; ++i) {
+		VDISK_CACHE_ENTRY *e = c->entries + i;
+		if (e->list == VDISK_CACHE_FREE || e->owner != owner ||
+			e->block < block || e->block - block >= count)
+			continue;
+		if (e->list != VDISK_CACHE_A1OUT)
+			c->slots[c->available++] = e->slot;
+		vdisk_cache_unlink(c, i);
+		vdisk_cache_release(c, i);
+	}
+
+	os_mutex_unlock(&c->mutex);
+}
+
+//
+// vdisk_table_cache_init
+//
+
+int vdisk_table_cache_init(VDISK_TABLE_CACHE *c, uint32_t size, uint64_t memory, uint32_t max) {
+	uint64_t count = memory / size;
+	if (count == 0)
+		count = 1;
+	else if (count > max)
+		count = max;
+
+	vdisk_table_cache_free(c);
+	c->tables = malloc((size_t)count * size);
+	c->keys = calloc((size_t)count, sizeof(uint64_t));
+	c->used = calloc((size_t)count, sizeof(uint64_t));
+	if (c->tables == NULL || c->keys == NULL || c->used == NULL) {
+		vdisk_table_cache_free(c);
+		return 1;
+	}
+	c->size = size;
+	c->count = (uint32_t)count;
+	return 0;
+}
+
+//
+// vdisk_table_cache_free
+//
+
+void vdisk_table_cache_free(VDISK_TABLE_CACHE *c) {
+	free(c->tables);
+	free(c->keys);
+	free(c->used);
+	c->tables = NULL;
+	c->keys = c->used = NULL;
+	c->clock = c->current = c->hits = c->misses = 0;
+	c->last = c->count = 0;
+}
+
+//
+// vdisk_table_cache_get
+//
+
+void* vdisk_table_cache_get(VDISK_TABLE_CACHE *c, __OSFILE fd, uint64_t offset) {
+	if (c->current == offset && offset) { // Table already returned
+		++c->hits;
+		return c->tables + ((size_t)c->last * c->size);
+	}
+
+	// Look for the table, or the least recently used slot
+	uint32_t victim = 0;
+	for (uint32_t i = 0; i < c->count; ++i) {
+		if (c->used[i] && c->keys[i] == offset) {
+			c->used[i] = ++c->clock;
+			c->current = offset;
+			c->last = i;
+			++c->hits;
+			return c->tables + ((size_t)i * c->size);
+		}
+		if (c->used[i] < c->used[victim])
+			victim = i;
+	}
+
+	++c->misses;
+	uint8_t *table = c->tables + ((size_t)victim * c->size);
+	if (os_pread(fd, table, c->size, offset)) {
+		c->used[victim] = 0;
+		c->current = 0;
+		return NULL;
+	}
+
+	c->keys[victim] = offset;
+	c->used[victim] = ++c->clock;
+	c->current = offset;
+	c->last = victim;
+	return table;
+}
@@ -0,0 +1,175 @@
+/**
+ * Block cache shared by VDISK handles, keyed by (handle, guest block).
+ *
+ * Guest data is cached in units of VDISK_CACHE_BLOCKSIZE bytes using the 2Q
+ * replacement policy (Johnson and Shasha, 1994). Blocks read once enter a
+ * small FIFO (A1in). When evicted from it, only their key is remembered in a
+ * ghost FIFO (A1out). Blocks requested again while their key is remembered
+ * enter the main LRU list (Am). A sequential sweep therefore only cycles
+ * through A1in and leaves the frequently used blocks in Am alone.
+ *
+ * All functions lock the cache, which can be shared between threads.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// Table cache, see below. Defined ahead of os.h since the format headers,
+// included through it, embed one.
+typedef struct VDISK_TABLE_CACHE {
+	uint8_t *tables;	// Cached tables, count * size bytes
+	uint64_t *keys;	// File offset of each cached table
+	uint64_t *used;	// Last use of each cached table, 0 if empty
+	uint64_t clock;	// Use counter
+	uint64_t current;	// File offset of the last returned table, 0 if none
+	uint64_t hits;	// Lookups served from the cache
+	uint64_t misses;	// Lookups needing a table read
+	uint32_t last;	// Slot of the last returned table
+	uint32_t size;	// Table size in bytes
+	uint32_t count;	// Number of cached tables
+} VDISK_TABLE_CACHE;
+
+#include "os.h"
+
+// Default memory budget for the block cache, can be defined at build time
+#ifndef VDISK_CACHE_MEMORY
+#define VDISK_CACHE_MEMORY	(16 * 1024 * 1024)
+#endif
+
+enum {
+	// Size of a cached guest block, in bytes
+	VDISK_CACHE_BLOCKSIZE	= 64 * 1024,
+	// Sectors per cached guest block
+	VDISK_CACHE_SECTORS	= VDISK_CACHE_BLOCKSIZE / 512,
+};
+
+enum {	// Cache entry lists
+	VDISK_CACHE_FREE,	// Entry not in use
+	VDISK_CACHE_A1IN,	// Resident, referenced once (FIFO)
+	VDISK_CACHE_A1OUT,	// Ghost, key only (FIFO)
+	VDISK_CACHE_AM,	// Resident, referenced again (LRU)
+};
+
+typedef struct VDISK_CACHE_ENTRY {
+	const void *owner;	// VDISK handle
+	uint64_t block;	// Guest block index
+	int32_t prev, next;	// List links, -1 terminated
+	int32_t hnext;	// Hash chain link, -1 terminated
+	uint32_t slot;	// Data slot, resident entries only
+	uint32_t list;	// See VDISK_CACHE enumeration
+} VDISK_CACHE_ENTRY;
+
+typedef struct VDISK_CACHE {
+	__OSMUTEX mutex;
+	uint8_t *data;	// Data slots, count * VDISK_CACHE_BLOCKSIZE
+	VDISK_CACHE_ENTRY *entries;	// Resident and ghost entries
+	int32_t *buckets;	// Hash buckets, -1 if empty
+	uint32_t *slots;	// Free data slots (stack)
+	uint32_t mask;	// Bucket index mask
+	uint32_t count;	// Number of data slots
+	uint32_t available;	// Number of free data slots
+	int32_t unused;	// Free entry list, -1 terminated
+	uint32_t kin;	// Target size of A1in
+	uint32_t kout;	// Maximum size of A1out
+	struct {
+		int32_t head;	// Newest or most recently used
+		int32_t tail;	// Oldest or least recently used
+		uint32_t size;
+	} lists[4];	// Indexed by the VDISK_CACHE enumeration
+	// Statistics
+	uint64_t hits;	// Requests served from memory
+	uint64_t misses;	// Requests that went to the backend
+	uint64_t promotions;	// Misses remembered in A1out, now in Am
+	uint64_t evictions;	// Blocks evicted from A1in or Am
+} VDISK_CACHE;
+
+/**
+ * Initiate a block cache.
+ *
+ * \param cache Cache structure
+ * \param memory Memory budget in bytes for cached data, at least
+ * VDISK_CACHE_BLOCKSIZE
+ *
+ * \returns Non-zero on error
+ */
+int vdisk_cache_init(VDISK_CACHE *cache, uint64_t memory);
+
+/**
+ * Free the memory held by a block cache. Handles using it must not be read
+ * from anymore.
+ */
+void vdisk_cache_free(VDISK_CACHE *cache);
+
+/**
+ * Copy a part of a cached block and count a hit or a miss.
+ *
+ * \param cache Cache structure
+ * \param owner VDISK handle
+ * \param block Guest block index
+ * \param buffer Destination buffer
+ * \param offset Byte offset within the block
+ * \param length Number of bytes to copy
+ *
+ * \returns Non-zero if the block was cached and copied
+ */
+int vdisk_cache_read(VDISK_CACHE *cache, const void *owner, uint64_t block,
+	void *buffer, uint32_t offset, uint32_t length);
+
+/**
+ * Insert a block read from the backend, evicting as needed.
+ *
+ * \param cache Cache structure
+ * \param owner VDISK handle
+ * \param block Guest block index
+ * \param data Block data, VDISK_CACHE_BLOCKSIZE bytes
+ */
+void vdisk_cache_insert(VDISK_CACHE *cache, const void *owner, uint64_t block, const void *data);
+
+/**
+ * Forget a range of blocks of a handle, including ghost entries.
+ *
+ * \param cache Cache structure
+ * \param owner VDISK handle
+ * \param block First guest block index
+ * \param count Number of blocks, UINT64_MAX for all remaining blocks
+ */
+void vdisk_cache_drop(VDISK_CACHE *cache, const void *owner, uint64_t block, uint64_t count);
+
+//
+// Table cache
+//
+// Metadata tables of the same size read from an image (e.g. QED L2 tables,
+// VMDK grain tables, QCOW2 L2 slices) are cached by file offset, the least
+// recently used table being replaced. A table cache belongs to one handle
+// and is not locked.
+//
+
+/**
+ * (Re)size a table cache to fit within a memory budget, holding at least one
+ * table and at most max tables. Cached tables and counters are reset.
+ *
+ * \param cache Table cache structure, zeroed or previously initiated
+ * \param size Table size in bytes
+ * \param memory Memory budget in bytes
+ * \param max Maximum number of tables
+ *
+ * \returns Non-zero on error
+ */
+int vdisk_table_cache_init(VDISK_TABLE_CACHE *cache, uint32_t size, uint64_t memory, uint32_t max);
+
+/**
+ * Free the memory held by a table cache. It can be initiated again.
+ */
+void vdisk_table_cache_free(VDISK_TABLE_CACHE *cache);
+
+/**
+ * Get a table, reading it from the file if it is not cached.
+ *
+ * \param cache Table cache structure
+ * \param fd File to read from
+ * \param offset File offset of the table
+ *
+ * \returns Table, or NULL if it could not be read
+ */
+void* vdisk_table_cache_get(VDISK_TABLE_CACHE *cache, __OSFILE fd, uint64_t offset);
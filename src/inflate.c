@@ -0,0 +1,352 @@
+#include <string.h> // memcpy, memset
+#include "inflate.h"
+
+enum {
+	INFLATE_FAST_BITS	= 10,	// Codes decoded with one table lookup
+	INFLATE_MAX_BITS	= 15,	// Longest code
+	INFLATE_LITLEN	= 288,	// Literal/length codes
+	INFLATE_DIST	= 30,	// Distance codes
+};
+
+typedef struct {
+	uint16_t fast[1 << INFLATE_FAST_BITS];	// (symbol << 4) | length, 0 if longer
+	uint16_t count[INFLATE_MAX_BITS + 1];	// Number of codes per length
+	uint16_t symbol[INFLATE_LITLEN];	// Symbols ordered by code
+} inflate_huff;
+
+typedef struct {
+	const uint8_t *in, *inend;
+	uint8_t *out, *outstart, *outend;
+	uint64_t bits;	// Bit buffer, LSB first
+	uint32_t nbits;	// Bits in buffer
+} inflate_state;
+
+static const uint16_t inflate_lbase[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t inflate_lextra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t inflate_dbase[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+	8193, 12289, 16385, 24577 };
+static const uint8_t inflate_dextra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t inflate_clorder[19] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+static inline void inflate_refill(inflate_state *s) {
+	while (s->nbits <= 56 && s->in < s->inend) {
+		s->bits |= (uint64_t)*s->in++ << s->nbits;
+		s->nbits += 8;
+	}
+}
+
+// Get n bits (n <= 32), -1 if the input is exhausted
+static inline int64_t inflate_bits(inflate_state *s, uint32_t n) {
+	if (s->nbits < n) {
+		inflate_refill(s);
+		if (s->nbits < n)
+			return -1;
+	}
+	uint32_t v = (uint32_t)(s->bits & ((1ull << n) - 1));
+	s->bits >>= n;
+	s->nbits -= n;
+	return v;
+}
+
+// Build a canonical Huffman decoding table from code lengths
+static int inflate_build(inflate_huff *h, const uint8_t *lengths, uint32_t n) {
+	uint16_t offs[INFLATE_MAX_BITS + 2];
+
+	memset(h->count, 0, sizeof(h->count));
+	memset(h->fast, 0, sizeof(h->fast));
+	for (uint32_t i = 0; i < n; ++i)
+		++h->count[lengths[i]];
+	h->count[0] = 0;
+
+	// Reject over-subscribed codes, incomplete codes are allowed
+	int left = 1;
+	for (uint32_t len = 1; len <= INFLATE_MAX_BITS; ++len) {
+		left <<= 1;
+		left -= h->count[len];
+		if (left < 0)
+			return INFLATE_EDATA;
+	}
+
+	offs[1] = 0;
+	for (uint32_t len = 1; len <= INFLATE_MAX_BITS; ++len)
+		offs[len + 1] = offs[len] + h->count[len];
+	for (uint32_t i = 0; i < n; ++i)
+		if (lengths[i])
+			h->symbol[offs[lengths[i]]++] = (uint16_t)i;
+
+	// Fast table, indexed by bit-reversed codes
+	uint32_t code = 0, index = 0;
+	for (uint32_t len = 1; len <= INFLATE_FAST_BITS; ++len) {
+		for (uint32_t i = 0; i < h->count[len]; ++i, ++code, ++index) {
+			uint32_t rev = 0;
+			for (uint32_t b = 0; b < len; ++b)
+				rev |= ((code >> b) & 1) << (len - 1 - b);
+			uint16_t entry = (uint16_t)((h->symbol[index] << 4) | len);
+			for (uint32_t r = rev; r < (1u << INFLATE_FAST_BITS); r += 1u << len)
+				h->fast[r] = entry;
+		}
+		code <<= 1;
+	}
+
+	return 0;
+}
+
+// Decode a symbol
+static inline int inflate_decode(inflate_state *s, const inflate_huff *h) {
+	if (s->nbits < INFLATE_MAX_BITS)
+		inflate_refill(s);
+
+	uint16_t entry = h->fast[s->bits & ((1 << INFLATE_FAST_BITS) - 1)];
+	if (entry) {
+		uint32_t len = entry & 15;
+		if (len > s->nbits)
+			return INFLATE_EINPUT;
+		s->bits >>= len;
+		s->nbits -= len;
+		return entry >> 4;
+	}
+
+	// Canonical decoding, one bit at a time
+	int code = 0, first = 0, index = 0;
+	for (uint32_t len = 1; len <= INFLATE_MAX_BITS; ++len) {
+		if (len > s->nbits)
+			return INFLATE_EINPUT;
+		code |= (s->bits >> (len - 1)) & 1;
+		int count = h->count[len];
+		if (code - count < first) {
+			s->bits >>= len;
+			s->nbits -= len;
+			return h->symbol[index + (code - first)];
+		}
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+	return INFLATE_EDATA;
+}
+
+// Decode a compressed block with the given tables
+static int inflate_codes(inflate_state *s, const inflate_huff *lit, const inflate_huff *dist) {
+	for (;;) {
+		int sym = inflate_decode(s, lit);
+		if (sym < 0)
+			return sym;
+		if (sym < 256) {
+			if (s->out >= s->outend)
+				return INFLATE_EOUTPUT;
+			*s->out++ = (uint8_t)sym;
+			continue;
+		}
+		if (sym == 256)
+			return 0;
+
+		sym -= 257;
+		if (sym >= 29)
+			return INFLATE_EDATA;
+		int64_t extra = inflate_bits(s, inflate_lextra[sym]);
+		if (extra < 0)
+			return INFLATE_EINPUT;
+		size_t len = inflate_lbase[sym] + (size_t)extra;
+
+		int dsym = inflate_decode(s, dist);
+		if (dsym < 0)
+			return dsym;
+		if (dsym >= 30)
+			return INFLATE_EDATA;
+		extra = inflate_bits(s, inflate_dextra[dsym]);
+		if (extra < 0)
+			return INFLATE_EINPUT;
+		size_t d = inflate_dbase[dsym] + (size_t)extra;
+
+		if (d > (size_t)(s->out - s->outstart))
+			return INFLATE_EDATA;
+		if (len > (size_t)(s->outend - s->out))
+			return INFLATE_EOUTPUT;
+
+		// Overlapping copies repeat the pattern
+		uint8_t *src = s->out - d;
+		if (d >= len) {
+			memcpy(s->out, src, len);
+			s->out += len;
+		} else {
+			while (len--)
+				*s->out++ = *src++;
+		}
+	}
+}
+
+static int inflate_stored(inflate_state *s) {
+	// Discard bits up to the byte boundary, then return buffered bytes
+	s->bits >>= s->nbits & 7;
+	s->nbits &= ~7u;
+	s->in -= s->nbits >> 3;
+	s->bits = 0;
+	s->nbits = 0;
+
+	if (s->inend - s->in < 4)
+		return INFLATE_EINPUT;
+	uint32_t len = s->in[0] | (s->in[1] << 8);
+	uint32_t nlen = s->in[2] | (s->in[3] << 8);
+	if (len != (~nlen & 0xFFFF))
+		return INFLATE_EDATA;
+	s->in += 4;
+	if ((size_t)(s->inend - s->in) < len)
+		return INFLATE_EINPUT;
+	if ((size_t)(s->outend - s->out) < len)
+		return INFLATE_EOUTPUT;
+	memcpy(s->out, s->in, len);
+	s->in += len;
+	s->out += len;
+	return 0;
+}
+
+static int inflate_fixed(inflate_state *s) {
+	inflate_huff lit, dist;
+	uint8_t lengths[INFLATE_LITLEN];
+	uint32_t i = 0;
+	for (; i < 144; ++i) lengths[i] = 8;
+	for (; i < 256; ++i) lengths[i] = 9;
+	for (; i < 280; ++i) lengths[i] = 7;
+	for (; i < 288; ++i) lengths[i] = 8;
+	inflate_build(&lit, lengths, INFLATE_LITLEN);
+	for (i = 0; i < INFLATE_DIST; ++i) lengths[i] = 5;
+	inflate_build(&dist, lengths, INFLATE_DIST);
+	return inflate_codes(s, &lit, &dist);
+}
+
+static int inflate_dynamic(inflate_state *s) {
+	inflate_huff lit, dist;
+	uint8_t lengths[INFLATE_LITLEN + INFLATE_DIST];
+
+	int64_t nlen = inflate_bits(s, 5);
+	int64_t ndist = inflate_bits(s, 5);
+	int64_t ncode = inflate_bits(s, 4);
+	if (nlen < 0 || ndist < 0 || ncode < 0)
+		return INFLATE_EINPUT;
+	nlen += 257;
+	ndist += 1;
+	ncode += 4;
+	if (nlen > 286 || ndist > 30)
+		return INFLATE_EDATA;
+
+	memset(lengths, 0, 19);
+	for (uint32_t i = 0; i < ncode; ++i) {
+		int64_t v = inflate_bits(s, 3);
+		if (v < 0)
+			return INFLATE_EINPUT;
+		lengths[inflate_clorder[i]] = (uint8_t)v;
+	}
+	if (inflate_build(&lit, lengths, 19))
+		return INFLATE_EDATA;
+
+	uint32_t n = (uint32_t)(nlen + ndist);
+	for (uint32_t i = 0; i < n;) {
+		int sym = inflate_decode(s, &lit);
+		if (sym < 0)
+			return sym;
+		if (sym < 16) {
+			lengths[i++] = (uint8_t)sym;
+			continue;
+		}
+
+		uint8_t len = 0;
+		int64_t rep;
+		switch (sym) {
+		case 16:
+			if (i == 0)
+				return INFLATE_EDATA;
+			len = lengths[i - 1];
+			rep = inflate_bits(s, 2);
+			if (rep < 0) return INFLATE_EINPUT;
+			rep += 3;
+			break;
+		case 17:
+			rep = inflate_bits(s, 3);
+			if (rep < 0) return INFLATE_EINPUT;
+			rep += 3;
+			break;
+		default:
+			rep = inflate_bits(s, 7);
+			if (rep < 0) return INFLATE_EINPUT;
+			rep += 11;
+			break;
+		}
+		if (i + rep > n)
+			return INFLATE_EDATA;
+		while (rep--)
+			lengths[i++] = len;
+	}
+
+	if (lengths[256] == 0) // End-of-block code is required
+		return INFLATE_EDATA;
+	if (inflate_build(&lit, lengths, (uint32_t)nlen) ||
+		inflate_build(&dist, lengths + nlen, (uint32_t)ndist))
+		return INFLATE_EDATA;
+
+	return inflate_codes(s, &lit, &dist);
+}
+
+//
+// inflate_raw
+//
+
+int inflate_raw(void *out, size_t outsize, size_t *outlen, const void *in, size_t insize) {
+	inflate_state s;
+	s.in = in;
+	s.inend = s.in + insize;
+	s.out = s.outstart = out;
+	s.outend = s.out + outsize;
+	s.bits = 0;
+	s.nbits = 0;
+
+	int64_t last;
+	do {
+		last = inflate_bits(&s, 1);
+		int64_t type = inflate_bits(&s, 2);
+		if (last < 0 || type < 0)
+			return INFLATE_EINPUT;
+
+		int e;
+		switch (type) {
+		case 0: e = inflate_stored(&s); break;
+		case 1: e = inflate_fixed(&s); break;
+		case 2: e = inflate_dynamic(&s); break;
+		default: return INFLATE_EDATA;
+		}
+		if (e)
+			return e;
+	} while (last == 0);
+
+	if (outlen)
+		*outlen = s.out - s.outstart;
+	return INFLATE_EOK;
+}
+
+//
+// inflate_zlib
+//
+
+int inflate_zlib(void *out, size_t outsize, size_t *outlen, const void *in, size_t insize) {
+	const uint8_t *p = in;
+
+	// CMF: CM=8 (deflate), CINFO <= 7; FCHECK makes CMF.FLG a multiple of 31
+	if (insize >= 2 && (p[0] & 0x0F) == 8 && (p[0] >> 4) <= 7 &&
+		((p[0] << 8) | p[1]) % 31 == 0) {
+		if (p[1] & 0x20) // Preset dictionary
+			return INFLATE_EDATA;
+		p += 2;
+		insize -= 2;
+	}
+
+	return inflate_raw(out, outsize, outlen, p, insize);
+}
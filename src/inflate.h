@@ -0,0 +1,45 @@
+/**
+ * DEFLATE (RFC 1951) decoder, with optional zlib (RFC 1950) wrapper.
+ * 
+ * Only decoding is supported, into a bounded memory buffer. The decoder
+ * keeps no global state and can be used from several threads at once.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum {
+	INFLATE_EOK	= 0,	// Success
+	INFLATE_EINPUT	= -1,	// Input is truncated
+	INFLATE_EOUTPUT	= -2,	// Output buffer is too small
+	INFLATE_EDATA	= -3,	// Invalid data
+};
+
+/**
+ * Decode a raw DEFLATE stream.
+ * 
+ * \param out Output buffer
+ * \param outsize Output buffer size
+ * \param outlen Decoded size, can be NULL
+ * \param in Input buffer
+ * \param insize Input size
+ * 
+ * \returns INFLATE_EOK on success
+ */
+int inflate_raw(void *out, size_t outsize, size_t *outlen, const void *in, size_t insize);
+
+/**
+ * Decode a DEFLATE stream, skipping a zlib header if present. The Adler-32
+ * trailer is not verified.
+ * 
+ * \param out Output buffer
+ * \param outsize Output buffer size
+ * \param outlen Decoded size, can be NULL
+ * \param in Input buffer
+ * \param insize Input size
+ * 
+ * \returns INFLATE_EOK on success
+ */
+int inflate_zlib(void *out, size_t outsize, size_t *outlen, const void *in, size_t insize);
@@ -57,6 +57,7 @@ void test() {
 	"sizeof	QED_HDR		%u\n"
 	"sizeof	QCOW_HDR	%u\n"
 	"sizeof	PHDD_HDR	%u\n"
+	"sizeof	BOCH_HDR	%u+%u\n"
 	"sizeof	wchar_t		%u\n"
 	"Running tests...\n",
 	(int)sizeof(VDISK),
@@ -67,6 +68,7 @@ void test() {
 	(int)sizeof(QED_HDR),
 	(int)sizeof(QCOW_HDR),
 	(int)sizeof(PHDD_HDR),
+	(int)sizeof(BOCH_HDR), (int)sizeof(BOCH_REDOLOG_HDR),
 	(int)sizeof(wchar_t)
 	);
 	assert(sizeof(MBR) == 512);
@@ -89,17 +91,35 @@ void test() {
 	assert(sizeof(VHD_DYN_HDR) == 1024);
 	// VHDX
 	assert(sizeof(VHDX_HDR) == 520);
-	assert(sizeof(VHDX_HEADER1) == 76);
+	assert(sizeof(VHDX_HEADER1) == 80);
 	assert(sizeof(VHDX_REGION_HDR) == 16);
 	assert(sizeof(VHDX_REGION_ENTRY) == 32);
 	assert(sizeof(VHDX_LOG_HDR) == 64);
 	assert(sizeof(VHDX_LOG_ZERO) == 32);
 	assert(sizeof(VDHX_LOG_DESC) == 32);
-	assert(sizeof(VHDX_LOG_DATA) == 4100);
+	assert(sizeof(VHDX_LOG_DATA) == 4096);
+	// Parallels
+	assert(sizeof(PHDD_HDR) == 64);
+	// Bochs
+	assert(sizeof(BOCH_HDR) == 72);
+	assert(sizeof(BOCH_REDOLOG_HDR) == 24);
 	// utils
 	assert(bswap16(0xAABB) == 0xBBAA);
 	assert(bswap32(0xAABBCCDD) == 0xDDCCBBAA);
 	assert(bswap64(0xAABBCCDD11223344) == 0x44332211DDCCBBAA);
+	printf("iszero		%s\n", iszero_name());
+	{
+		uint8_t zb[1000];
+		memset(zb, 0, sizeof(zb));
+		assert(iszero(zb, sizeof(zb)));
+		assert(iszero(zb + 3, sizeof(zb) - 3));
+		for (size_t i = 0; i < sizeof(zb); i += 37) {
+			zb[i] = 1;
+			assert(iszero(zb, sizeof(zb)) == 0);
+			assert(iszero(zb, i) && iszero(zb + i + 1, sizeof(zb) - i - 1));
+			zb[i] = 0;
+		}
+	}
 #ifdef _WIN32
 	assert(extcmp(L"test.bin", L"bin"));
 #else
@@ -118,6 +138,7 @@ static void help() {
 	puts(
 	"Manage virtual disks\n"
 	"  Usage: vvd OPERATION [FILE] [OPTIONS]\n"
+	"         vvd convert FILE OUTPUT [OPTIONS]\n"
 	"         vvd PAGE\n"
 	"         vvd {--help|--version|--license}\n"
 	"\n"
@@ -126,6 +147,7 @@ static void help() {
 	"  new        Create new empty vdisk\n"
 	"  map        Show allocation map\n"
 	"  compact    Compact vdisk image\n"
+	"  convert    Convert vdisk image into a new vdisk image\n"
 	"\n"
 	"PAGES\n"
 	"  help       Show help page and exit\n"
@@ -134,10 +156,19 @@ static void help() {
 	"  license    Show license page and exit\n"
 	"\n"
 	"OPTIONS\n"
-	"  --raw           Open as RAW\n"
-	"  --create-raw    Create as RAW\n"
-	"  --create-dyn    Create vdisk as dynamic\n"
-	"  --create-fixed  Create vdisk as fixed\n"
+	"  --raw             Open as RAW\n"
+	"  --mmap            Map allocation tables in memory\n"
+	"  --replay          Replay a pending VHDX log into the file\n"
+	"  --direct          Bypass the OS cache with direct I/O\n"
+	"  --create-raw      Create as RAW\n"
+	"  --create-dyn      Create vdisk as dynamic\n"
+	"  --create-fixed    Create vdisk as fixed\n"
+	"  --create-sparse   Preallocate fixed data sparsely (raw default)\n"
+	"  --create-reserve  Preallocate fixed data on disk (fixed default)\n"
+	"  --create-zero     Preallocate fixed data by writing zeros\n"
+	"  --progress        Show a progress bar\n"
+	"  --threads N       Number of reader threads (convert)\n"
+	"  --map-csv         Print allocation map as CSV (map)\n"
 	);
 	exit(EXIT_SUCCESS);
 }
@@ -159,14 +190,15 @@ static void version(void) {
 #endif
 	"\n\n"
 	"FORMAT	OPERATIONS\n"
-	"VDI	info, map, new, compact\n"
-	"VMDK	info\n"
-	"VHD	info, map\n"
-	"VHDX	\n"
-	"QED	info, map\n"
-	"QCOW	\n"
-	"PHDD	\n"
-	"RAW	info\n"
+	"VDI	info, map, new, compact, convert\n"
+	"VMDK	info, map, convert (from)\n"
+	"VHD	info, map, convert (from)\n"
+	"VHDX	info, map, convert (from)\n"
+	"QED	info, map, convert (from)\n"
+	"QCOW	info, map, new, convert\n"
+	"PHDD	info, map, convert (from)\n"
+	"BOCHS	info, map, convert (from)\n"
+	"RAW	info, convert\n"
 	);
 	exit(EXIT_SUCCESS);
 }
@@ -206,7 +238,7 @@ static void license() {
  * 
  * \returns VDISK_FORMAT enum
  */
-static int vdextauto(const oschar *path) {
+static uint32_t vdextauto(const oschar *path) {
 	if (extcmp(path, osstr("vdi")))	return VDISK_FORMAT_VDI;
 	if (extcmp(path, osstr("vmdk")))	return VDISK_FORMAT_VMDK;
 	if (extcmp(path, osstr("vhd")))	return VDISK_FORMAT_VHD;
@@ -230,7 +262,9 @@ MAIN {
 	VDISK vdin;	// vdisk IN
 	VDISK vdout;	// vdisk OUT
 	uint64_t vsize = 0;	// virtual disk size, used in 'new' and 'resize'
+	uint32_t threads = 0;	// reader threads, used in 'convert'
 	const oschar *defopt = NULL;	// Default option for input file
+	const oschar *defout = NULL;	// Second default option for output file
 
 	// Additional arguments are processed first, since they're simpler
 	//TODO: --verbose: prints those extra lines (>v0.10.0)
@@ -251,10 +285,27 @@ MAIN {
 			}
 			continue;
 		}
-		if (oscmp(arg, osstr("--size")) == 0) {
+		if (oscmp(arg, osstr("--progress")) == 0) {
 			mflags |= VVD_PROGRESS;
 			continue;
 		}
+		if (oscmp(arg, osstr("--threads")) == 0) {
+			if (argi + 1 >= argc) {
+				fputs("main: missing argument for --threads\n", stderr);
+				return EXIT_FAILURE;
+			}
+			unsigned int n;
+#ifdef _WIN32
+			if (swscanf(argv[++argi], L"%u", &n) != 1 || n == 0 || n > 256) {
+#else
+			if (sscanf(argv[++argi], "%u", &n) != 1 || n == 0 || n > 256) {
+#endif
+				fputs("main: invalid thread count\n", stderr);
+				return EXIT_FAILURE;
+			}
+			threads = n;
+			continue;
+		}
 		//
 		// vdisk_open flags
 		//
@@ -262,6 +313,19 @@ MAIN {
 			oflags |= VDISK_RAW;
 			continue;
 		}
+		if (oscmp(arg, osstr("--mmap")) == 0) {
+			oflags |= VDISK_OPEN_MMAP;
+			continue;
+		}
+		if (oscmp(arg, osstr("--replay")) == 0) {
+			oflags |= VDISK_OPEN_LOG_REPLAY;
+			continue;
+		}
+		if (oscmp(arg, osstr("--direct")) == 0) {
+			oflags |= VDISK_OPEN_DIRECT;
+			cflags |= VDISK_CREATE_DIRECT;
+			continue;
+		}
 		//
 		// vdisk_create flags
 		//
@@ -277,6 +341,18 @@ MAIN {
 			cflags |= VDISK_CREATE_TYPE_FIXED;
 			continue;
 		}
+		if (oscmp(arg, osstr("--create-sparse")) == 0) {
+			cflags = (cflags & ~VDISK_CREATE_ALLOC_MASK) | VDISK_CREATE_SPARSE;
+			continue;
+		}
+		if (oscmp(arg, osstr("--create-reserve")) == 0) {
+			cflags = (cflags & ~VDISK_CREATE_ALLOC_MASK) | VDISK_CREATE_RESERVE;
+			continue;
+		}
+		if (oscmp(arg, osstr("--create-zero")) == 0) {
+			cflags = (cflags & ~VDISK_CREATE_ALLOC_MASK) | VDISK_CREATE_ZERO;
+			continue;
+		}
 		//
 		// vvd_info flags
 		//
@@ -285,12 +361,23 @@ MAIN {
 			continue;
 		}
 		//
+		// vvd_map flags
+		//
+		if (oscmp(arg, osstr("--map-csv")) == 0) {
+			mflags |= VVD_MAP_CSV;
+			continue;
+		}
+		//
 		// Default argument
 		//
 		if (defopt == NULL) {
 			defopt = arg;
 			continue;
 		}
+		if (defout == NULL) {
+			defout = arg;
+			continue;
+		}
 
 		fprintf(stderr, "main: '" OSCHARFMT "' unknown option\n", arg);
 		return EXIT_FAILURE;
@@ -311,7 +398,19 @@ MAIN {
 			vdisk_perror(&vdin);
 			return vdin.err.num;
 		}
-		return vvd_info(&vdin, mflags);
+		// Partition tables are read sector by sector, but only touch a
+		// few blocks (MBR, GPT headers and entries, EBR chain). The cache
+		// holds a mutex, so it is allocated.
+		VDISK_CACHE *cache = malloc(sizeof(VDISK_CACHE));
+		if (cache && vdisk_cache_init(cache, 4 * VDISK_CACHE_BLOCKSIZE) == 0)
+			vdin.cache = cache;
+		int e = vvd_info(&vdin, mflags);
+		if (vdin.cache) {
+			vdin.cache = NULL;
+			vdisk_cache_free(cache);
+		}
+		free(cache);
+		return e;
 	}
 
 	if (oscmp(action, osstr("map")) == 0) {
@@ -323,7 +422,7 @@ MAIN {
 			vdisk_perror(&vdin);
 			return vdin.err.num;
 		}
-		return vvd_map(&vdin, 0);
+		return vvd_map(&vdin, mflags);
 	}
 
 	if (oscmp(action, osstr("compact")) == 0) {
@@ -331,15 +430,11 @@ MAIN {
 			fputs("main: missing vdisk\n", stderr);
 			return EXIT_FAILURE;
 		}
-		if (vdisk_open(&vdin, defopt, 0)) {
-			vdisk_perror(&vdin);
-			return vdin.err.num;
-		}
-		if (vvd_compact(&vdin, 0)) {
+		if (vdisk_open(&vdin, defopt, oflags & VDISK_OPEN_DIRECT)) {
 			vdisk_perror(&vdin);
 			return vdin.err.num;
 		}
-		return EXIT_FAILURE;
+		return vvd_compact(&vdin, mflags);
 	}
 
 	if (oscmp(action, osstr("defrag")) == 0) {
@@ -357,8 +452,8 @@ MAIN {
 			return EXIT_FAILURE;
 		}
 
-		// Get vdisk type out of extension name
-		int format = vdextauto(defopt);
+		// Get vdisk type out of extension name, unless raw
+		uint32_t format = cflags & VDISK_RAW ? VDISK_FORMAT_RAW : vdextauto(defopt);
 		if (format == VDISK_FORMAT_NONE) {
 			fputs("main: unknown extension\n", stderr);
 			return EXIT_FAILURE;
@@ -378,8 +473,29 @@ MAIN {
 	}
 
 	if (oscmp(action, osstr("convert")) == 0) {
-		fputs("main: not implemented\n", stderr);
-		return EXIT_FAILURE;
+		if (defopt == NULL) {
+			fputs("main: missing vdisk\n", stderr);
+			return EXIT_FAILURE;
+		}
+		if (defout == NULL) {
+			fputs("main: missing output path specifier\n", stderr);
+			return EXIT_FAILURE;
+		}
+
+		// Get output vdisk type out of extension name, unless raw
+		uint32_t format = cflags & VDISK_RAW ? VDISK_FORMAT_RAW : vdextauto(defout);
+		if (format == VDISK_FORMAT_NONE) {
+			fputs("main: unknown extension\n", stderr);
+			return EXIT_FAILURE;
+		}
+
+		if (vdisk_open(&vdin, defopt, oflags)) {
+			vdisk_perror(&vdin);
+			return vdin.err.num;
+		}
+		int e = vvd_convert(&vdin, defout, format, cflags, threads, mflags);
+		vdisk_close(&vdin);
+		return e;
 	}
 
 	if (oscmp(action, osstr("upgrade")) == 0) {
@@ -1,12 +1,23 @@
+#ifndef _WIN32
+#define _GNU_SOURCE	// pread, pwrite, sysconf
+#endif
 #include <stdio.h>
 #include "os.h"
-#ifndef _WIN32
 #include <string.h>	// memset
+#ifndef _WIN32
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <linux/fs.h>
 #endif
 
+#if defined(__linux__) && !defined(OS_NO_URING)
+#define OS_URING 1
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
 //
 // os_fopen
 //
@@ -50,13 +61,160 @@ __OSFILE os_fcreate(const oschar *path) {
 	if (fd == INVALID_HANDLE_VALUE)
 		return 0;
 #else
-	__OSFILE fd = open(path, O_RDWR | O_CREAT | O_TRUNC);
+	__OSFILE fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
 	if (fd == -1)
 		return 0;
 #endif
 	return fd;
 }
 
+//
+// Direct I/O (internal)
+//
+
+// Handles opened with os_fopen_direct or os_fcreate_direct
+static __OSFILE os_i_direct[OS_DIRECT_MAX];
+static uint32_t os_i_ndirect;
+// Bounce buffers for transfers not meeting the direct I/O alignment
+static struct os_apool_t *os_i_bounce;
+
+static int os_i_isdirect(__OSFILE fd) {
+	for (uint32_t i = 0; i < os_i_ndirect; ++i)
+		if (os_i_direct[i] == fd)
+			return 1;
+	return 0;
+}
+
+// Check that a direct transfer works and register the handle. The handle is
+// closed on failure, so the file can be opened again without direct I/O.
+static __OSFILE os_i_direct_add(__OSFILE fd) {
+	if (os_i_bounce == NULL) {
+		struct os_apool_t *pool = malloc(sizeof(struct os_apool_t));
+		if (pool == NULL)
+			goto L_ERR;
+		if (os_apool_init(pool, OS_DIRECT_POOL, OS_DIRECT_BOUNCE)) {
+			free(pool);
+			goto L_ERR;
+		}
+		os_i_bounce = pool;
+	}
+	if (os_i_ndirect >= OS_DIRECT_MAX)
+		goto L_ERR;
+
+	// Some filesystems accept the flag when opening but fail transfers
+	void *probe = os_apool_get(os_i_bounce);
+#ifdef _WIN32
+	OVERLAPPED ov;
+	DWORD r;
+	memset(&ov, 0, sizeof(ov));
+	int e = ReadFile(fd, probe, OS_DIRECT_ALIGN, &r, &ov) == 0 &&
+		GetLastError() != ERROR_HANDLE_EOF;
+#else
+	int e = pread(fd, probe, OS_DIRECT_ALIGN, 0) == -1;
+#endif
+	os_apool_put(os_i_bounce, probe);
+	if (e)
+		goto L_ERR;
+
+	os_i_direct[os_i_ndirect++] = fd;
+	return fd;
+
+L_ERR:
+	os_fclose(fd);
+	return 0;
+}
+
+//
+// os_fopen_direct
+//
+
+__OSFILE os_fopen_direct(const oschar *path) {
+#ifdef _WIN32
+	__OSFILE fd = CreateFileW(
+		path,	// lpFileName
+		GENERIC_READ | GENERIC_WRITE,	// dwDesiredAccess
+		0,	// dwShareMode
+		NULL,	// lpSecurityAttributes
+		OPEN_EXISTING,	// dwCreationDisposition
+		FILE_FLAG_NO_BUFFERING,	// dwFlagsAndAttributes
+		NULL	// hTemplateFile
+	);
+	if (fd == INVALID_HANDLE_VALUE)
+		return 0;
+#elif defined(O_DIRECT)
+	__OSFILE fd = open(path, O_RDWR | O_DIRECT);
+	if (fd == -1)
+		return 0;
+#elif defined(F_NOCACHE)
+	__OSFILE fd = open(path, O_RDWR);
+	if (fd == -1)
+		return 0;
+	if (fcntl(fd, F_NOCACHE, 1) == -1) {
+		close(fd);
+		return 0;
+	}
+#else
+	return 0;
+#endif
+	return os_i_direct_add(fd);
+}
+
+//
+// os_fcreate_direct
+//
+
+__OSFILE os_fcreate_direct(const oschar *path) {
+#ifdef _WIN32
+	__OSFILE fd = CreateFileW(
+		path,	// lpFileName
+		GENERIC_READ | GENERIC_WRITE,	// dwDesiredAccess
+		0,	// dwShareMode
+		NULL,	// lpSecurityAttributes
+		CREATE_ALWAYS,	// dwCreationDisposition
+		FILE_FLAG_NO_BUFFERING,	// dwFlagsAndAttributes
+		NULL	// hTemplateFile
+	);
+	if (fd == INVALID_HANDLE_VALUE)
+		return 0;
+#elif defined(O_DIRECT)
+	__OSFILE fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+	if (fd == -1)
+		return 0;
+#elif defined(F_NOCACHE)
+	__OSFILE fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1)
+		return 0;
+	if (fcntl(fd, F_NOCACHE, 1) == -1) {
+		close(fd);
+		return 0;
+	}
+#else
+	return 0;
+#endif
+	return os_i_direct_add(fd);
+}
+
+//
+// os_fclose
+//
+
+int os_fclose(__OSFILE fd) {
+	for (uint32_t i = 0; i < os_i_ndirect; ++i) {
+		if (os_i_direct[i] == fd) {
+			os_i_direct[i] = os_i_direct[--os_i_ndirect];
+			break;
+		}
+	}
+#ifdef _WIN32
+	if (CloseHandle(fd) == 0)
+		return -1;
+#else
+	if (close(fd))
+		return -1;
+#endif
+	return 0;
+}
+
 //
 // os_fseek
 //
@@ -74,11 +232,171 @@ int os_fseek(__OSFILE fd, int64_t pos, int flags) {
 	return 0;
 }
 
+// Read at a position. With a direct handle, a short transfer means the end
+// of the file was reached, since the next one would not be aligned.
+static int os_i_pread(__OSFILE fd, void *buffer, size_t size, uint64_t pos, int direct) {
+	uint8_t *buf = buffer;
+	while (size) {
+#ifdef _WIN32
+		OVERLAPPED ov;
+		DWORD r;
+		DWORD s = size > 0x40000000 ? 0x40000000 : (DWORD)size;
+		memset(&ov, 0, sizeof(ov));
+		ov.Offset = (DWORD)pos;
+		ov.OffsetHigh = (DWORD)(pos >> 32);
+		if (ReadFile(fd, buf, s, &r, &ov) == 0) {
+			if (GetLastError() != ERROR_HANDLE_EOF)
+				return -1;
+			r = 0;
+		}
+#else
+		ssize_t r = pread(fd, buf, size, (off_t)pos);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+#endif
+		if (r == 0 || (direct && r % OS_DIRECT_ALIGN)) { // EOF
+			buf += r;
+			size -= r;
+			memset(buf, 0, size);
+			break;
+		}
+		buf += r;
+		pos += r;
+		size -= r;
+	}
+	return 0;
+}
+
+// Write at a position
+static int os_i_pwrite(__OSFILE fd, void *buffer, size_t size, uint64_t pos) {
+	uint8_t *buf = buffer;
+	while (size) {
+#ifdef _WIN32
+		OVERLAPPED ov;
+		DWORD r;
+		DWORD s = size > 0x40000000 ? 0x40000000 : (DWORD)size;
+		memset(&ov, 0, sizeof(ov));
+		ov.Offset = (DWORD)pos;
+		ov.OffsetHigh = (DWORD)(pos >> 32);
+		if (WriteFile(fd, buf, s, &r, &ov) == 0)
+			return -1;
+#else
+		ssize_t r = pwrite(fd, buf, size, (off_t)pos);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+#endif
+		if (r == 0)
+			return -1;
+		buf += r;
+		pos += r;
+		size -= r;
+	}
+	return 0;
+}
+
+// Check if a transfer can be made directly with a direct handle
+static int os_i_aligned(void *buffer, size_t size, uint64_t pos) {
+	return (((uintptr_t)buffer | size | pos) & (OS_DIRECT_ALIGN - 1)) == 0;
+}
+
+// Read with a direct handle, through bounce buffers if unaligned
+static int os_i_pread_direct(__OSFILE fd, void *buffer, size_t size, uint64_t pos) {
+	if (os_i_aligned(buffer, size, pos))
+		return os_i_pread(fd, buffer, size, pos, 1);
+
+	uint8_t *buf = buffer;
+	uint8_t *bounce = os_apool_get(os_i_bounce);
+	int e = 0;
+	while (size) {
+		uint64_t start = pos & ~(uint64_t)(OS_DIRECT_ALIGN - 1);
+		size_t skip = (size_t)(pos - start);
+		size_t n = OS_DIRECT_BOUNCE - skip;
+		if (n > size)
+			n = size;
+		size_t len = (skip + n + OS_DIRECT_ALIGN - 1) & ~(size_t)(OS_DIRECT_ALIGN - 1);
+		if ((e = os_i_pread(fd, bounce, len, start, 1)))
+			break;
+		memcpy(buf, bounce + skip, n);
+		buf += n;
+		pos += n;
+		size -= n;
+	}
+	os_apool_put(os_i_bounce, bounce);
+	return e;
+}
+
+// Write with a direct handle. Unaligned writes read, patch and write back
+// the aligned range, then restore the file size if it grew past the write.
+static int os_i_pwrite_direct(__OSFILE fd, void *buffer, size_t size, uint64_t pos) {
+	if (os_i_aligned(buffer, size, pos))
+		return os_i_pwrite(fd, buffer, size, pos);
+
+	uint64_t fsize, end = pos + size;
+	if (os_fsize(fd, &fsize))
+		return -1;
+
+	uint8_t *buf = buffer;
+	uint8_t *bounce = os_apool_get(os_i_bounce);
+	int e = 0;
+	while (size) {
+		uint64_t start = pos & ~(uint64_t)(OS_DIRECT_ALIGN - 1);
+		size_t skip = (size_t)(pos - start);
+		size_t n = OS_DIRECT_BOUNCE - skip;
+		if (n > size)
+			n = size;
+		size_t len = (skip + n + OS_DIRECT_ALIGN - 1) & ~(size_t)(OS_DIRECT_ALIGN - 1);
+		if ((e = os_i_pread(fd, bounce, len, start, 1)))
+			break;
+		memcpy(bounce + skip, buf, n);
+		if ((e = os_i_pwrite(fd, bounce, len, start)))
+			break;
+		buf += n;
+		pos += n;
+		size -= n;
+	}
+	os_apool_put(os_i_bounce, bounce);
+
+	if (e == 0 && ((end + OS_DIRECT_ALIGN - 1) & ~(uint64_t)(OS_DIRECT_ALIGN - 1)) > fsize)
+		e = os_ftruncate(fd, end > fsize ? end : fsize);
+	return e;
+}
+
+// Read or write with a direct handle at the stream position, then advance it
+static int os_i_fxfer_direct(__OSFILE fd, void *buffer, size_t size, int write) {
+	uint64_t pos;
+#ifdef _WIN32
+	LARGE_INTEGER a, b;
+	a.QuadPart = 0;
+	if (SetFilePointerEx(fd, a, &b, FILE_CURRENT) == 0)
+		return -1;
+	pos = b.QuadPart;
+#else
+	off_t o = lseek(fd, 0, SEEK_CUR);
+	if (o == -1)
+		return -1;
+	pos = (uint64_t)o;
+#endif
+	int e = write ?
+		os_i_pwrite_direct(fd, buffer, size, pos) :
+		os_i_pread_direct(fd, buffer, size, pos);
+	if (e)
+		return e;
+	return os_fseek(fd, (int64_t)(pos + size), SEEK_SET);
+}
+
 //
 // os_fread
 //
 
 int os_fread(__OSFILE fd, void *buffer, size_t size) {
+	if (os_i_ndirect && os_i_isdirect(fd))
+		return os_i_fxfer_direct(fd, buffer, size, 0);
 #ifdef _WIN32
 	DWORD r;
 	if (ReadFile(fd, buffer, size, &r, NULL) == 0)
@@ -106,6 +424,8 @@ int os_fread(__OSFILE fd, void *buffer, size_t size) {
 //
 
 int os_fwrite(__OSFILE fd, void *buffer, size_t size) {
+	if (os_i_ndirect && os_i_isdirect(fd))
+		return os_i_fxfer_direct(fd, buffer, size, 1);
 #ifdef _WIN32
 	DWORD r;
 	if (WriteFile(fd, buffer, size, &r, NULL) == 0)
@@ -122,6 +442,26 @@ int os_fwrite(__OSFILE fd, void *buffer, size_t size) {
 	return 0;
 }
 
+//
+// os_pread
+//
+
+int os_pread(__OSFILE fd, void *buffer, size_t size, uint64_t pos) {
+	if (os_i_ndirect && os_i_isdirect(fd))
+		return os_i_pread_direct(fd, buffer, size, pos);
+	return os_i_pread(fd, buffer, size, pos, 0);
+}
+
+//
+// os_pwrite
+//
+
+int os_pwrite(__OSFILE fd, void *buffer, size_t size, uint64_t pos) {
+	if (os_i_ndirect && os_i_isdirect(fd))
+		return os_i_pwrite_direct(fd, buffer, size, pos);
+	return os_i_pwrite(fd, buffer, size, pos);
+}
+
 //
 // os_fsize
 //
@@ -158,23 +498,641 @@ int os_fsize(__OSFILE fd, uint64_t *size) {
 // os_falloc
 //
 
-int os_falloc(__OSFILE fd, uint64_t fsize) {
-	const int bsize = 1024 * 1024; // 1 MiB
-	uint8_t *buf = calloc(1, bsize); // zeroed
-	if (fsize >= bsize) {
+int os_falloc(__OSFILE fd, uint64_t position, uint64_t length, int mode) {
+	uint64_t fsize, end = position + length;
+	if (os_fsize(fd, &fsize))
+		return -1;
+
+	switch (mode) {
+	case OS_FALLOC_ZERO: {
+		const size_t bsize = 1024 * 1024; // 1 MiB
+		uint8_t *buf = os_amalloc(bsize);
 		if (buf == NULL)
 			return 1;
-		while (fsize > bsize) {
-			if (os_fwrite(fd, buf, bsize))
-				return -1;
-			fsize -= bsize;
+		memset(buf, 0, bsize);
+		int e = 0;
+		while (length > 0) {
+			size_t size = length > bsize ? bsize : (size_t)length;
+			if ((e = os_pwrite(fd, buf, size, position)))
+				break;
+			position += size;
+			length -= size;
 		}
+		os_afree(buf);
+		return e;
 	}
-	if (fsize > 0) {
-		if (os_fwrite(fd, buf, bsize - fsize))
+	case OS_FALLOC_RESERVE:
+		if (length == 0)
+			break;
+#if _WIN32
+		// Reserved clusters past the file size are released on close,
+		// so the file size is set afterwards
+		if (end > fsize) {
+			FILE_ALLOCATION_INFO info;
+			info.AllocationSize.QuadPart = end;
+			SetFileInformationByHandle(fd, FileAllocationInfo, &info, sizeof(info));
+		}
+#elif defined(__linux__)
+		if (fallocate(fd, 0, (off_t)position, (off_t)length) == 0)
+			return 0;
+		if (errno != EOPNOTSUPP && errno != ENOSYS)
 			return -1;
+#elif defined(F_PREALLOCATE)
+		// Only space past the end of the file can be reserved
+		if (end > fsize) {
+			fstore_t st = { F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, (off_t)(end - fsize), 0 };
+			if (fcntl(fd, F_PREALLOCATE, &st) == -1) {
+				st.fst_flags = F_ALLOCATEALL;
+				if (fcntl(fd, F_PREALLOCATE, &st) == -1 && errno == ENOSPC)
+					return -1;
+			}
+		}
+#endif
+		// Not supported by the filesystem, fall back to a sparse region
+		/* fallthrough */
+	case OS_FALLOC_SPARSE: break;
+	default: return -1;
 	}
-	free(buf);
+
+	return end > fsize ? os_ftruncate(fd, end) : 0;
+}
+
+//
+// os_ftruncate
+//
+
+int os_ftruncate(__OSFILE fd, uint64_t fsize) {
+#if _WIN32
+	LARGE_INTEGER li;
+	li.QuadPart = fsize;
+	if (SetFilePointerEx(fd, li, NULL, FILE_BEGIN) == 0)
+		return -1;
+	return SetEndOfFile(fd) == 0;
+#else
+	return ftruncate(fd, (off_t)fsize);
+#endif
+}
+
+//
+// os_fsync
+//
+
+int os_fsync(__OSFILE fd) {
+#if _WIN32
+	return FlushFileBuffers(fd) == 0;
+#else
+	return fsync(fd);
+#endif
+}
+
+//
+// os_mmap
+//
+
+void *os_mmap(__OSFILE fd, uint64_t position, size_t size, void **base, size_t *length) {
+#if _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	uint64_t gran = si.dwAllocationGranularity;
+#else
+	uint64_t gran = (uint64_t)sysconf(_SC_PAGESIZE);
+#endif
+	uint64_t start = position - (position % gran);
+	size_t len = (size_t)(position - start) + size;
+#if _WIN32
+	HANDLE h = CreateFileMappingW(fd, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	if (h == NULL)
+		return NULL;
+	void *p = MapViewOfFile(h, FILE_MAP_COPY,
+		(DWORD)(start >> 32), (DWORD)start, len);
+	CloseHandle(h); // The view holds a reference
+	if (p == NULL)
+		return NULL;
+#else
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, (off_t)start);
+	if (p == MAP_FAILED)
+		return NULL;
+#endif
+	*base = p;
+	*length = len;
+	return (uint8_t*)p + (position - start);
+}
+
+//
+// os_munmap
+//
+
+int os_munmap(void *base, size_t length) {
+#if _WIN32
+	return UnmapViewOfFile(base) == 0;
+#else
+	return munmap(base, length);
+#endif
+}
+
+//
+// os_fadvise
+//
+
+int os_fadvise(__OSFILE fd, uint64_t position, uint64_t length, int advice) {
+#ifdef POSIX_FADV_NORMAL
+	static const int advices[] = {
+		POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM,
+		POSIX_FADV_WILLNEED, POSIX_FADV_DONTNEED
+	};
+	return posix_fadvise(fd, (off_t)position, (off_t)length, advices[advice]);
+#else
+	return 0;
+#endif
+}
+
+//
+// os_madvise
+//
+
+int os_madvise(void *base, size_t length, int advice) {
+#ifdef POSIX_MADV_NORMAL
+	static const int advices[] = {
+		POSIX_MADV_NORMAL, POSIX_MADV_SEQUENTIAL, POSIX_MADV_RANDOM,
+		POSIX_MADV_WILLNEED
+	};
+	if (advice == OS_ADVICE_DONTNEED)
+		return 0;
+	return posix_madvise(base, length, advices[advice]);
+#else
+	return 0;
+#endif
+}
+
+//
+// os_amalloc
+//
+
+void *os_amalloc(size_t size) {
+#ifdef _WIN32
+	return _aligned_malloc(size, OS_DIRECT_ALIGN);
+#else
+	void *p;
+	return posix_memalign(&p, OS_DIRECT_ALIGN, size) ? NULL : p;
+#endif
+}
+
+//
+// os_afree
+//
+
+void os_afree(void *buffer) {
+#ifdef _WIN32
+	_aligned_free(buffer);
+#else
+	free(buffer);
+#endif
+}
+
+//
+// os_thread_create
+//
+
+struct os_thread_start_t {
+	void (*func)(void*);
+	void *arg;
+};
+
+#ifdef _WIN32
+static DWORD WINAPI os_i_thread_start(LPVOID p) {
+#else
+static void *os_i_thread_start(void *p) {
+#endif
+	struct os_thread_start_t s = *(struct os_thread_start_t*)p;
+	free(p);
+	s.func(s.arg);
+	return 0;
+}
+
+int os_thread_create(__OSTHREAD *t, void (*func)(void*), void *arg) {
+	struct os_thread_start_t *s = malloc(sizeof(struct os_thread_start_t));
+	if (s == NULL)
+		return -1;
+	s->func = func;
+	s->arg = arg;
+#ifdef _WIN32
+	if ((*t = CreateThread(NULL, 0, os_i_thread_start, s, 0, NULL)) == NULL) {
+#else
+	if (pthread_create(t, NULL, os_i_thread_start, s)) {
+#endif
+		free(s);
+		return -1;
+	}
+	return 0;
+}
+
+//
+// os_thread_join
+//
+
+int os_thread_join(__OSTHREAD t) {
+#ifdef _WIN32
+	if (WaitForSingleObject(t, INFINITE) != WAIT_OBJECT_0)
+		return -1;
+	CloseHandle(t);
+	return 0;
+#else
+	return pthread_join(t, NULL) ? -1 : 0;
+#endif
+}
+
+//
+// os_cpu_count
+//
+
+uint32_t os_cpu_count(void) {
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors ? si.dwNumberOfProcessors : 1;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (uint32_t)n : 1;
+#endif
+}
+
+//
+// os_mutex_*, os_cond_*
+//
+
+#ifdef _WIN32
+void os_mutex_init(__OSMUTEX *m)	{ InitializeSRWLock(m); }
+void os_mutex_lock(__OSMUTEX *m)	{ AcquireSRWLockExclusive(m); }
+void os_mutex_unlock(__OSMUTEX *m)	{ ReleaseSRWLockExclusive(m); }
+void os_mutex_destroy(__OSMUTEX *m)	{ }
+void os_cond_init(__OSCOND *c)	{ InitializeConditionVariable(c); }
+void os_cond_wait(__OSCOND *c, __OSMUTEX *m)	{ SleepConditionVariableSRW(c, m, INFINITE, 0); }
+void os_cond_broadcast(__OSCOND *c)	{ WakeAllConditionVariable(c); }
+void os_cond_destroy(__OSCOND *c)	{ }
+#else
+void os_mutex_init(__OSMUTEX *m)	{ pthread_mutex_init(m, NULL); }
+void os_mutex_lock(__OSMUTEX *m)	{ pthread_mutex_lock(m); }
+void os_mutex_unlock(__OSMUTEX *m)	{ pthread_mutex_unlock(m); }
+void os_mutex_destroy(__OSMUTEX *m)	{ pthread_mutex_destroy(m); }
+void os_cond_init(__OSCOND *c)	{ pthread_cond_init(c, NULL); }
+void os_cond_wait(__OSCOND *c, __OSMUTEX *m)	{ pthread_cond_wait(c, m); }
+void os_cond_broadcast(__OSCOND *c)	{ pthread_cond_broadcast(c); }
+void os_cond_destroy(__OSCOND *c)	{ pthread_cond_destroy(c); }
+#endif
+
+//
+// os_apool_init
+//
+
+int os_apool_init(struct os_apool_t *pool, uint32_t count, size_t size) {
+	size = (size + OS_DIRECT_ALIGN - 1) & ~(size_t)(OS_DIRECT_ALIGN - 1);
+	pool->base = os_amalloc(size * count);
+	pool->avail = malloc(count * sizeof(uint32_t));
+	if (pool->base == NULL || pool->avail == NULL) {
+		os_afree(pool->base);
+		free(pool->avail);
+		return -1;
+	}
+	for (uint32_t i = 0; i < count; ++i)
+		pool->avail[i] = count - 1 - i;
+	pool->size = size;
+	pool->count = pool->navail = count;
+	os_mutex_init(&pool->mutex);
+	os_cond_init(&pool->cond);
+	return 0;
+}
+
+//
+// os_apool_get
+//
+
+void *os_apool_get(struct os_apool_t *pool) {
+	os_mutex_lock(&pool->mutex);
+	while (pool->navail == 0)
+		os_cond_wait(&pool->cond, &pool->mutex);
+	uint32_t i = pool->avail[--pool->navail];
+	os_mutex_unlock(&pool->mutex);
+	return pool->base + (size_t)i * pool->size;
+}
+
+//
+// os_apool_put
+//
+
+void os_apool_put(struct os_apool_t *pool, void *buffer) {
+	os_mutex_lock(&pool->mutex);
+	pool->avail[pool->navail++] = (uint32_t)(((uint8_t*)buffer - pool->base) / pool->size);
+	os_cond_broadcast(&pool->cond);
+	os_mutex_unlock(&pool->mutex);
+}
+
+//
+// os_apool_end
+//
+
+void os_apool_end(struct os_apool_t *pool) {
+	os_cond_destroy(&pool->cond);
+	os_mutex_destroy(&pool->mutex);
+	os_afree(pool->base);
+	free(pool->avail);
+	pool->base = NULL;
+	pool->avail = NULL;
+}
+
+//
+// os_aio_* (internal)
+//
+
+#ifdef OS_URING
+static int os_i_uring_setup(struct os_aio_t *aio) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	int ring = (int)syscall(__NR_io_uring_setup, aio->depth, &p);
+	if (ring < 0)
+		return -1;
+
+	aio->sq_len = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	aio->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	aio->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (aio->cq_len > aio->sq_len)
+			aio->sq_len = aio->cq_len;
+		aio->cq_len = aio->sq_len;
+	}
+
+	aio->sq_ptr = mmap(NULL, aio->sq_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+	if (aio->sq_ptr == MAP_FAILED)
+		goto L_ERR_SQ;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		aio->cq_ptr = aio->sq_ptr;
+	} else {
+		aio->cq_ptr = mmap(NULL, aio->cq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+		if (aio->cq_ptr == MAP_FAILED)
+			goto L_ERR_CQ;
+	}
+	aio->sqes = mmap(NULL, aio->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+	if (aio->sqes == MAP_FAILED)
+		goto L_ERR_SQES;
+
+	uint8_t *sq = aio->sq_ptr, *cq = aio->cq_ptr;
+	aio->sq_head  = (uint32_t*)(sq + p.sq_off.head);
+	aio->sq_tail  = (uint32_t*)(sq + p.sq_off.tail);
+	aio->sq_mask  = (uint32_t*)(sq + p.sq_off.ring_mask);
+	aio->sq_array = (uint32_t*)(sq + p.sq_off.array);
+	aio->cq_head  = (uint32_t*)(cq + p.cq_off.head);
+	aio->cq_tail  = (uint32_t*)(cq + p.cq_off.tail);
+	aio->cq_mask  = (uint32_t*)(cq + p.cq_off.ring_mask);
+	aio->cqes     = cq + p.cq_off.cqes;
+
+	// Registered buffers are optional, fixed reads are only used if
+	// registration succeeded
+	if (aio->buffer) {
+		struct iovec iov;
+		iov.iov_base = aio->buffer;
+		iov.iov_len = aio->bufsize;
+		if (syscall(__NR_io_uring_register, ring, IORING_REGISTER_BUFFERS, &iov, 1))
+			aio->buffer = NULL;
+	}
+
+	aio->ring = ring;
+	aio->engine = OS_AIO_ENGINE_URING;
+	return 0;
+
+L_ERR_SQES:
+	if (aio->cq_ptr != aio->sq_ptr)
+		munmap(aio->cq_ptr, aio->cq_len);
+L_ERR_CQ:
+	munmap(aio->sq_ptr, aio->sq_len);
+L_ERR_SQ:
+	close(ring);
+	return -1;
+}
+
+static int os_i_uring_enter(struct os_aio_t *aio, uint32_t submit, uint32_t wait) {
+	uint32_t flags = wait ? IORING_ENTER_GETEVENTS : 0;
+	for (;;) {
+		int r = (int)syscall(__NR_io_uring_enter, aio->ring, submit, wait, flags, NULL, 0);
+		if (r >= 0)
+			return r;
+		if (errno != EINTR)
+			return -1;
+	}
+}
+#endif // OS_URING
+
+static int os_i_aio_queue(struct os_aio_t *aio, __OSFILE fd, void *buffer,
+	size_t size, uint64_t pos, uint64_t tag, int write) {
+	if (aio->nslots == 0)
+		return -1;
+
+	uint32_t slot = aio->slots[--aio->nslots];
+	struct os_aio_req_t *req = aio->reqs + slot;
+	req->fd = fd;
+	req->buffer = buffer;
+	req->size = size;
+	req->position = pos;
+	req->tag = tag;
+	req->write = write;
+
+#ifdef OS_URING
+	if (aio->engine == OS_AIO_ENGINE_URING) {
+		uint32_t tail = *aio->sq_tail;
+		uint32_t index = tail & *aio->sq_mask;
+		struct io_uring_sqe *sqe = (struct io_uring_sqe*)aio->sqes + index;
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->fd = fd;
+		sqe->off = pos;
+		sqe->user_data = slot;
+		req->sync = os_i_ndirect && os_i_isdirect(fd) &&
+			os_i_aligned(buffer, size, pos) == 0;
+		if (req->sync) {
+			// The kernel would reject it, promote it now and only
+			// post a completion
+			req->result = write ?
+				os_i_pwrite_direct(fd, buffer, size, pos) :
+				os_i_pread_direct(fd, buffer, size, pos);
+			sqe->opcode = IORING_OP_NOP;
+		} else if (aio->buffer &&
+			(uint8_t*)buffer >= aio->buffer &&
+			(uint8_t*)buffer + size <= aio->buffer + aio->bufsize) {
+			sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+			sqe->addr = (uint64_t)(uintptr_t)buffer;
+			sqe->len = (uint32_t)size;
+			sqe->buf_index = 0;
+		} else {
+			req->iov_base = buffer;
+			req->iov_len = size;
+			sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->addr = (uint64_t)(uintptr_t)&req->iov_base;
+			sqe->len = 1;
+		}
+		aio->sq_array[index] = index;
+		__atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+		++aio->queued;
+		return 0;
+	}
+#endif
+
+	// Synchronous engine: Perform now, report on wait
+	req->result = write ?
+		os_pwrite(fd, buffer, size, pos) :
+		os_pread(fd, buffer, size, pos);
+	aio->done[aio->dtail++ % aio->depth] = slot;
+	++aio->inflight;
+	return 0;
+}
+
+//
+// os_aio_init
+//
+
+int os_aio_init(struct os_aio_t *aio, uint32_t depth, void *buffer, size_t size) {
+	if (depth == 0)
+		depth = OS_AIO_DEPTH_DEFAULT;
+	else if (depth > OS_AIO_DEPTH_MAX)
+		depth = OS_AIO_DEPTH_MAX;
+	// io_uring rounds entries up to a power of 2
+	uint32_t d = 1;
+	while (d < depth) d <<= 1;
+	depth = d;
+
+	memset(aio, 0, sizeof(*aio));
+	aio->depth = depth;
+	aio->buffer = buffer;
+	aio->bufsize = buffer ? size : 0;
+	aio->ring = -1;
+	aio->reqs = calloc(depth, sizeof(struct os_aio_req_t));
+	aio->slots = malloc(depth * sizeof(uint32_t));
+	aio->done = malloc(depth * sizeof(uint32_t));
+	if (aio->reqs == NULL || aio->slots == NULL || aio->done == NULL) {
+		free(aio->reqs);
+		free(aio->slots);
+		free(aio->done);
+		return -1;
+	}
+	for (uint32_t i = 0; i < depth; ++i)
+		aio->slots[i] = depth - 1 - i;
+	aio->nslots = depth;
+
+#ifdef OS_URING
+	if (os_i_uring_setup(aio))
+		aio->buffer = NULL;
+#else
+	aio->buffer = NULL;
+#endif
+	return 0;
+}
+
+//
+// os_aio_read
+//
+
+int os_aio_read(struct os_aio_t *aio, __OSFILE fd, void *buffer, size_t size, uint64_t pos, uint64_t tag) {
+	return os_i_aio_queue(aio, fd, buffer, size, pos, tag, 0);
+}
+
+//
+// os_aio_write
+//
+
+int os_aio_write(struct os_aio_t *aio, __OSFILE fd, void *buffer, size_t size, uint64_t pos, uint64_t tag) {
+	return os_i_aio_queue(aio, fd, buffer, size, pos, tag, 1);
+}
+
+//
+// os_aio_submit
+//
+
+int os_aio_submit(struct os_aio_t *aio) {
+#ifdef OS_URING
+	while (aio->queued) {
+		int r = os_i_uring_enter(aio, aio->queued, 0);
+		if (r < 0)
+			return -1;
+		aio->queued -= r;
+		aio->inflight += r;
+	}
+#endif
+	return 0;
+}
+
+//
+// os_aio_wait
+//
+
+int os_aio_wait(struct os_aio_t *aio, uint64_t *tag) {
+	// Requests already in flight can still be reaped if this fails
+	if (os_aio_submit(aio) && aio->inflight == 0)
+		return -1;
+	if (aio->inflight == 0)
+		return -2;
+
+	uint32_t slot;
+	int e;
+
+#ifdef OS_URING
+	if (aio->engine == OS_AIO_ENGINE_URING) {
+		uint32_t head = *aio->cq_head;
+		while (head == __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE)) {
+			if (os_i_uring_enter(aio, 0, 1) < 0)
+				return -1;
+		}
+		struct io_uring_cqe *cqe =
+			(struct io_uring_cqe*)aio->cqes + (head & *aio->cq_mask);
+		slot = (uint32_t)cqe->user_data;
+		int res = cqe->res;
+		__atomic_store_n(aio->cq_head, head + 1, __ATOMIC_RELEASE);
+
+		struct os_aio_req_t *req = aio->reqs + slot;
+		if (req->sync) {
+			e = req->result;
+		} else if (res < 0) {
+			errno = -res;
+			e = -1;
+		} else if ((size_t)res < req->size) { // Short transfer
+			e = req->write ?
+				os_pwrite(req->fd, req->buffer + res, req->size - res, req->position + res) :
+				os_pread(req->fd, req->buffer + res, req->size - res, req->position + res);
+		} else
+			e = 0;
+	} else
+#endif
+	{
+		slot = aio->done[aio->dhead++ % aio->depth];
+		e = aio->reqs[slot].result;
+	}
+
+	--aio->inflight;
+	*tag = aio->reqs[slot].tag;
+	aio->slots[aio->nslots++] = slot;
+	return e;
+}
+
+//
+// os_aio_end
+//
+
+int os_aio_end(struct os_aio_t *aio) {
+	uint64_t tag;
+	os_aio_submit(aio);
+	while (aio->inflight)
+		os_aio_wait(aio, &tag);
+#ifdef OS_URING
+	if (aio->engine == OS_AIO_ENGINE_URING) {
+		munmap(aio->sqes, aio->sqes_len);
+		if (aio->cq_ptr != aio->sq_ptr)
+			munmap(aio->cq_ptr, aio->cq_len);
+		munmap(aio->sq_ptr, aio->sq_len);
+		close(aio->ring);
+	}
+#endif
+	free(aio->reqs);
+	free(aio->slots);
+	free(aio->done);
 	return 0;
 }
 
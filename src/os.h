@@ -4,16 +4,23 @@
 #ifdef _WIN32
 #include <Windows.h>
 typedef HANDLE __OSFILE;
+typedef HANDLE __OSTHREAD;
+typedef SRWLOCK __OSMUTEX;
+typedef CONDITION_VARIABLE __OSCOND;
 #else // Posix
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 
 #ifndef __OSFILE_H
 #define __OSFILE_H
 typedef int __OSFILE;
+typedef pthread_t __OSTHREAD;
+typedef pthread_mutex_t __OSMUTEX;
+typedef pthread_cond_t __OSCOND;
 #endif // __OSFILE_H
 #endif
 
@@ -32,6 +39,33 @@ __OSFILE os_fopen(const oschar *path);
  */
 __OSFILE os_fcreate(const oschar *path);
 
+/**
+ * Open a file stream bypassing the OS cache. Uses O_DIRECT (Linux),
+ * F_NOCACHE (macOS) or FILE_FLAG_NO_BUFFERING (Windows).
+ * 
+ * Direct transfers must be aligned to OS_DIRECT_ALIGN in buffer address,
+ * size and position. Other transfers made with os_pread, os_pwrite,
+ * os_fread, os_fwrite and os_aio_* are promoted to aligned transfers
+ * through bounce buffers. Unaligned writes are performed as
+ * read-modify-write and must not overlap concurrent writes.
+ * 
+ * Handles must be opened and closed from a single thread.
+ * 
+ * \returns File handle, or 0 if the file cannot be opened with direct I/O
+ * (e.g. the filesystem rejects it), in which case os_fopen can be used.
+ */
+__OSFILE os_fopen_direct(const oschar *path);
+
+/**
+ * Like os_fcreate, but bypassing the OS cache. See os_fopen_direct.
+ */
+__OSFILE os_fcreate_direct(const oschar *path);
+
+/**
+ * Close a file stream.
+ */
+int os_fclose(__OSFILE fd);
+
 /**
  * Seek into a position within the stream.
  */
@@ -47,6 +81,22 @@ int os_fread(__OSFILE fd, void *buffer, size_t size);
  */
 int os_fwrite(__OSFILE fd, void *buffer, size_t size);
 
+/**
+ * Read data from stream at an absolute position. The stream position is
+ * neither used nor relied upon, which allows concurrent readers on the same
+ * handle. Uses pread (Posix) or ReadFile with an OVERLAPPED offset (Windows).
+ * 
+ * If the end of the file is reached before size bytes are read, the rest of
+ * the buffer is zero-filled.
+ */
+int os_pread(__OSFILE fd, void *buffer, size_t size, uint64_t position);
+
+/**
+ * Write data to stream at an absolute position, overwrites. Like os_pread,
+ * the stream position is not used.
+ */
+int os_pwrite(__OSFILE fd, void *buffer, size_t size, uint64_t position);
+
 /**
  * Get the file size, or the disk size, in bytes. If the handle is a file,
  * the file size is set, otherwise if the handle is a block device, the
@@ -54,10 +104,328 @@ int os_fwrite(__OSFILE fd, void *buffer, size_t size);
  */
 int os_fsize(__OSFILE fd, uint64_t *size);
 
+#ifndef DEFINITION_OS_FALLOC
+#define DEFINITION_OS_FALLOC
+enum {	// Allocation modes for os_falloc
+	OS_FALLOC_SPARSE	= 0,	// Set the file size only, unwritten data reads as zero
+	OS_FALLOC_RESERVE	= 1,	// Reserve disk space without writing, sparse if unsupported
+	OS_FALLOC_ZERO	= 2,	// Write zeros, slow but supported everywhere
+};
+#endif // DEFINITION_OS_FALLOC
+
+/**
+ * Allocate a file region that reads as zero, extending the file size if it
+ * ends past the end of the file. Existing data in the region is left as-is
+ * except with OS_FALLOC_ZERO, which overwrites it.
+ * 
+ * OS_FALLOC_SPARSE uses SetEndOfFile (Windows) or ftruncate (POSIX) and
+ * OS_FALLOC_RESERVE uses FileAllocationInfo (Windows), fallocate (Linux)
+ * or F_PREALLOCATE (macOS), both taking a constant time regardless of the
+ * region size. Reserved regions cannot fail to be written later for lack of
+ * disk space.
+ * 
+ * \param fd File handle
+ * \param position Absolute file position
+ * \param length Region length in bytes
+ * \param mode See OS_FALLOC enumeration
+ * 
+ * \returns Non-zero on error
+ */
+int os_falloc(__OSFILE fd, uint64_t position, uint64_t length, int mode);
+
+/**
+ * Set the file size, truncating or extending it. Uses SetEndOfFile (Windows)
+ * or ftruncate (POSIX). The stream position is unspecified afterwards.
+ */
+int os_ftruncate(__OSFILE fd, uint64_t fsize);
+
+/**
+ * Flush file data and metadata to the storage device. Uses FlushFileBuffers
+ * (Windows) or fsync (POSIX).
+ */
+int os_fsync(__OSFILE fd);
+
+/**
+ * Map a file region in memory. The mapping is private (copy-on-write):
+ * changes are not written back to the file. Pages are only read when
+ * touched. Uses MapViewOfFile (Windows) or mmap (POSIX).
+ * 
+ * \param fd File handle
+ * \param position Absolute file position, no alignment required
+ * \param size Region size in bytes
+ * \param base Set to the base of the mapping, for os_munmap
+ * \param length Set to the length of the mapping, for os_munmap
+ * 
+ * \returns Pointer to the data at position, or NULL on error
+ */
+void *os_mmap(__OSFILE fd, uint64_t position, size_t size, void **base, size_t *length);
+
+/**
+ * Unmap a file region mapped with os_mmap.
+ */
+int os_munmap(void *base, size_t length);
+
+#ifndef DEFINITION_OS_ADVICE
+#define DEFINITION_OS_ADVICE
+enum {	// Access patterns for os_fadvise and os_madvise
+	OS_ADVICE_NORMAL	= 0,	// No particular order
+	OS_ADVICE_SEQUENTIAL	= 1,	// Ascending order, read ahead more
+	OS_ADVICE_RANDOM	= 2,	// Random order, do not read ahead
+	OS_ADVICE_WILLNEED	= 3,	// Will be accessed soon, start reading
+	OS_ADVICE_DONTNEED	= 4,	// Will not be accessed again, drop from cache
+};
+#endif // DEFINITION_OS_ADVICE
+
+/**
+ * Hint the OS about how a file region will be accessed. Uses
+ * posix_fadvise where available, and does nothing elsewhere since hints are
+ * optional. With OS_ADVICE_DONTNEED, clean cached pages are dropped and
+ * writeback of dirty pages is started.
+ * 
+ * \param fd File handle
+ * \param position Absolute file position
+ * \param length Region length in bytes, 0 for up to the end of the file
+ * \param advice See OS_ADVICE enumeration
+ * 
+ * \returns Non-zero on error
+ */
+int os_fadvise(__OSFILE fd, uint64_t position, uint64_t length, int advice);
+
+/**
+ * Hint the OS about how a mapping made with os_mmap will be accessed. Uses
+ * posix_madvise where available. OS_ADVICE_DONTNEED is ignored, since the
+ * mapping is private and changes would be lost.
+ * 
+ * \param base Base of the mapping, as set by os_mmap
+ * \param length Length of the mapping, as set by os_mmap
+ * \param advice See OS_ADVICE enumeration
+ * 
+ * \returns Non-zero on error
+ */
+int os_madvise(void *base, size_t length, int advice);
+
+#ifndef DEFINITION_OS_DIRECT
+#define DEFINITION_OS_DIRECT
+enum {
+	OS_DIRECT_ALIGN	= 4096,	// Alignment of direct transfers
+	OS_DIRECT_BOUNCE	= 1024 * 1024,	// Size of a bounce buffer
+	OS_DIRECT_POOL	= 8,	// Number of bounce buffers
+	OS_DIRECT_MAX	= 64,	// Maximum number of direct handles
+};
+#endif // DEFINITION_OS_DIRECT
+
+/**
+ * Allocate memory aligned to OS_DIRECT_ALIGN, suitable for direct
+ * transfers. Free with os_afree.
+ */
+void *os_amalloc(size_t size);
+
+/**
+ * Free memory allocated with os_amalloc.
+ */
+void os_afree(void *buffer);
+
+//
+// Thread functions
+//
+// Mutexes and condition variables should be placed in memory obtained from
+// malloc (e.g. first in a context structure) since the build packs
+// structures.
+//
+
+/**
+ * Start a new thread.
+ * 
+ * \param t Thread handle
+ * \param func Thread entry point
+ * \param arg Parameter given to func
+ * 
+ * \returns Non-zero on error
+ */
+int os_thread_create(__OSTHREAD *t, void (*func)(void*), void *arg);
+
+/**
+ * Wait for a thread to finish and release its handle.
+ */
+int os_thread_join(__OSTHREAD t);
+
+/**
+ * Get the number of online processors, at least 1.
+ */
+uint32_t os_cpu_count(void);
+
+void os_mutex_init(__OSMUTEX *m);
+void os_mutex_lock(__OSMUTEX *m);
+void os_mutex_unlock(__OSMUTEX *m);
+void os_mutex_destroy(__OSMUTEX *m);
+
+void os_cond_init(__OSCOND *c);
+/**
+ * Atomically release the mutex and wait for the condition to be signaled.
+ */
+void os_cond_wait(__OSCOND *c, __OSMUTEX *m);
+/**
+ * Wake all threads waiting on the condition.
+ */
+void os_cond_broadcast(__OSCOND *c);
+void os_cond_destroy(__OSCOND *c);
+
+//
+// Aligned buffer pool functions
+//
+// A pool hands out a fixed number of buffers of the same size, aligned to
+// OS_DIRECT_ALIGN, from several threads. os_apool_get waits until a buffer
+// is returned if all are in use. The pool structure holds a mutex, so it
+// must be allocated with malloc.
+//
+
+#ifndef DEFINITION_OS_APOOL
+#define DEFINITION_OS_APOOL
+struct os_apool_t {
+	__OSMUTEX mutex;
+	__OSCOND cond;
+	uint8_t *base;	// count * size bytes
+	size_t size;	// Buffer size, multiple of OS_DIRECT_ALIGN
+	uint32_t count;	// Number of buffers
+	uint32_t navail;	// Number of free buffers
+	uint32_t *avail;	// Free buffer indexes (stack)
+};
+#endif // DEFINITION_OS_APOOL
+
+/**
+ * Initiate an aligned buffer pool.
+ * 
+ * \param pool Pool structure
+ * \param count Number of buffers
+ * \param size Buffer size, rounded up to OS_DIRECT_ALIGN
+ * 
+ * \returns Non-zero on memory allocation failure
+ */
+int os_apool_init(struct os_apool_t *pool, uint32_t count, size_t size);
+
+/**
+ * Take a buffer from the pool, waiting for one if none are free.
+ */
+void *os_apool_get(struct os_apool_t *pool);
+
+/**
+ * Return a buffer to the pool.
+ */
+void os_apool_put(struct os_apool_t *pool, void *buffer);
+
+/**
+ * Free the buffers of a pool. All buffers must have been returned.
+ */
+void os_apool_end(struct os_apool_t *pool);
+
+//
+// Asynchronous I/O functions
+//
+// Requests are queued with os_aio_read/os_aio_write, handed to the OS in one
+// batch with os_aio_submit, and reaped one at a time with os_aio_wait. On
+// Linux, io_uring is used when available (unless OS_NO_URING is defined),
+// and reads into the buffer region given to os_aio_init use registered
+// buffers. Elsewhere, or when io_uring cannot be set up, requests are
+// performed synchronously with os_pread/os_pwrite and completions are
+// returned in order, so callers do not need to care which engine is used.
+// Unaligned requests on direct handles (see os_fopen_direct) are always
+// performed synchronously.
+//
+
+#ifndef DEFINITION_OS_AIO
+#define DEFINITION_OS_AIO
+enum {
+	OS_AIO_DEPTH_DEFAULT	= 32,	// Default queue depth
+	OS_AIO_DEPTH_MAX	= 1024,	// Maximum queue depth
+
+	OS_AIO_ENGINE_SYNC	= 0,	// Synchronous fallback
+	OS_AIO_ENGINE_URING	= 1,	// Linux io_uring
+};
+
+// (Internal) Request slot
+struct os_aio_req_t {
+	__OSFILE fd;
+	uint8_t *buffer;
+	size_t size;
+	uint64_t position;
+	uint64_t tag;	// User tag, returned by os_aio_wait
+	int write;	// Non-zero for write requests
+	int result;	// Synchronous engine: request result
+	int sync;	// io_uring: performed synchronously, result is set
+	void *iov_base;	// io_uring: struct iovec for readv/writev
+	size_t iov_len;
+};
+
+struct os_aio_t {
+	uint32_t engine;	// See OS_AIO_ENGINE enumeration
+	uint32_t depth;	// Maximum number of requests in flight
+	uint32_t queued;	// Requests prepared, not yet submitted
+	uint32_t inflight;	// Requests submitted, not yet reaped
+	uint8_t *buffer;	// Registered buffer region, may be NULL
+	size_t bufsize;	// Registered buffer region size
+	struct os_aio_req_t *reqs;	// Request slots (depth)
+	uint32_t *slots;	// Free slot stack (depth)
+	uint32_t nslots;	// Number of free slots
+	uint32_t *done;	// Synchronous engine: completion FIFO (depth)
+	uint32_t dhead, dtail;
+	// io_uring rings
+	int ring;
+	uint32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+	uint32_t *cq_head, *cq_tail, *cq_mask;
+	void *sqes, *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+};
+#endif // DEFINITION_OS_AIO
+
+/**
+ * Initiate an asynchronous I/O context.
+ * 
+ * \param aio struct os_aio_t pointer
+ * \param depth Maximum number of requests in flight, 0 for default
+ * \param buffer Buffer region to register with the OS, may be NULL
+ * \param size Buffer region size in bytes
+ * 
+ * \returns Non-zero on memory allocation failure
+ */
+int os_aio_init(struct os_aio_t *aio, uint32_t depth, void *buffer, size_t size);
+
+/**
+ * Queue a read request. The request is not started until os_aio_submit.
+ * 
+ * \returns Non-zero if all request slots are in use
+ */
+int os_aio_read(struct os_aio_t *aio, __OSFILE fd, void *buffer, size_t size, uint64_t position, uint64_t tag);
+
+/**
+ * Queue a write request. The request is not started until os_aio_submit.
+ * 
+ * \returns Non-zero if all request slots are in use
+ */
+int os_aio_write(struct os_aio_t *aio, __OSFILE fd, void *buffer, size_t size, uint64_t position, uint64_t tag);
+
+/**
+ * Submit all queued requests in a single call.
+ */
+int os_aio_submit(struct os_aio_t *aio);
+
+/**
+ * Wait for a request to complete and release its slot. Queued requests are
+ * submitted first. Short reads are completed synchronously.
+ * 
+ * \param aio struct os_aio_t pointer
+ * \param tag Tag of the completed request
+ * 
+ * \returns 0 on success, -1 if the request failed, -2 if there are no
+ * requests in flight
+ */
+int os_aio_wait(struct os_aio_t *aio, uint64_t *tag);
+
 /**
- * Zero write to file.
+ * Close the asynchronous I/O context. Requests still in flight are waited
+ * on and discarded.
  */
-int os_falloc(__OSFILE fd, uint64_t fsize);
+int os_aio_end(struct os_aio_t *aio);
 
 //
 // Progress functions
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h> // memcmp
 #include <assert.h>
 #include "uid.h"
 #include "utils.h"
@@ -59,6 +60,5 @@ int uid_nil(UID *uid) {
 //
 
 int uid_cmp(UID *uid1, UID *uid2) {
-	assert(0);
-	return 0;
+	return memcmp(uid1->data, uid2->data, 16) == 0;
 }
@@ -46,5 +46,7 @@ void uid_swap(UID *uid);
 int uid_nil(UID *uid);
 /**
  * Compares two GUIDs/UUIDs.
+ * 
+ * Returns non-zero if both are equal.
  */
 int uid_cmp(UID *uid1, UID *uid2);
@@ -117,3 +117,26 @@ void str_s(char *str, int size);
  * \returns Number of characters copied or negative on error
  */
 int wstra(char *dest, char16 *src, int nchars);
+
+/**
+ * Check if a buffer only contains zeros. Uses AVX2 or SSE2 when available
+ * (selected at runtime on first use), otherwise a word-wise scan. Returns on
+ * the first non-zero chunk found.
+ * 
+ * \param buffer Buffer
+ * \param size Buffer size in bytes
+ * 
+ * \returns Non-zero if the buffer only contains zeros
+ */
+int iszero(const void *buffer, size_t size);
+
+/**
+ * Get the name of the implementation selected by iszero, e.g. "avx2".
+ */
+const char *iszero_name(void);
+
+/**
+ * Compute a CRC-32C (Castagnoli) checksum, as used by VHDX. To checksum
+ * data in parts, pass the previous result as crc, otherwise 0.
+ */
+uint32_t crc32c(uint32_t crc, const void *buffer, size_t size);
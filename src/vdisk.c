@@ -20,6 +20,13 @@ int vdisk_i_err(VDISK *vd, int e, int l, const char *f) {
 // non-implemented functions during operation
 void vdisk_i_pre_init(VDISK *vd) {
 	memset(&vd->cb, 0, sizeof(vd->cb));
+	vd->meta = NULL;
+	vd->path = NULL;
+	vd->cache = NULL;
+	memset(&vd->ra, 0, sizeof(vd->ra));
+	vd->ra.next = UINT64_MAX;
+	vd->blksize = 0;
+	vd->blkcount = 0;
 }
 
 //
@@ -27,10 +34,13 @@ void vdisk_i_pre_init(VDISK *vd) {
 //
 
 int vdisk_open(VDISK *vd, const oschar *path, uint32_t flags) {
-	if ((vd->fd = os_fopen(path)) == 0)
+	// Direct I/O is not available everywhere, fall back to buffered I/O
+	vd->fd = flags & VDISK_OPEN_DIRECT ? os_fopen_direct(path) : 0;
+	if (vd->fd == 0 && (vd->fd = os_fopen(path)) == 0)
 		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
 
 	vdisk_i_pre_init(vd);
+	vd->path = path;
 
 	if (flags & VDISK_RAW)
 		return vdisk_raw_open(vd, flags, 0);
@@ -42,9 +52,7 @@ int vdisk_open(VDISK *vd, const oschar *path, uint32_t flags) {
 	// seeking capabilities on the file or device.
 	//
 
-	if (os_fread(vd->fd, &vd->format, 4))
-		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-	if (os_fseek(vd->fd, 0, SEEK_SET))
+	if (os_pread(vd->fd, &vd->format, 4, 0))
 		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
 
 	//
@@ -54,6 +62,7 @@ int vdisk_open(VDISK *vd, const oschar *path, uint32_t flags) {
 	uint32_t internal = 0; // Internal flags
 	uint32_t sign32;
 	uint64_t sign64;
+	uint64_t fsize;
 
 	switch (vd->format) {
 	case VDISK_FORMAT_VDI:
@@ -84,12 +93,16 @@ int vdisk_open(VDISK *vd, const oschar *path, uint32_t flags) {
 		if (vdisk_phdd_open(vd, flags, internal))
 			return vd->err.num;
 		break;
+	case VDISK_FORMAT_BOCHS:
+		if (vdisk_bochs_open(vd, flags, internal))
+			return vd->err.num;
+		break;
 	default: // Attempt at different offsets
 
 		// VHD: (Fixed) 512 bytes before EOF
-		if (os_fseek(vd->fd, -512, SEEK_END))
+		if (os_fsize(vd->fd, &fsize) || fsize < 512)
 			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-		if (os_fread(vd->fd, &sign64, 8))
+		if (os_pread(vd->fd, &sign64, 8, fsize - 512))
 			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
 		if (sign64 == VHD_MAGIC) {
 			vd->format = VDISK_FORMAT_VHD;
@@ -121,21 +134,23 @@ int vdisk_create(VDISK *vd, const oschar *path, int format, uint64_t capacity, u
 	if (capacity == 0)
 		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
 
-	if ((vd->fd = os_fcreate(path)) == 0)
+	vd->fd = flags & VDISK_CREATE_DIRECT ? os_fcreate_direct(path) : 0;
+	if (vd->fd == 0 && (vd->fd = os_fcreate(path)) == 0)
 		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
 
-	if (flags & VDISK_RAW) {
-		vd->format = VDISK_FORMAT_RAW;
-		if (os_falloc(vd->fd, capacity))
-			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-		return VVD_EOK;
-	}
+	vdisk_i_pre_init(vd);
+
+	if (flags & VDISK_RAW)
+		return vdisk_raw_create(vd, capacity, flags);
 
 	int e;
 	switch (format) {
 	case VDISK_FORMAT_VDI:
 		e = vdisk_vdi_create(vd, capacity, flags);
 		break;
+	case VDISK_FORMAT_QCOW:
+		e = vdisk_qcow_create(vd, capacity, flags);
+		break;
 	default:
 		return vdisk_i_err(vd, VVD_EVDFORMAT, __LINE__, __func__);
 	}
@@ -144,9 +159,59 @@ int vdisk_create(VDISK *vd, const oschar *path, int format, uint64_t capacity, u
 }
 
 //
-//TODO: vdisk_close(VDISK *vd)
+// vdisk_close
 //
 
+int vdisk_close(VDISK *vd) {
+	if (vd->cache) {
+		vdisk_cache_drop(vd->cache, vd, 0, UINT64_MAX);
+		vd->cache = NULL;
+	}
+
+	os_afree(vd->ra.buffer);
+	vd->ra.buffer = NULL;
+	vd->ra.count = 0;
+
+	switch (vd->format) {
+	case VDISK_FORMAT_VDI:
+		if (vd->vdi->in.map)
+			os_munmap(vd->vdi->in.map, vd->vdi->in.maplen);
+		else
+			free(vd->vdi->in.offsets);
+		break;
+	case VDISK_FORMAT_VHD:
+		vdisk_vhd_close(vd);
+		break;
+	case VDISK_FORMAT_VMDK:
+		vdisk_vmdk_close(vd);
+		break;
+	case VDISK_FORMAT_QED:
+		free(vd->qed->in.L1.offsets);
+		vdisk_qed_close(vd);
+		break;
+	case VDISK_FORMAT_QCOW:
+		vdisk_qcow_close(vd);
+		break;
+	case VDISK_FORMAT_PHDD:
+		vdisk_phdd_close(vd);
+		break;
+	case VDISK_FORMAT_BOCHS:
+		vdisk_bochs_close(vd);
+		break;
+	case VDISK_FORMAT_VHDX:
+		vdisk_vhdx_close(vd);
+		break;
+	}
+
+	free(vd->meta);
+	vd->meta = NULL;
+	vd->format = VDISK_FORMAT_NONE;
+
+	if (os_fclose(vd->fd))
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+
+	return 0;
+}
 
 
 //
@@ -162,6 +227,7 @@ const char* vdisk_str(VDISK *vd) {
 	case VDISK_FORMAT_QED:	return "QED";
 	case VDISK_FORMAT_QCOW:	return "QCOW";
 	case VDISK_FORMAT_PHDD:	return "Parallels";
+	case VDISK_FORMAT_BOCHS:	return "Bochs";
 	case VDISK_FORMAT_RAW:	return "RAW";
 	default:	return NULL; // Not opened, etc.
 	}
@@ -174,24 +240,20 @@ const char* vdisk_str(VDISK *vd) {
 int vdisk_update(VDISK *vd) {
 	switch (vd->format) {
 	case VDISK_FORMAT_VDI:
-		//TODO: Move pre-header signature in creation function
-		if (os_fseek(vd->fd, 0, SEEK_SET))
-			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-		if (os_fwrite(vd->fd, VDI_SIGNATURE, 40))
+		// Pre-header (includes signature), then header
+		if (os_pwrite(vd->fd, &vd->vdi->hdr, sizeof(VDI_HDR), 0))
 			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-		// skip signature
-		if (os_fseek(vd->fd, VDI_SIGNATURE_SIZE, SEEK_SET))
-			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-		if (os_fwrite(vd->fd, &vd->vdi->hdr, sizeof(VDI_HDR)))
-			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-		if (os_fwrite(vd->fd, &vd->vdi->v1, sizeof(VDI_HEADERv1)))
+		if (os_pwrite(vd->fd, &vd->vdi->v1, sizeof(VDI_HEADERv1), sizeof(VDI_HDR)))
 			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
 		// blocks
-		if (os_fseek(vd->fd, vd->vdi->v1.offBlocks, SEEK_SET))
-			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-		if (os_fwrite(vd->fd, vd->vdi->in.offsets, vd->vdi->v1.blk_total << 2))
+		if (os_pwrite(vd->fd, vd->vdi->in.offsets,
+			(size_t)vd->vdi->v1.blk_total << 2, vd->vdi->v1.offBlocks))
 			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
 		break;
+	case VDISK_FORMAT_QCOW:
+		return vdisk_qcow_update(vd);
+	case VDISK_FORMAT_RAW: // No metadata
+		break;
 	/*case VDISK_FORMAT_VMDK:
 		assert(0);
 		break;
@@ -219,14 +281,176 @@ int vdisk_read_sector(VDISK *vd, void *buffer, uint64_t lba) {
 	if (vd->cb.lba_read == NULL)
 		return vdisk_i_err(vd, VVD_EVDTODO, __LINE__, __func__);
 
-	return vd->cb.lba_read(vd, buffer, lba);
+	if (vd->cache || lba == vd->ra.next ||
+		(lba >= vd->ra.lba && lba - vd->ra.lba < vd->ra.count))
+		return vdisk_read_sectors(vd, buffer, lba, 1);
+
+	vd->ra.window = 0;
+	vd->ra.next = lba + 1;
+	switch (vd->cb.lba_read(vd, buffer, lba)) {
+	case 0: return 0;
+	case VVD_EVDUNALLOC: // Same as vdisk_read_sectors
+		memset(buffer, 0, 512);
+		return 0;
+	default: return vd->err.num;
+	}
+}
+
+// Read sectors from the backend
+static int vdisk_i_read_sectors(VDISK *vd, void *buffer, uint64_t lba, uint32_t count) {
+	if (vd->cb.lba_readn)
+		return vd->cb.lba_readn(vd, buffer, lba, count);
+
+	if (vd->cb.lba_read == NULL)
+		return vdisk_i_err(vd, VVD_EVDTODO, __LINE__, __func__);
+
+	// Fallback: One sector at a time
+	uint8_t *buf = buffer;
+	for (uint32_t i = 0; i < count; ++i, buf += 512) {
+		switch (vd->cb.lba_read(vd, buf, lba + i)) {
+		case 0: continue;
+		case VVD_EVDUNALLOC:
+			memset(buf, 0, 512);
+			continue;
+		default: return vd->err.num;
+		}
+	}
+
+	return 0;
+}
+
+// Read sectors, reading ahead of sequential requests. The window doubles on
+// each refill and is clipped to the end of the allocated run, which is one
+// physical read for most formats. Unallocated sectors cost no I/O and are
+// not read ahead.
+static int vdisk_i_read_ahead(VDISK *vd, uint8_t *buffer, uint64_t lba, uint32_t count) {
+	if (lba != vd->ra.next)
+		vd->ra.window = 0;
+	int streaming = lba == vd->ra.next;
+	vd->ra.next = lba + count;
+
+	if (lba >= vd->ra.lba && lba - vd->ra.lba < vd->ra.count) {
+		uint32_t n = vd->ra.lba + vd->ra.count - lba;
+		if (n > count)
+			n = count;
+		memcpy(buffer, vd->ra.buffer + ((size_t)(lba - vd->ra.lba) << 9), (size_t)n << 9);
+		if ((count -= n) == 0)
+			return 0;
+		buffer += (size_t)n << 9;
+		lba += n;
+		streaming = 1;
+	}
+
+	if (streaming == 0)
+		return vdisk_i_read_sectors(vd, buffer, lba, count);
+
+	uint32_t window = vd->ra.window ? vd->ra.window << 1 : VDISK_READAHEAD_MIN;
+	if (window > VDISK_READAHEAD_MAX)
+		window = VDISK_READAHEAD_MAX;
+	vd->ra.window = window;
+	if (count >= window)
+		return vdisk_i_read_sectors(vd, buffer, lba, count);
+
+	uint64_t end = lba + window;
+	uint64_t total = BYTE_TO_SECTOR(vd->capacity);
+	if (end > total)
+		end = total;
+	uint32_t bsectors = vd->blksize >> 9;
+	if (bsectors) {
+		uint64_t boundary = end - end % bsectors;
+		if (boundary > lba)
+			end = boundary;
+		if (vd->cb.blk_map) {
+			uint64_t pos, run = 1;
+			uint64_t index = lba / bsectors;
+			if (vd->cb.blk_map(vd, index, &pos, &run) != VDISK_EXTENT_DATA)
+				return vdisk_i_read_sectors(vd, buffer, lba, count);
+			if (end > (index + run) * bsectors)
+				end = (index + run) * bsectors;
+		}
+	}
+	if (end <= lba + count)
+		return vdisk_i_read_sectors(vd, buffer, lba, count);
+
+	if (vd->ra.buffer == NULL &&
+		(vd->ra.buffer = os_amalloc((size_t)VDISK_READAHEAD_MAX << 9)) == NULL)
+		return vdisk_i_read_sectors(vd, buffer, lba, count);
+
+	vd->ra.count = 0;
+	int e = vdisk_i_read_sectors(vd, vd->ra.buffer, lba, (uint32_t)(end - lba));
+	if (e)
+		return e;
+	vd->ra.lba = lba;
+	vd->ra.count = (uint32_t)(end - lba);
+	memcpy(buffer, vd->ra.buffer, (size_t)count << 9);
+	return 0;
+}
+
+// Read sectors through the block cache. Missing blocks are read whole from
+// the backend, directly into the buffer if it covers them.
+static int vdisk_i_read_cached(VDISK *vd, uint8_t *buffer, uint64_t lba, uint32_t count) {
+	uint64_t total = BYTE_TO_SECTOR(vd->capacity);
+	uint8_t *scratch = NULL;
+	int e = 0;
+
+	while (count) {
+		uint64_t block = lba / VDISK_CACHE_SECTORS;
+		uint32_t skip = lba % VDISK_CACHE_SECTORS;
+		uint32_t n = VDISK_CACHE_SECTORS - skip;
+		if (n > count)
+			n = count;
+
+		if (vdisk_cache_read(vd->cache, vd, block, buffer, skip << 9, n << 9))
+			goto L_NEXT;
+
+		uint64_t first = block * VDISK_CACHE_SECTORS;
+		if (first >= total) { // Out of bounds, let the backend decide
+			e = vdisk_i_read_ahead(vd, buffer, lba, count);
+			break;
+		}
+		uint32_t avail = total - first < VDISK_CACHE_SECTORS ?
+			(uint32_t)(total - first) : VDISK_CACHE_SECTORS;
+
+		uint8_t *dst = buffer;
+		if (n < VDISK_CACHE_SECTORS || avail < VDISK_CACHE_SECTORS) {
+			if (scratch == NULL && (scratch = malloc(VDISK_CACHE_BLOCKSIZE)) == NULL) {
+				e = vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+				break;
+			}
+			dst = scratch;
+			memset(dst + ((size_t)avail << 9), 0, (size_t)(VDISK_CACHE_SECTORS - avail) << 9);
+		}
+
+		if ((e = vdisk_i_read_ahead(vd, dst, first, avail)))
+			break;
+		vdisk_cache_insert(vd->cache, vd, block, dst);
+		if (dst != buffer)
+			memcpy(buffer, dst + ((size_t)skip << 9), (size_t)n << 9);
+
+L_NEXT:
+		buffer += (size_t)n << 9;
+		lba += n;
+		count -= n;
+	}
+
+	free(scratch);
+	return e;
 }
 
 //
-//TODO: Consider vdisk_read_sectors
-//      Read multiple sectors at once
+// vdisk_read_sectors
 //
 
+int vdisk_read_sectors(VDISK *vd, void *buffer, uint64_t lba, uint32_t count) {
+	if (count == 0)
+		return 0;
+
+	if (vd->cache)
+		return vdisk_i_read_cached(vd, buffer, lba, count);
+
+	return vdisk_i_read_ahead(vd, buffer, lba, count);
+}
+
 //
 // vdisk_write_lba
 //
@@ -238,15 +462,44 @@ int vdisk_write_lba(VDISK *vd, void *buffer, uint64_t lba) {
 	return VVD_EOK;
 }
 
+//
+// vdisk_i_block_size
+//
+
+// Get the size of a block within capacity, zero the remainder of buffer
+static size_t vdisk_i_block_size(VDISK *vd, void *buffer, uint64_t index) {
+	uint64_t base = index * vd->blksize;
+	size_t size = vd->blksize;
+	if (base + size > vd->capacity) {
+		size = (size_t)(vd->capacity - base);
+		memset((uint8_t*)buffer + size, 0, vd->blksize - size);
+	}
+	return size;
+}
+
 //
 // vdisk_read_block
 //
 
 int vdisk_read_block(VDISK *vd, void *buffer, uint64_t index) {
+	if (vd->cb.blk_read) {
+		int e = vd->cb.blk_read(vd, buffer, index);
+		return e ? vdisk_i_err(vd, e, __LINE__, __func__) : 0;
+	}
+	if (vd->cb.blk_locate == NULL)
+		return vdisk_i_err(vd, VVD_EVDTODO, __LINE__, __func__);
+	if (index >= vd->blkcount)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
 
-	assert(0);
+	uint64_t pos;
+	if (vd->cb.blk_locate(vd, index, &pos))
+		return vd->err.num;
 
-	return VVD_EOK;
+	size_t size = vdisk_i_block_size(vd, buffer, index);
+	if (os_pread(vd->fd, buffer, size, pos))
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+
+	return 0;
 }
 
 //
@@ -254,10 +507,19 @@ int vdisk_read_block(VDISK *vd, void *buffer, uint64_t index) {
 //
 
 int vdisk_write_block(VDISK *vd, void *buffer, uint64_t index) {
+	if (vd->cb.blk_write == NULL)
+		return vdisk_i_err(vd, VVD_EVDTODO, __LINE__, __func__);
+	if (index >= vd->blkcount)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
 
-	assert(0);
+	vd->ra.count = 0;
+	if (vd->cache) {
+		uint64_t start = index * vd->blksize;
+		vdisk_cache_drop(vd->cache, vd, start / VDISK_CACHE_BLOCKSIZE,
+			(start % VDISK_CACHE_BLOCKSIZE + vd->blksize + VDISK_CACHE_BLOCKSIZE - 1) / VDISK_CACHE_BLOCKSIZE);
+	}
 
-	return VVD_EOK;
+	return vd->cb.blk_write(vd, buffer, index);
 }
 
 //
@@ -271,6 +533,156 @@ int vdisk_write_block_at(VDISK *vd, void *buffer, uint64_t bindex, uint64_t dind
 	return VVD_EOK;
 }
 
+//
+// vdisk_get_extents
+//
+
+int vdisk_get_extents(VDISK *vd, uint64_t offset, uint64_t length, VDISK_EXTENT **extents, size_t *count) {
+	if (extents == NULL || count == NULL)
+		return vdisk_i_err(vd, VVD_ENULL, __LINE__, __func__);
+	if (vd->blksize == 0 || (vd->cb.blk_map == NULL && vd->cb.blk_locate == NULL))
+		return vdisk_i_err(vd, VVD_EVDTODO, __LINE__, __func__);
+	if (offset > vd->capacity)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+	if (length > vd->capacity - offset)
+		length = vd->capacity - offset;
+
+	size_t cap = 16, n = 0;
+	if (length == 0) {
+		*extents = NULL;
+		*count = 0;
+		return 0;
+	}
+	VDISK_EXTENT *list = malloc(cap * sizeof(VDISK_EXTENT));
+	if (list == NULL)
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+
+	uint64_t end = offset + length;
+	uint64_t bsize = vd->blksize;
+	uint64_t index = offset / bsize;
+	uint64_t last = (end + bsize - 1) / bsize;
+	if (last > vd->blkcount)
+		last = vd->blkcount;
+
+	while (index < last) {
+		uint64_t pos = 0, span = 1;
+		int state;
+		if (vd->cb.blk_map) {
+			state = vd->cb.blk_map(vd, index, &pos, &span);
+		} else switch (vd->cb.blk_locate(vd, index, &pos)) {
+		case 0: state = VDISK_EXTENT_DATA; break;
+		case VVD_EVDUNALLOC: state = VDISK_EXTENT_UNALLOC; break;
+		default: state = vd->err.num; break;
+		}
+		if (state < 0) {
+			free(list);
+			return state;
+		}
+		if (state != VDISK_EXTENT_DATA)
+			pos = 0;
+		if (span == 0 || span > last - index)
+			span = last - index;
+
+		uint64_t voff = index * bsize;
+		uint64_t vlen = span * bsize;
+		VDISK_EXTENT *e = n ? list + n - 1 : NULL;
+		if (e && e->state == (uint32_t)state &&
+			(state != VDISK_EXTENT_DATA || e->position + e->length == pos)) {
+			e->length += vlen;
+		} else {
+			if (n == cap) {
+				VDISK_EXTENT *t = realloc(list, (cap <<= 1) * sizeof(VDISK_EXTENT));
+				if (t == NULL) {
+					free(list);
+					return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+				}
+				list = t;
+			}
+			e = list + n++;
+			e->offset = voff;
+			e->length = vlen;
+			e->position = pos;
+			e->state = state;
+		}
+		index += span;
+	}
+
+	// Clip to range
+	if (n) {
+		uint64_t d = offset - list[0].offset;
+		list[0].offset += d;
+		list[0].length -= d;
+		if (list[0].state == VDISK_EXTENT_DATA)
+			list[0].position += d;
+		VDISK_EXTENT *e = list + n - 1;
+		if (e->offset + e->length > end)
+			e->length = end - e->offset;
+	}
+
+	*extents = list;
+	*count = n;
+	return 0;
+}
+
+//
+// vdisk_i_advise
+//
+
+void vdisk_i_advise(VDISK *vd, int advice) {
+	os_fadvise(vd->fd, 0, 0, advice);
+
+	void *map;
+	size_t maplen;
+	switch (vd->format) {
+	case VDISK_FORMAT_VDI:
+		map = vd->vdi->in.map;
+		maplen = vd->vdi->in.maplen;
+		break;
+	case VDISK_FORMAT_VHD:
+		map = vd->vhd->in.map;
+		maplen = vd->vhd->in.maplen;
+		break;
+	case VDISK_FORMAT_VHDX:
+		map = vd->vhdx->in.map;
+		maplen = vd->vhdx->in.maplen;
+		break;
+	case VDISK_FORMAT_PHDD:
+		map = vd->phdd->in.map;
+		maplen = vd->phdd->in.maplen;
+		break;
+	default: return;
+	}
+	if (map)
+		os_madvise(map, maplen, advice);
+}
+
+//
+// vdisk_i_drop
+//
+
+void vdisk_i_drop(VDISK *vd, uint64_t position, uint64_t length) {
+	uint64_t start = position - position % VDISK_DROP_ALIGN;
+	uint64_t end = position + length;
+	end -= end % VDISK_DROP_ALIGN;
+	if (end > start)
+		os_fadvise(vd->fd, start, end - start, OS_ADVICE_DONTNEED);
+}
+
+//
+// vdisk_i_falloc
+//
+
+int vdisk_i_falloc(VDISK *vd, uint64_t position, uint64_t length, uint32_t flags, int mode) {
+	switch (flags & VDISK_CREATE_ALLOC_MASK) {
+	case VDISK_CREATE_SPARSE:  mode = OS_FALLOC_SPARSE; break;
+	case VDISK_CREATE_RESERVE: mode = OS_FALLOC_RESERVE; break;
+	case VDISK_CREATE_ZERO:    mode = OS_FALLOC_ZERO; break;
+	}
+	if (os_falloc(vd->fd, position, length, mode))
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	return 0;
+}
+
 //
 // vdisk_op_compact
 //
@@ -284,6 +696,411 @@ int vdisk_op_compact(VDISK *vd, void(*cb)(uint32_t, void*)) {
 	}
 }
 
+//
+// vdisk_op_convert
+//
+
+enum {	// Convert slot states
+	VDISK_CONV_FREE,	// Available to readers
+	VDISK_CONV_READING,	// Claimed by a reader
+	VDISK_CONV_READ,	// Data available for checker
+	VDISK_CONV_CHECKED,	// Zero-checked, available for writer
+};
+
+// Input block position markers
+#define VDISK_CONV_NOPOS UINT64_MAX	// No data, zero-filled
+#define VDISK_CONV_DONE (UINT64_MAX - 1)	// Already read by the resolver
+
+typedef struct {
+	uint8_t *buffer;	// Unit data
+	uint8_t *zero;	// Per output block: all-zero
+	uint64_t *pos;	// Per input block: file position, or VDISK_CONV_NOPOS
+	uint64_t unit;	// Unit index
+	uint32_t state;	// See VDISK_CONV enumeration
+} vdisk_conv_slot;
+
+typedef struct {
+	// Synchronization objects first, see os.h
+	__OSMUTEX mutex;
+	__OSCOND cond;
+	VDISK *in, *out;
+	vdisk_conv_slot *slots;
+	uint64_t unit;	// Unit size in bytes
+	uint64_t units;	// Number of units
+	uint64_t next;	// Next unit to inspect by readers
+	uint64_t seqread;	// Next sequence to claim by readers
+	uint64_t seqcheck;	// Next sequence for the checker
+	uint64_t seqwrite;	// Next sequence for the writer
+	uint32_t depth;	// Number of slots
+	uint32_t readers;	// Readers still running
+	uint32_t inblocks;	// Input blocks per unit
+	uint32_t outblocks;	// Output blocks per unit
+	VDISK *failed;	// First VDISK that failed, if any
+	int direct;	// Input lacks block locations, read sectors
+	int decode;	// Input blocks are decoded with blk_read
+} vdisk_conv_ctx;
+
+// Reader: Reap a block read of a unit and drop it behind the cursor
+static int vdisk_i_conv_reap(vdisk_conv_ctx *c, struct os_aio_t *aio, vdisk_conv_slot *slot) {
+	uint64_t i;
+	int e = os_aio_wait(aio, &i);
+	if (e == 0) {
+		uint64_t base = (slot->unit * c->inblocks + i) * c->in->blksize;
+		uint64_t size = c->in->capacity - base;
+		vdisk_i_drop(c->in, slot->pos[i], size < c->in->blksize ? size : c->in->blksize);
+	}
+	return e;
+}
+
+// Reader: Claim the next unit holding data and read it
+static void vdisk_i_conv_reader(void *arg) {
+	vdisk_conv_ctx *c = arg;
+	VDISK *in = c->in;
+
+	// Block reads of a unit are all queued at once
+	struct os_aio_t aio;
+	int async = c->direct == 0 && c->decode == 0;
+
+	os_mutex_lock(&c->mutex);
+	if (async && os_aio_init(&aio, c->inblocks, NULL, 0)) {
+		if (c->failed == NULL) {
+			vdisk_i_err(in, VVD_ENOMEM, __LINE__, __func__);
+			c->failed = in;
+		}
+		async = 0;
+		goto L_EXIT;
+	}
+	for (;;) {
+		vdisk_conv_slot *slot = c->slots + (c->seqread % c->depth);
+		while (c->failed == NULL && slot->state != VDISK_CONV_FREE) {
+			os_cond_wait(&c->cond, &c->mutex);
+			slot = c->slots + (c->seqread % c->depth);
+		}
+		if (c->failed || c->next >= c->units)
+			break;
+
+		// Resolve input block positions (metadata), skip empty units
+		int data = 0;
+		uint64_t unit;
+		if (c->direct) {
+			unit = c->next++;
+			data = 1;
+		} else {
+			for (; data == 0 && c->next < c->units;) {
+				unit = c->next++;
+				uint64_t base = unit * c->inblocks;
+				for (uint32_t i = 0; i < c->inblocks; ++i) {
+					uint64_t *pos = slot->pos + i;
+					if (base + i >= in->blkcount) {
+						*pos = VDISK_CONV_NOPOS;
+						continue;
+					}
+					if (c->decode) {
+						uint64_t n;
+						int state = in->cb.blk_map(in, base + i, pos, &n);
+						if (state == VDISK_EXTENT_DATA) {
+							data = 1;
+							continue;
+						}
+						if (state >= 0) {
+							*pos = VDISK_CONV_NOPOS;
+							continue;
+						}
+					} else switch (in->cb.blk_locate(in, base + i, pos)) {
+					case 0: data = 1; continue;
+					case VVD_EVDUNALLOC: *pos = VDISK_CONV_NOPOS; continue;
+					case VVD_EVDTYPE: { // Not stored as-is, read through the format
+						uint64_t offset = (base + i) * in->blksize;
+						uint64_t size = in->capacity - offset;
+						uint8_t *buf = slot->buffer + ((size_t)i * in->blksize);
+						if (size > in->blksize)
+							size = in->blksize;
+						else
+							memset(buf + size, 0, in->blksize - size);
+						if (vdisk_read_sectors(in, buf, BYTE_TO_SECTOR(offset),
+							(uint32_t)BYTE_TO_SECTOR(size)))
+							break;
+						*pos = VDISK_CONV_DONE;
+						data = 1;
+						continue;
+					}
+					}
+					c->failed = in;
+					goto L_EXIT;
+				}
+			}
+		}
+		if (data == 0)
+			break;
+
+		slot->unit = unit;
+		slot->state = VDISK_CONV_READING;
+		++c->seqread;
+
+		if (c->direct) {
+			// Serialized, metadata is accessed while reading
+			uint64_t lba = BYTE_TO_SECTOR(unit * c->unit);
+			uint64_t size = c->unit;
+			if (SECTOR_TO_BYTE(lba) + size > in->capacity) {
+				size = in->capacity - SECTOR_TO_BYTE(lba);
+				memset(slot->buffer + size, 0, c->unit - size);
+			}
+			if (vdisk_read_sectors(in, slot->buffer, lba, (uint32_t)BYTE_TO_SECTOR(size))) {
+				c->failed = in;
+				break;
+			}
+		} else {
+			// Data reads are done in parallel
+			os_mutex_unlock(&c->mutex);
+			uint32_t bsize = in->blksize;
+			int e = 0;
+			for (uint32_t i = 0; e == 0 && i < c->inblocks; ++i) {
+				uint8_t *buf = slot->buffer + ((size_t)i * bsize);
+				if (slot->pos[i] == VDISK_CONV_NOPOS) {
+					memset(buf, 0, bsize);
+					continue;
+				}
+				if (slot->pos[i] == VDISK_CONV_DONE)
+					continue;
+				uint64_t base = (unit * c->inblocks + i) * bsize;
+				size_t size = bsize;
+				if (base + size > in->capacity) {
+					size = (size_t)(in->capacity - base);
+					memset(buf + size, 0, bsize - size);
+				}
+				if (c->decode) {
+					if ((e = in->cb.blk_read(in, buf, unit * c->inblocks + i)))
+						break;
+					if (size < bsize)
+						memset(buf + size, 0, bsize - size);
+				} else {
+					// Make room if the unit has more blocks than the
+					// queue depth
+					while (e == 0 &&
+						os_aio_read(&aio, in->fd, buf, size, slot->pos[i], i))
+						e = vdisk_i_conv_reap(c, &aio, slot);
+				}
+			}
+			// Reap until nothing is in flight, requests left queued
+			// after a failed submission are reaped by os_aio_end
+			while (async && (aio.inflight || aio.queued)) {
+				int r = vdisk_i_conv_reap(c, &aio, slot);
+				if (e == 0)
+					e = r;
+				if (r && aio.inflight == 0)
+					break;
+			}
+			os_mutex_lock(&c->mutex);
+			if (e) {
+				if (c->failed == NULL) {
+					// Decoding errors are returned by blk_read, not set
+					vdisk_i_err(in, c->decode ? e : VVD_EOS, __LINE__, __func__);
+					c->failed = in;
+				}
+				break;
+			}
+		}
+
+		slot->state = VDISK_CONV_READ;
+		os_cond_broadcast(&c->cond);
+	}
+L_EXIT:
+	--c->readers;
+	os_cond_broadcast(&c->cond);
+	os_mutex_unlock(&c->mutex);
+	if (async)
+		os_aio_end(&aio);
+}
+
+// Checker: Detect all-zero output blocks, in order
+static void vdisk_i_conv_checker(void *arg) {
+	vdisk_conv_ctx *c = arg;
+	size_t bsize = c->out->blksize;
+
+	os_mutex_lock(&c->mutex);
+	for (;;) {
+		vdisk_conv_slot *slot = c->slots + (c->seqcheck % c->depth);
+		while (c->failed == NULL && slot->state != VDISK_CONV_READ &&
+			(c->readers || c->seqcheck < c->seqread))
+			os_cond_wait(&c->cond, &c->mutex);
+		if (c->failed || slot->state != VDISK_CONV_READ)
+			break;
+		os_mutex_unlock(&c->mutex);
+
+		for (uint32_t i = 0; i < c->outblocks; ++i)
+			slot->zero[i] = iszero(slot->buffer + (i * bsize), bsize);
+
+		os_mutex_lock(&c->mutex);
+		slot->state = VDISK_CONV_CHECKED;
+		++c->seqcheck;
+		os_cond_broadcast(&c->cond);
+	}
+	os_mutex_unlock(&c->mutex);
+}
+
+int vdisk_op_convert(VDISK *in, VDISK *out, uint32_t readers, uint32_t depth, void(*cb)(uint32_t, void*)) {
+	if (out->blksize == 0 || out->cb.blk_write == NULL)
+		return vdisk_i_err(out, VVD_EVDTODO, __LINE__, __func__);
+	if (in->capacity > out->capacity)
+		return vdisk_i_err(out, VVD_EVDBOUND, __LINE__, __func__);
+
+	vdisk_conv_ctx *c = calloc(1, sizeof(vdisk_conv_ctx));
+	if (c == NULL)
+		return vdisk_i_err(out, VVD_ENOMEM, __LINE__, __func__);
+
+	c->in = in;
+	c->out = out;
+	c->decode = in->cb.blk_locate == NULL && in->cb.blk_read && in->cb.blk_map;
+	c->direct = (in->cb.blk_locate == NULL && c->decode == 0) || in->blksize == 0;
+
+	// A unit covers whole blocks of both sides (sizes are powers of 2)
+	c->unit = out->blksize;
+	if (c->direct == 0 && in->blksize > c->unit)
+		c->unit = in->blksize;
+	c->units = (in->capacity + c->unit - 1) / c->unit;
+	c->inblocks = c->direct ? 0 : (uint32_t)(c->unit / in->blksize);
+	c->outblocks = (uint32_t)(c->unit / out->blksize);
+
+	if (readers == 0) // Decoding is processor-bound
+		readers = c->decode ? os_cpu_count() : VDISK_CONVERT_READERS;
+	if (depth == 0)
+		depth = VDISK_CONVERT_DEPTH;
+	if (depth * c->unit > VDISK_CONVERT_MEMORY)
+		depth = (uint32_t)(VDISK_CONVERT_MEMORY / c->unit);
+	if (depth < 2)
+		depth = 2;
+	c->depth = depth;
+
+	int e = 0;
+	if ((c->slots = calloc(depth, sizeof(vdisk_conv_slot))) == NULL) {
+		e = vdisk_i_err(out, VVD_ENOMEM, __LINE__, __func__);
+		goto L_FREE;
+	}
+	for (uint32_t i = 0; i < depth; ++i) {
+		vdisk_conv_slot *slot = c->slots + i;
+		slot->buffer = os_amalloc(c->unit);
+		slot->zero = malloc(c->outblocks);
+		slot->pos = malloc((c->inblocks + 1) * sizeof(uint64_t));
+		if (slot->buffer == NULL || slot->zero == NULL || slot->pos == NULL) {
+			e = vdisk_i_err(out, VVD_ENOMEM, __LINE__, __func__);
+			goto L_FREE;
+		}
+	}
+
+	os_mutex_init(&c->mutex);
+	os_cond_init(&c->cond);
+
+	if (cb) cb(VVD_NOTIF_VDISK_TOTAL_BLOCKS64, &c->units);
+
+	// Each byte is read once, in ascending order
+	vdisk_i_advise(in, OS_ADVICE_SEQUENTIAL);
+
+	// Start pipeline
+	__OSTHREAD checker;
+	__OSTHREAD *threads = malloc(readers * sizeof(__OSTHREAD));
+	if (threads == NULL) {
+		e = vdisk_i_err(out, VVD_ENOMEM, __LINE__, __func__);
+		goto L_DESTROY;
+	}
+	uint32_t started = 0;
+	for (; started < readers; ++started) {
+		os_mutex_lock(&c->mutex);
+		++c->readers;
+		os_mutex_unlock(&c->mutex);
+		if (os_thread_create(threads + started, vdisk_i_conv_reader, c)) {
+			os_mutex_lock(&c->mutex);
+			--c->readers;
+			os_mutex_unlock(&c->mutex);
+			break;
+		}
+	}
+	int checking = started && os_thread_create(&checker, vdisk_i_conv_checker, c) == 0;
+	if (checking == 0) {
+		os_mutex_lock(&c->mutex);
+		vdisk_i_err(out, VVD_EOS, __LINE__, __func__);
+		c->failed = out;
+		os_cond_broadcast(&c->cond);
+		os_mutex_unlock(&c->mutex);
+	}
+
+	// Writer: Write non-zero output blocks, in order. Cached pages of the
+	// output, and of the input if its data positions are unknown to
+	// readers, are dropped periodically.
+	uint32_t bsize = out->blksize;
+	uint64_t written = 0;
+	os_mutex_lock(&c->mutex);
+	for (;;) {
+		vdisk_conv_slot *slot = c->slots + (c->seqwrite % c->depth);
+		while (c->failed == NULL && slot->state != VDISK_CONV_CHECKED &&
+			(c->readers || c->seqwrite < c->seqread))
+			os_cond_wait(&c->cond, &c->mutex);
+		if (c->failed || slot->state != VDISK_CONV_CHECKED)
+			break;
+		os_mutex_unlock(&c->mutex);
+
+		uint64_t base = slot->unit * c->outblocks;
+		int we = 0;
+		for (uint32_t i = 0; i < c->outblocks; ++i) {
+			if (slot->zero[i] || base + i >= out->blkcount)
+				continue;
+			if ((we = vdisk_write_block(out, slot->buffer + ((size_t)i * bsize), base + i)))
+				break;
+			written += bsize;
+		}
+		if (written >= VDISK_CONVERT_DROP) {
+			os_fadvise(out->fd, 0, 0, OS_ADVICE_DONTNEED);
+			if (c->direct || c->decode)
+				os_fadvise(in->fd, 0, 0, OS_ADVICE_DONTNEED);
+			written = 0;
+		}
+		if (cb) cb(VVD_NOTIF_VDISK_CURRENT_BLOCK64, &slot->unit);
+
+		os_mutex_lock(&c->mutex);
+		if (we) {
+			c->failed = out;
+			os_cond_broadcast(&c->cond);
+			break;
+		}
+		slot->state = VDISK_CONV_FREE;
+		++c->seqwrite;
+		os_cond_broadcast(&c->cond);
+	}
+	os_mutex_unlock(&c->mutex);
+
+	for (uint32_t i = 0; i < started; ++i)
+		os_thread_join(threads[i]);
+	if (checking)
+		os_thread_join(checker);
+	free(threads);
+
+	if (c->failed) {
+		if (c->failed != out)
+			out->err = c->failed->err;
+		e = out->err.num;
+	} else if (vdisk_update(out))
+		e = out->err.num;
+
+	if (cb) cb(VVD_NOTIF_DONE, NULL);
+
+L_DESTROY:
+	os_fadvise(in->fd, 0, 0, OS_ADVICE_DONTNEED);
+	os_fadvise(out->fd, 0, 0, OS_ADVICE_DONTNEED);
+	vdisk_i_advise(in, OS_ADVICE_NORMAL);
+	os_cond_destroy(&c->cond);
+	os_mutex_destroy(&c->mutex);
+L_FREE:
+	if (c->slots) {
+		for (uint32_t i = 0; i < depth; ++i) {
+			os_afree(c->slots[i].buffer);
+			free(c->slots[i].zero);
+			free(c->slots[i].pos);
+		}
+		free(c->slots);
+	}
+	free(c);
+	return e;
+}
+
 //
 // vdisk_error
 //
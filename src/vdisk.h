@@ -2,6 +2,7 @@
 
 #include "os.h"
 #include "utils.h"
+#include "cache.h"
 #include "vdisk/raw.h"
 #include "vdisk/vdi.h"
 #include "vdisk/vmdk.h"
@@ -10,6 +11,7 @@
 #include "vdisk/qed.h"
 #include "vdisk/qcow.h"
 #include "vdisk/phdd.h"
+#include "vdisk/bochs.h"
 
 #define VDISK_M_ERR(vd,ERR)	vdisk_i_err(vd,ERR,__LINE__,__func__)
 
@@ -29,13 +31,36 @@ enum {	// DISKFORMAT magical hints (LSB), used for VDISK.format
 	VDISK_FORMAT_QED	= 0x00444551,	// "QED\0" QEMU Enhanced Disk
 	VDISK_FORMAT_QCOW	= 0xFB494651,	// "QFI\xFB" QEMU Copy-On-Write, v1/v2
 	VDISK_FORMAT_PHDD	= 0x68746957,	// "With" Parallels HDD
-	VDISK_FORMAT_BOCHS	= 0x68636F68,	// "Boch" Bochs Virtual HD Image
+	VDISK_FORMAT_BOCHS	= 0x68636F42,	// "Boch" Bochs Virtual HD Image
 //	VDISK_FORMAT_DMG	= 0x,	// "" Apple DMG
 };
 #else
 
 #endif
 
+enum {
+	// Block size used for formats without allocation units (e.g. raw)
+	VDISK_BLOCKSIZE_RAW	= 1024 * 1024,
+
+	// vdisk_op_convert: Default number of reader threads
+	VDISK_CONVERT_READERS	= 4,
+	// vdisk_op_convert: Default number of blocks in flight
+	VDISK_CONVERT_DEPTH	= 16,
+	// vdisk_op_convert: Upper memory bound for blocks in flight
+	VDISK_CONVERT_MEMORY	= 256 * 1024 * 1024,
+	// vdisk_op_convert: Bytes written between dropping cached pages
+	VDISK_CONVERT_DROP	= 64 * 1024 * 1024,
+	// Alignment of ranges dropped from the OS cache. Cached pages can be
+	// grouped up to this size (e.g. 2 MiB folios on Linux), and are only
+	// dropped if the whole group is within the range.
+	VDISK_DROP_ALIGN	= 2 * 1024 * 1024,
+
+	// vdisk_read_sectors: Initial readahead window in sectors
+	VDISK_READAHEAD_MIN	= 128 * 1024 / 512,
+	// vdisk_read_sectors: Largest readahead window in sectors
+	VDISK_READAHEAD_MAX	= 4 * 1024 * 1024 / 512,
+};
+
 enum {	// VDISK flags, the open/create flags may overlap
 	VDISK_RAW	= 0x1,	// Open or create vdisk as raw
 
@@ -43,6 +68,16 @@ enum {	// VDISK flags, the open/create flags may overlap
 	// vdisk_open flags
 	//
 
+	// Map the allocation table in memory instead of reading it, pages are
+	// loaded on access. Changes are private until written by vdisk_update.
+	VDISK_OPEN_MMAP	= 0x10,
+	// Replay a pending VHDX log into the file. Otherwise, the log is only
+	// replayed in memory and the file is left untouched.
+	VDISK_OPEN_LOG_REPLAY	= 0x20,
+	// Bypass the OS cache with direct I/O (e.g. O_DIRECT), if the file
+	// system allows it. Otherwise, the file is opened normally.
+	VDISK_OPEN_DIRECT	= 0x40,
+
 	VDISK_OPEN_VDI_ONLY	= 0x1000,	//TODO: Only open successfully if VDISK is VDI
 	VDISK_OPEN_VMDK_ONLY	= 0x2000,	//TODO: Only open successfully if VDISK is VMDK
 	VDISK_OPEN_VHD_ONLY	= 0x3000,	//TODO: Only open successfully if VDISK is VHD
@@ -50,13 +85,19 @@ enum {	// VDISK flags, the open/create flags may overlap
 	VDISK_OPEN_QED_ONLY	= 0x5000,	//TODO: Only open successfully if VDISK is QED
 	VDISK_OPEN_QCOW_ONLY	= 0x6000,	//TODO: Only open successfully if VDISK is QCOW
 	VDISK_OPEN_PHDD_ONLY	= 0x7000,	//TODO: Only open successfully if VDISK is Parallels HDD
-	VDISK_OPEN_BOCHS_ONLY	= 0x8000,	//TODO: Only open successfully if VDISK is Parallels HDD
+	VDISK_OPEN_BOCHS_ONLY	= 0x8000,	//TODO: Only open successfully if VDISK is Bochs
 
 	//
 	// vdisk_create flags
 	//
 
 	VDISK_CREATE_TEMP	= 0x0100,	//TODO: Create a temporary (random) vdisk file
+	VDISK_CREATE_DIRECT	= 0x0200,	// Like VDISK_OPEN_DIRECT, for the created file
+
+	VDISK_CREATE_SPARSE	= 0x0400,	// Preallocate fixed data by setting the file size only
+	VDISK_CREATE_RESERVE	= 0x0800,	// Preallocate fixed data by reserving disk space
+	VDISK_CREATE_ZERO	= 0x0C00,	// Preallocate fixed data by writing zeros
+	VDISK_CREATE_ALLOC_MASK	= 0x0C00,	// Preallocation mask used internally
 
 	VDISK_CREATE_TYPE_DYNAMIC	= 0x1000,	//TODO: Create a dynamic type VDISK
 	VDISK_CREATE_TYPE_FIXED	= 0x2000,	//TODO: Create a fixed type VDISK
@@ -102,10 +143,25 @@ enum {
 	VVD_NOTIF_VDISK_CURRENT_BLOCK64,
 };
 
+enum {	// VDISK extent states
+	VDISK_EXTENT_UNALLOC	= 0,	// Not allocated, reads as zeros
+	VDISK_EXTENT_ZERO	= 1,	// Marked as zeros, no data in file
+	VDISK_EXTENT_DATA	= 2,	// Data present in file
+	VDISK_EXTENT_PARENT	= 3,	// Data present in a parent image, no file position
+};
+
 //
 // Structure definitions
 //
 
+// Describes a range of the virtual disk sharing the same allocation state.
+typedef struct VDISK_EXTENT {
+	uint64_t offset;	// Virtual offset in bytes
+	uint64_t length;	// Length in bytes
+	uint64_t position;	// File position of the data, DATA state only
+	uint32_t state;	// See VDISK_EXTENT enumeration
+} VDISK_EXTENT;
+
 // Defines a virtual disk.
 // All fields are more or less internal.
 typedef struct VDISK {
@@ -122,8 +178,29 @@ typedef struct VDISK {
 	// Virtual disk capacity in bytes. For RAW files, it's the file size. For
 	// RAW devices, it's the disk size. This is populated automatically.
 	uint64_t capacity;
+	// Allocation unit size in bytes (block, cluster). For formats without
+	// allocation units, it is VDISK_BLOCKSIZE_RAW. This is populated by
+	// backends implementing the blk_locate callback.
+	uint32_t blksize;
+	// Number of allocation units covering the capacity.
+	uint64_t blkcount;
 	// (Posix) File descriptor (Windows) File HANDLE
 	__OSFILE fd;
+	// Path given to vdisk_open, used to find related files (e.g. parent
+	// images). Only valid while opening.
+	const oschar *path;
+	// Block cache used by vdisk_read_sector and vdisk_read_sectors, can be
+	// shared between handles. Cleared when opening, set it afterwards.
+	struct VDISK_CACHE *cache;
+	// Readahead state of vdisk_read_sectors. A request starting where the
+	// previous one ended continues a stream, which grows the window.
+	struct {
+		uint8_t *buffer;	// VDISK_READAHEAD_MAX sectors, allocated on use
+		uint64_t lba;	// First sector held in buffer
+		uint32_t count;	// Number of sectors held in buffer
+		uint32_t window;	// Window in sectors, 0 if not streaming
+		uint64_t next;	// Sector following the previous request
+	} ra;
 	// Error structure
 	struct {
 		int num;	// Error number
@@ -134,12 +211,23 @@ typedef struct VDISK {
 	struct {
 		// Read from a disk sector with a LBA index
 		int (*lba_read)(struct VDISK*, void*, uint64_t);
+		// Read a number of disk sectors starting at a LBA index
+		int (*lba_readn)(struct VDISK*, void*, uint64_t, uint32_t);
 		// Write to a disk sector with a LBA index
 		int (*lba_write)(struct VDISK*, void*, uint64_t);
-		// Read a dynamic block with a block index
+		// Read a dynamic block with a block index, decoding it if needed.
+		// Must be safe to call from several threads at once, so errors are
+		// returned without being set with vdisk_i_err.
 		int (*blk_read)(struct VDISK*, void*, uint64_t);
 		// Read a sector with a LBA index
 		int (*blk_write)(struct VDISK*, void*, uint64_t);
+		// Locate the data of a block within the file with a block index
+		int (*blk_locate)(struct VDISK*, uint64_t, uint64_t*);
+		// Get the extent state of a block with a block index, and set the
+		// file position (DATA) and the number of following blocks sharing
+		// the state (at least 1, physically contiguous for DATA).
+		// Returns the state, or a negative error code.
+		int (*blk_map)(struct VDISK*, uint64_t, uint64_t*, uint64_t*);
 	} cb;
 	// Meta union
 	union {
@@ -148,6 +236,9 @@ typedef struct VDISK {
 		VMDK_META *vmdk;
 		VHD_META *vhd;
 		QED_META *qed;
+		QCOW_META *qcow;
+		PHDD_META *phdd;
+		BOCHS_META *bochs;
 		VHDX_META *vhdx;
 	};
 } VDISK;
@@ -163,6 +254,32 @@ typedef struct VDISK {
  */
 int vdisk_i_err(VDISK *vd, int e, int l, const char *f);
 
+/**
+ * (Internal) Clear callbacks and metadata before opening or creating.
+ */
+void vdisk_i_pre_init(VDISK *vd);
+
+/**
+ * (Internal) Hint the access pattern of the file, and of the mapped
+ * allocation table if any, to the OS. See os_fadvise.
+ */
+void vdisk_i_advise(VDISK *vd, int advice);
+
+/**
+ * (Internal) Drop a file region that was read and will not be accessed
+ * again from the OS cache. The region is extended down to VDISK_DROP_ALIGN,
+ * and its end is rounded down to it, so that a cursor moving forward drops
+ * everything behind it.
+ */
+void vdisk_i_drop(VDISK *vd, uint64_t position, uint64_t length);
+
+/**
+ * (Internal) Preallocate a file region that reads as zero, with the method
+ * selected by the VDISK_CREATE_ALLOC_MASK bits of flags, or mode if none is
+ * selected. See os_falloc.
+ */
+int vdisk_i_falloc(VDISK *vd, uint64_t position, uint64_t length, uint32_t flags, int mode);
+
 //
 // SECTION Functions
 //
@@ -205,6 +322,12 @@ int vdisk_create(VDISK *vd, const oschar *path, int format, uint64_t capacity, u
  */
 const char *vdisk_str(VDISK *vd);
 
+/**
+ * Close a VDISK, freeing its allocation tables and closing the file. This
+ * does not update metadata, see vdisk_update.
+ */
+int vdisk_close(VDISK *vd);
+
 /**
  * Update header information and allocation tables into file or device.
  */
@@ -214,27 +337,77 @@ int vdisk_update(VDISK *vd);
  * Seek and read a sector-size (512 bytes) of data from a sector index (LBA).
  * 
  * This function checks if sector exists on dynamic type disks, and index
- * tables such as the BAT on VHDs.
+ * tables such as the BAT on VHDs. Unallocated sectors read as zeros.
+ * 
+ * If the sector is part of a sequential stream or a block cache is set,
+ * it is read with vdisk_read_sectors.
  * 
  * Returns error code. Non-zero being an error.
  */
 int vdisk_read_sector(VDISK *vd, void *buffer, uint64_t lba);
 
 /**
- * Seek to a block index and read it. The size of the block depends on the size
- * speicified in the VDISK structure. Only certain VDISK types are supported,
- * notably dynamic types. If unsupported, returns EVDFORMAT or EVDTYPE.
+ * Read a number of sectors (512 bytes each) starting at a sector index (LBA).
+ * 
+ * Backends split the request at block or cluster boundaries and issue one
+ * read per contiguous physical run. Unlike vdisk_read_sector, unallocated
+ * sectors within the range are zero-filled instead of returning
+ * VVD_EVDUNALLOC. If the backend does not provide a multi-sector callback,
+ * sectors are read one by one.
+ * 
+ * Sequential requests are detected per handle. While they continue, the
+ * backend is read ahead in a window that doubles up to VDISK_READAHEAD_MAX
+ * sectors, clipped at block boundaries and at the end of the allocated run,
+ * and following requests are copied from memory.
+ * 
+ * If a block cache is set, sectors are served from it when possible and
+ * missing blocks of VDISK_CACHE_BLOCKSIZE bytes are read whole into it.
+ * 
+ * \param vd VDISK structure
+ * \param buffer Buffer of at least count * 512 bytes
+ * \param lba Starting sector index
+ * \param count Number of sectors to read
+ * 
+ * \returns Error code. Non-zero being an error.
+ */
+int vdisk_read_sectors(VDISK *vd, void *buffer, uint64_t lba, uint32_t count);
+
+/**
+ * Read a block with a block index. The size of the block is VDISK.blksize.
+ * If the block is not allocated, the buffer is left untouched and
+ * VVD_EVDUNALLOC is returned. If the last block extends past the capacity,
+ * the remainder is zero-filled. If unsupported, returns EVDTODO.
  */
 int vdisk_read_block(VDISK *vd, void *buffer, uint64_t index);
 
 /**
+ * Get the allocation state of a range of the VDISK as a list of extents,
+ * computed from the allocation tables without reading any data. Adjacent
+ * blocks sharing the same state are coalesced, data blocks only if they are
+ * also contiguous within the file. The list covers the range in order and is
+ * clipped to the capacity.
+ * 
+ * The list is allocated with malloc and must be freed by the caller.
  * 
+ * \param vd VDISK structure
+ * \param offset Virtual offset in bytes
+ * \param length Length in bytes, UINT64_MAX for the rest of the VDISK
+ * \param extents Pointer receiving the extent list
+ * \param count Pointer receiving the number of extents
+ * 
+ * \returns Error code. Non-zero being an error.
  */
-int vdisk_write_lba(VDISK *vd, void *buffer, uint64_t lba);
+int vdisk_get_extents(VDISK *vd, uint64_t offset, uint64_t length, VDISK_EXTENT **extents, size_t *count);
 
 /**
  * 
  */
+int vdisk_write_lba(VDISK *vd, void *buffer, uint64_t lba);
+
+/**
+ * Write a block with a block index. The size of the block is VDISK.blksize.
+ * On dynamic disks, unallocated blocks are allocated (appended) first.
+ */
 int vdisk_write_block(VDISK *vd, void *buffer, uint64_t index);
 
 /**
@@ -251,6 +424,34 @@ int vdisk_write_block_at(VDISK *vd, void *buffer, uint64_t bindex, uint64_t dind
  */
 int vdisk_op_compact(VDISK *vd, void(*cb)(uint32_t, void*));
 
+/**
+ * Copy the contents of a VDISK into another, created beforehand with the
+ * same capacity (see vdisk_create).
+ * 
+ * This is a pipeline: reader threads fetch allocated blocks from the input,
+ * a checker thread detects all-zero blocks, and the calling thread writes
+ * the other blocks to the output in order. Unallocated and all-zero blocks
+ * are left unallocated in the output. Memory use is bounded by the number of
+ * blocks in flight (depth).
+ * 
+ * The input metadata is only accessed by one thread at a time; only data
+ * reads are done in parallel. Inputs with encoded blocks (e.g. compressed
+ * grains) are decoded in parallel by the readers, which default to the
+ * number of processors. Inputs without block location support are read
+ * sector-wise in a serialized fashion.
+ * 
+ * On error, the error information is set in out.
+ * 
+ * \param in Input VDISK
+ * \param out Output VDISK
+ * \param readers Number of reader threads, 0 for default
+ * \param depth Number of blocks in flight, 0 for default
+ * \param cb Notification callback
+ * 
+ * \returns Error code. Non-zero being an error.
+ */
+int vdisk_op_convert(VDISK *in, VDISK *out, uint32_t readers, uint32_t depth, void(*cb)(uint32_t, void*));
+
 /**
  * 
  */
@@ -1,3 +1,269 @@
 #include "vdisk.h"
 #include "utils.h"
 #include "platform.h"
+#include <string.h> // strncmp, memcpy, memset
+
+//
+// vdisk_bochs_open
+//
+
+int vdisk_bochs_open(VDISK *vd, uint32_t flags, uint32_t internal) {
+	if ((vd->meta = malloc(BOCHS_META_ALLOC)) == NULL)
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+
+	BOCH_HDR *hdr = &vd->bochs->hdr;
+	BOCH_REDOLOG_HDR *redolog = &vd->bochs->redolog;
+	BOCHS_INTERNALS *in = &vd->bochs->in;
+	in->catalog = NULL;
+	in->bitmaps = in->loaded = NULL;
+
+	if (os_pread(vd->fd, hdr, sizeof(BOCH_HDR), 0))
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	if (os_pread(vd->fd, redolog, sizeof(BOCH_REDOLOG_HDR), sizeof(BOCH_HDR)))
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+
+	if (strncmp(hdr->signacture, BOCHS_MAGIC, sizeof(hdr->signacture)))
+		return vdisk_i_err(vd, VVD_EVDMAGIC, __LINE__, __func__);
+	if (strncmp(hdr->type, BOCHS_TYPE_REDOLOG, sizeof(hdr->type)))
+		return vdisk_i_err(vd, VVD_EVDTYPE, __LINE__, __func__);
+	// Undoable and volatile redologs only hold the changes to a base image
+	if (strncmp(hdr->subtype, BOCHS_SUBTYPE_UNDOABLE, sizeof(hdr->subtype)) == 0 ||
+		strncmp(hdr->subtype, BOCHS_SUBTYPE_VOLATILE, sizeof(hdr->subtype)) == 0)
+		return vdisk_i_err(vd, VVD_EVDTODO, __LINE__, __func__); //TODO: Base images
+	if (strncmp(hdr->subtype, BOCHS_SUBTYPE_GROWING, sizeof(hdr->subtype)))
+		return vdisk_i_err(vd, VVD_EVDTYPE, __LINE__, __func__);
+
+	if (hdr->version == BOCHS_V1) { // No timestamp field
+		uint64_t disksize;
+		memcpy(&disksize, &redolog->timestamp, sizeof(disksize));
+		redolog->disksize = disksize;
+		redolog->timestamp = 0;
+	} else if (hdr->version != BOCHS_VERSION)
+		return vdisk_i_err(vd, VVD_EVDVERSION, __LINE__, __func__);
+
+	// Bochs only creates power-of-2 extents
+	uint32_t esize = redolog->extentsize;
+	if (esize < 512 || (esize & (esize - 1)) ||
+		(uint64_t)redolog->bitmapsize * 8 < esize >> 9 ||
+		hdr->hdrsize < sizeof(BOCH_HDR) + sizeof(BOCH_REDOLOG_HDR))
+		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+
+	vd->capacity = redolog->disksize;
+	vd->blksize = esize;
+	vd->blkcount = (vd->capacity + esize - 1) / esize;
+	if (vd->blkcount > redolog->nentries)
+		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+
+	in->shift = fpow2(esize);
+	in->full = esize >> 9;
+	in->bitmap = (redolog->bitmapsize + 511) & ~511u;
+	in->stride = (uint64_t)in->bitmap + esize;
+	in->data = hdr->hdrsize + ((uint64_t)redolog->nentries << 2);
+
+	// Catalog, in one read
+
+	size_t csize = (size_t)redolog->nentries << 2;
+	if ((in->catalog = malloc(csize ? csize : 1)) == NULL)
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+	if (os_pread(vd->fd, in->catalog, csize, hdr->hdrsize))
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+
+	uint32_t extents = 0;
+	for (uint64_t i = 0; i < vd->blkcount; ++i) {
+		uint32_t e = in->catalog[i];
+		if (e != BOCHS_UNALLOC && e >= extents)
+			extents = e + 1;
+	}
+	in->extents = extents;
+
+	// Bitmaps are loaded on first access, then kept
+	if ((in->bitmaps = malloc(((size_t)extents * redolog->bitmapsize) + 1)) == NULL ||
+		(in->loaded = calloc((size_t)extents + 1, 1)) == NULL)
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+
+	vd->cb.lba_read = vdisk_bochs_read_sector;
+	vd->cb.lba_readn = vdisk_bochs_read_sectors;
+	vd->cb.blk_locate = vdisk_bochs_locate_block;
+	vd->cb.blk_map = vdisk_bochs_map_block;
+
+	return 0;
+}
+
+//
+// vdisk_bochs_close
+//
+
+void vdisk_bochs_close(VDISK *vd) {
+	BOCHS_INTERNALS *in = &vd->bochs->in;
+	free(in->catalog);
+	free(in->bitmaps);
+	free(in->loaded);
+	in->catalog = NULL;
+	in->bitmaps = in->loaded = NULL;
+}
+
+// Get the bitmap of an extent, NULL on error
+static uint8_t* vdisk_bochs_bitmap(VDISK *vd, uint32_t extent) {
+	BOCHS_INTERNALS *in = &vd->bochs->in;
+	uint32_t size = vd->bochs->redolog.bitmapsize;
+	uint8_t *bitmap = in->bitmaps + ((size_t)extent * size);
+	if (in->loaded[extent] == 0) {
+		if (os_pread(vd->fd, bitmap, size, in->data + (extent * in->stride))) {
+			vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+			return NULL;
+		}
+		in->loaded[extent] = 1;
+	}
+	return bitmap;
+}
+
+// Get the extent state from its bitmap
+static int vdisk_bochs_state(const uint8_t *bitmap, uint32_t sectors) {
+	uint32_t set = 0;
+	uint32_t i = 0;
+	for (; i + 8 <= sectors; i += 8) {
+		switch (bitmap[i >> 3]) {
+		case 0xFF: set += 8; continue;
+		case 0: continue;
+		}
+		return VDISK_EXTENT_DATA + 1; // Partial
+	}
+	for (; i < sectors; ++i)
+		set += (bitmap[i >> 3] >> (i & 7)) & 1;
+	if (set == 0)
+		return VDISK_EXTENT_UNALLOC;
+	return set == sectors ? VDISK_EXTENT_DATA : VDISK_EXTENT_DATA + 1;
+}
+
+//
+// vdisk_bochs_read_sector
+//
+
+int vdisk_bochs_read_sector(VDISK *vd, void *buffer, uint64_t index) {
+	return vdisk_bochs_read_sectors(vd, buffer, index, 1);
+}
+
+//
+// vdisk_bochs_read_sectors
+//
+
+int vdisk_bochs_read_sectors(VDISK *vd, void *buffer, uint64_t index, uint32_t count) {
+	BOCHS_INTERNALS *in = &vd->bochs->in;
+	uint8_t *buf = buffer;
+	uint64_t offset = SECTOR_TO_BYTE(index); // Byte offset
+	uint64_t end = offset + SECTOR_TO_BYTE(count);
+
+	if (end > vd->capacity) // out of bounds
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint64_t esize = vd->blksize;
+	uint64_t mask = esize - 1;
+
+	while (offset < end) {
+		uint64_t len = esize - (offset & mask);
+		if (len > end - offset)
+			len = end - offset;
+
+		uint32_t extent = in->catalog[offset >> in->shift];
+		if (extent == BOCHS_UNALLOC) {
+			memset(buf, 0, len);
+			buf += len;
+			offset += len;
+			continue;
+		}
+
+		uint8_t *bitmap = vdisk_bochs_bitmap(vd, extent);
+		if (bitmap == NULL)
+			return vd->err.num;
+
+		// Read runs of present sectors, zero the others
+		uint64_t base = in->data + (extent * in->stride) + in->bitmap;
+		uint32_t s = (uint32_t)((offset & mask) >> 9);
+		uint32_t n = (uint32_t)(len >> 9);
+		for (uint32_t i = 0; i < n;) {
+			uint32_t bit = (bitmap[(s + i) >> 3] >> ((s + i) & 7)) & 1;
+			uint32_t j = i + 1;
+			while (j < n) {
+				uint32_t k = s + j;
+				if ((k & 7) == 0 && j + 8 <= n &&
+					bitmap[k >> 3] == (bit ? 0xFF : 0)) {
+					j += 8;
+					continue;
+				}
+				if (((bitmap[k >> 3] >> (k & 7)) & 1) != bit)
+					break;
+				++j;
+			}
+			uint8_t *b = buf + SECTOR_TO_BYTE(i);
+			size_t size = (size_t)SECTOR_TO_BYTE(j - i);
+			if (bit == 0)
+				memset(b, 0, size);
+			else if (os_pread(vd->fd, b, size, base + SECTOR_TO_BYTE(s + i)))
+				return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+			i = j;
+		}
+
+		buf += len;
+		offset += len;
+	}
+
+	return 0;
+}
+
+//
+// vdisk_bochs_locate_block
+//
+
+int vdisk_bochs_locate_block(VDISK *vd, uint64_t index, uint64_t *offset) {
+	BOCHS_INTERNALS *in = &vd->bochs->in;
+	if (index >= vd->blkcount)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint32_t extent = in->catalog[index];
+	if (extent == BOCHS_UNALLOC)
+		return vdisk_i_err(vd, VVD_EVDUNALLOC, __LINE__, __func__);
+
+	uint8_t *bitmap = vdisk_bochs_bitmap(vd, extent);
+	if (bitmap == NULL)
+		return vd->err.num;
+
+	switch (vdisk_bochs_state(bitmap, in->full)) {
+	case VDISK_EXTENT_DATA: break;
+	case VDISK_EXTENT_UNALLOC:
+		return vdisk_i_err(vd, VVD_EVDUNALLOC, __LINE__, __func__);
+	default: // Partially present, read by sectors
+		return vdisk_i_err(vd, VVD_EVDTYPE, __LINE__, __func__);
+	}
+
+	*offset = in->data + (extent * in->stride) + in->bitmap;
+	return 0;
+}
+
+//
+// vdisk_bochs_map_block
+//
+
+int vdisk_bochs_map_block(VDISK *vd, uint64_t index, uint64_t *offset, uint64_t *count) {
+	BOCHS_INTERNALS *in = &vd->bochs->in;
+	uint64_t total = vd->blkcount;
+	if (index >= total)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint32_t extent = in->catalog[index];
+	if (extent != BOCHS_UNALLOC) {
+		uint8_t *bitmap = vdisk_bochs_bitmap(vd, extent);
+		if (bitmap == NULL)
+			return vd->err.num;
+		// Extent data is never contiguous, bitmaps sit in-between
+		if (vdisk_bochs_state(bitmap, in->full) != VDISK_EXTENT_UNALLOC) {
+			*offset = in->data + (extent * in->stride) + in->bitmap;
+			*count = 1;
+			return VDISK_EXTENT_DATA;
+		}
+	}
+
+	uint64_t i = index + 1;
+	while (i < total && in->catalog[i] == BOCHS_UNALLOC) ++i;
+	*count = i - index;
+	return VDISK_EXTENT_UNALLOC;
+}
@@ -5,6 +5,16 @@
  * 
  * Little-endian
  * 
+ * Redologs ("Growing", "Undoable", "Volatile") are made of the header, a
+ * catalog of 32-bit extent indexes (BOCHS_UNALLOC if absent), then the
+ * extents. Each extent is a bitmap (one bit per sector) followed by the
+ * extent data, both padded to sectors. A sector is only present if its
+ * bit is set, otherwise it reads as zeros (growing) or from the base image
+ * (undoable and volatile, not supported yet).
+ * 
+ * Extent bitmaps are loaded on first access and kept, about 1/4096 of the
+ * allocated data.
+ * 
  * http://bochs.sourceforge.net/doc/docbook/development/harddisk-redologs.html
  * §2.10
  */
@@ -15,6 +25,12 @@ static const uint32_t BOCHS_VERSION = 0x00020000;
 static const uint32_t BOCHS_V1 = 0x00010000;
 static const uint32_t BOCHS_UNALLOC = 0xffffffff;
 
+#define BOCHS_MAGIC	"Bochs Virtual HD Image"
+#define BOCHS_TYPE_REDOLOG	"Redolog"
+#define BOCHS_SUBTYPE_GROWING	"Growing"
+#define BOCHS_SUBTYPE_UNDOABLE	"Undoable"
+#define BOCHS_SUBTYPE_VOLATILE	"Volatile"
+
 typedef struct {
 	char signacture[32];	// "Bochs Virtual HD Image"
 	char type[16];	// "Redolog"
@@ -30,3 +46,37 @@ typedef struct {
 	uint32_t timestamp;	// ("Undoable" only) timestamp, FAT format
 	uint64_t disksize;	// Disk capacity in bytes
 } BOCH_REDOLOG_HDR;
+
+typedef struct {
+	uint32_t *catalog;	// Extent indexes
+	uint8_t *bitmaps;	// Extent bitmaps, by extent index
+	uint8_t *loaded;	// Per extent index: bitmap was loaded
+	uint64_t data;	// File offset of the first extent
+	uint64_t stride;	// Extent bitmap and data size in bytes
+	uint32_t bitmap;	// Bitmap size, padded to sectors
+	uint32_t extents;	// Number of extent indexes in use
+	uint32_t shift;	// Extent shift
+	uint32_t full;	// Number of sectors per extent
+} BOCHS_INTERNALS;
+
+typedef struct {
+	BOCH_HDR hdr;
+	BOCH_REDOLOG_HDR redolog;
+	BOCHS_INTERNALS in;
+} BOCHS_META;
+
+static const uint32_t BOCHS_META_ALLOC = sizeof(BOCHS_META);
+
+struct VDISK;
+
+int vdisk_bochs_open(struct VDISK *vd, uint32_t flags, uint32_t internal);
+
+void vdisk_bochs_close(struct VDISK *vd);
+
+int vdisk_bochs_read_sector(struct VDISK *vd, void *buffer, uint64_t index);
+
+int vdisk_bochs_read_sectors(struct VDISK *vd, void *buffer, uint64_t index, uint32_t count);
+
+int vdisk_bochs_locate_block(struct VDISK *vd, uint64_t index, uint64_t *offset);
+
+int vdisk_bochs_map_block(struct VDISK *vd, uint64_t index, uint64_t *offset, uint64_t *count);
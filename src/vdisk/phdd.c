@@ -1,11 +1,186 @@
 #include "utils.h"
 #include "vdisk.h"
 #include "platform.h"
-#include <assert.h>
+#include <string.h> // memcmp, memset
+
+//
+// vdisk_phdd_open
+//
 
 int vdisk_phdd_open(VDISK *vd, uint32_t flags, uint32_t internal) {
-	
-	assert(0);
+	if ((vd->meta = malloc(PHDD_META_ALLOC)) == NULL)
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+
+	PHDD_HDR *hdr = &vd->phdd->hdr;
+	PHDD_INTERNALS *in = &vd->phdd->in;
+	in->offsets = NULL;
+	in->map = NULL;
+
+	if (os_pread(vd->fd, hdr, sizeof(PHDD_HDR), 0))
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+
+	int ext;
+	if (memcmp(hdr->magic, PHDD_MAGIC, 16) == 0)
+		ext = 0;
+	else if (memcmp(hdr->magic, PHDD_MAGIC_EXT, 16) == 0)
+		ext = 1;
+	else
+		return vdisk_i_err(vd, VVD_EVDMAGIC, __LINE__, __func__);
+	if (hdr->version != PHDD_VERSION)
+		return vdisk_i_err(vd, VVD_EVDVERSION, __LINE__, __func__);
+	if (hdr->sectorsPerTrack == 0 || hdr->sectorsPerTrack > INT32_MAX / 513)
+		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+
+	// Like QEMU, the high 32 bits are ignored as older versions left
+	// garbage in them
+	in->csize = SECTOR_TO_BYTE(hdr->sectorsPerTrack);
+	in->unit = ext ? in->csize : 512;
+	vd->capacity = SECTOR_TO_BYTE(hdr->sectors & UINT32_MAX);
+
+	uint64_t needed = (vd->capacity + in->csize - 1) / in->csize;
+	if (hdr->number_entries < needed)
+		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+
+	// Block allocation table
+
+	size_t bsize = (size_t)needed << 2;
+	if (bsize == 0) {
+	} else if (flags & VDISK_OPEN_MMAP) {
+		in->offsets = os_mmap(vd->fd, sizeof(PHDD_HDR), bsize, &in->map, &in->maplen);
+		if (in->offsets == NULL)
+			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	} else {
+		if ((in->offsets = malloc(bsize)) == NULL)
+			return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+		if (os_pread(vd->fd, in->offsets, bsize, sizeof(PHDD_HDR)))
+			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	}
+
+	// Block operations need power-of-2 clusters, otherwise the image is
+	// only read by sectors
+	vd->cb.lba_read = vdisk_phdd_read_sector;
+	vd->cb.lba_readn = vdisk_phdd_read_sectors;
+	if ((in->csize & (in->csize - 1)) == 0) {
+		vd->blksize = (uint32_t)in->csize;
+		vd->blkcount = needed;
+		vd->cb.blk_locate = vdisk_phdd_locate_block;
+		vd->cb.blk_map = vdisk_phdd_map_block;
+	}
+
+	return 0;
+}
+
+//
+// vdisk_phdd_close
+//
+
+void vdisk_phdd_close(VDISK *vd) {
+	PHDD_INTERNALS *in = &vd->phdd->in;
+	if (in->map)
+		os_munmap(in->map, in->maplen);
+	else
+		free(in->offsets);
+	in->offsets = NULL;
+	in->map = NULL;
+}
+
+//
+// vdisk_phdd_read_sector
+//
+
+int vdisk_phdd_read_sector(VDISK *vd, void *buffer, uint64_t index) {
+	return vdisk_phdd_read_sectors(vd, buffer, index, 1);
+}
+
+//
+// vdisk_phdd_read_sectors
+//
+
+int vdisk_phdd_read_sectors(VDISK *vd, void *buffer, uint64_t index, uint32_t count) {
+	PHDD_INTERNALS *in = &vd->phdd->in;
+	uint8_t *buf = buffer;
+	uint64_t offset = SECTOR_TO_BYTE(index); // Byte offset
+	uint64_t end = offset + SECTOR_TO_BYTE(count);
+
+	if (end > vd->capacity) // out of bounds
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint32_t *offsets = in->offsets;
+	uint64_t csize = in->csize;
+
+	while (offset < end) {
+		uint64_t ci = offset / csize;
+		uint64_t coff = offset - ci * csize;
+		uint64_t len = csize - coff;
+		if (len > end - offset)
+			len = end - offset;
+
+		uint32_t block = offsets[ci];
+		if (block == 0) {
+			memset(buf, 0, len);
+			buf += len;
+			offset += len;
+			continue;
+		}
+
+		// Extend the run while the next clusters follow physically
+		uint64_t pos = ((uint64_t)block * in->unit) + coff;
+		uint64_t run = len;
+		for (uint64_t n = 1; offset + run < end; ++n) {
+			if ((uint64_t)offsets[ci + n] * in->unit !=
+				(uint64_t)block * in->unit + n * csize)
+				break;
+			uint64_t left = end - offset - run;
+			run += left < csize ? left : csize;
+		}
+
+		if (os_pread(vd->fd, buf, run, pos))
+			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+
+		buf += run;
+		offset += run;
+	}
 
 	return 0;
 }
+
+//
+// vdisk_phdd_locate_block
+//
+
+int vdisk_phdd_locate_block(VDISK *vd, uint64_t index, uint64_t *offset) {
+	if (index >= vd->blkcount)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint32_t block = vd->phdd->in.offsets[index];
+	if (block == 0)
+		return vdisk_i_err(vd, VVD_EVDUNALLOC, __LINE__, __func__);
+
+	*offset = (uint64_t)block * vd->phdd->in.unit;
+	return 0;
+}
+
+//
+// vdisk_phdd_map_block
+//
+
+int vdisk_phdd_map_block(VDISK *vd, uint64_t index, uint64_t *offset, uint64_t *count) {
+	uint64_t total = vd->blkcount;
+	if (index >= total)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	PHDD_INTERNALS *in = &vd->phdd->in;
+	uint32_t *offsets = in->offsets;
+	uint64_t i = index + 1;
+	if (offsets[index] == 0) {
+		while (i < total && offsets[i] == 0) ++i;
+		*count = i - index;
+		return VDISK_EXTENT_UNALLOC;
+	}
+
+	uint64_t pos = (uint64_t)offsets[index] * in->unit;
+	while (i < total && (uint64_t)offsets[i] * in->unit == pos + (i - index) * in->csize) ++i;
+	*offset = pos;
+	*count = i - index;
+	return VDISK_EXTENT_DATA;
+}
@@ -1,15 +1,32 @@
 /**
  * PHDD: Parallels Hard Disk Drive
  * 
+ * Little-endian expanding format. The header is followed by the block
+ * allocation table (BAT), one 32-bit entry per cluster. An entry of 0 is an
+ * unallocated cluster, otherwise the entry is the cluster's file offset in
+ * sectors ("WithoutFreeSpace") or in clusters ("WithouFreSpacExt").
+ * 
+ * Clusters are usually 1 MiB, but older images use a cluster size of one
+ * CHS track (e.g. 63 sectors), which is not a power of 2. Such images are
+ * only read by sectors.
+ * 
  * https://github.com/qemu/qemu/blob/master/docs/interop/parallels.txt
  * VBox/Storage/Parallels.cpp
  */
 
 #include <stdint.h>
 
+#define PHDD_MAGIC	"WithoutFreeSpace"	// BAT entries in sectors
+#define PHDD_MAGIC_EXT	"WithouFreSpacExt"	// BAT entries in clusters
+
+enum {
+	PHDD_VERSION	= 2,
+	PHDD_INUSE	= 0x746F6E59,	// Image was not closed properly
+};
+
 // Parallels header structure
 typedef struct {
-	// Magic header
+	// Magic header, see PHDD_MAGIC and PHDD_MAGIC_EXT
 	char     magic[16];
 	// Virtual disk version, currently 2
 	uint32_t version;
@@ -17,16 +34,47 @@ typedef struct {
 	uint32_t heads;
 	// (CHS) Cylinders
 	uint32_t cylinders;
-	// (CHS) Number of sectors per track
+	// (CHS) Number of sectors per track, the cluster size in sectors
 	uint32_t sectorsPerTrack;
-	// Number of entries in the allocation bitmap.
+	// Number of entries in the block allocation table
 	uint32_t number_entries;
-	// Total number of sectors
-	uint32_t sectors;
-	// Padding.
-//	char Padding[24];
+	// Total number of sectors, only the low 32 bits are reliable
+	uint64_t sectors;
+	// PHDD_INUSE if the image is open, otherwise 0
+	uint32_t inuse;
+	// Data offset in sectors, 0 if unset
+	uint32_t data_off;
+	// Flags, unused
+	uint32_t flags;
+	// Format extension offset in sectors, 0 if none
+	uint64_t ext_off;
 } PHDD_HDR;
 
+typedef struct {
+	uint32_t *offsets;	// Block allocation table
+	void *map;	// Table mapping (VDISK_OPEN_MMAP), otherwise NULL
+	size_t maplen;	// Table mapping length
+	uint64_t unit;	// Table entry unit in bytes
+	uint64_t csize;	// Cluster size in bytes
+} PHDD_INTERNALS;
+
+typedef struct {
+	PHDD_HDR hdr;
+	PHDD_INTERNALS in;
+} PHDD_META;
+
+static const uint32_t PHDD_META_ALLOC = sizeof(PHDD_META);
+
 struct VDISK;
 
 int vdisk_phdd_open(struct VDISK *vd, uint32_t flags, uint32_t internal);
+
+void vdisk_phdd_close(struct VDISK *vd);
+
+int vdisk_phdd_read_sector(struct VDISK *vd, void *buffer, uint64_t index);
+
+int vdisk_phdd_read_sectors(struct VDISK *vd, void *buffer, uint64_t index, uint32_t count);
+
+int vdisk_phdd_locate_block(struct VDISK *vd, uint64_t index, uint64_t *offset);
+
+int vdisk_phdd_map_block(struct VDISK *vd, uint64_t index, uint64_t *offset, uint64_t *count);
@@ -1,11 +1,601 @@
 #include "utils.h"
 #include "vdisk.h"
 #include "platform.h"
-#include <assert.h>
+#include "inflate.h"
+#include <string.h> // memset, memcpy
+
+// L2 entries and refcounts are kept big-endian in memory
+#if ENDIAN_LITTLE
+#define QCOW_BE16(v) bswap16(v)
+#define QCOW_BE64(v) bswap64(v)
+#else
+#define QCOW_BE16(v) (v)
+#define QCOW_BE64(v) (v)
+#endif
+
+// Set cluster geometry and derived values
+static void vdisk_qcow_geometry(VDISK *vd, uint32_t bits, uint64_t capacity) {
+	QCOW_INTERNALS *in = &vd->qcow->in;
+	uint32_t csize = 1u << bits;
+	in->shift = bits;
+	in->mask = csize - 1;
+	in->l2_bits = bits - 3;	// 8-byte entries
+	in->slice_size = csize < QCOW_L2_SLICE_SIZE ? csize : QCOW_L2_SLICE_SIZE;
+	in->slice_bits = fpow2(in->slice_size) - 3;
+	in->csize_shift = 62 - (bits - 8);
+	in->csize_mask = (1ull << (bits - 8)) - 1;
+	in->coffset_mask = (1ull << in->csize_shift) - 1;
+
+	vd->capacity = capacity;
+	vd->blksize = csize;
+	vd->blkcount = (capacity + csize - 1) >> bits;
+}
+
+// Set the refcount of a new cluster to one, allocating its refcount block
+static int vdisk_qcow_ref(VDISK *vd, uint64_t offset) {
+	QCOW_INTERNALS *in = &vd->qcow->in;
+	uint64_t cluster = offset >> in->shift;
+	uint64_t b = cluster >> in->alloc.ref_bits;
+	if (b >= in->alloc.reftable_entries)
+		return vdisk_i_err(vd, VVD_EVDFULL, __LINE__, __func__);
+
+	uint16_t *block = in->alloc.refblocks[b];
+	if (block == NULL) {
+		if ((block = calloc(1, vd->blksize)) == NULL)
+			return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+		in->alloc.refblocks[b] = block;
+		in->alloc.reftable[b] = in->alloc.next;
+		in->alloc.next += vd->blksize;
+		in->alloc.tables = 1;
+		if (vdisk_qcow_ref(vd, in->alloc.reftable[b]))
+			return vd->err.num;
+	}
+
+	block[cluster & ((1ull << in->alloc.ref_bits) - 1)] = QCOW_BE16(1);
+	in->alloc.dirty[in->l1_entries + b] = 1;
+	return 0;
+}
+
+// Append a cluster
+static int vdisk_qcow_alloc(VDISK *vd, uint64_t *offset) {
+	QCOW_INTERNALS *in = &vd->qcow->in;
+	*offset = in->alloc.next;
+	in->alloc.next += vd->blksize;
+	return vdisk_qcow_ref(vd, *offset);
+}
 
 int vdisk_qcow_open(VDISK *vd, uint32_t flags, uint32_t internal) {
-	
-	assert(0);
+	if ((vd->meta = malloc(QCOW_META_ALLOC)) == NULL)
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+
+	QCOW_HDR *hdr = &vd->qcow->hdr;
+	QCOW_INTERNALS *in = &vd->qcow->in;
+	memset(hdr, 0, sizeof(QCOW_HDR));
+	memset(in, 0, sizeof(QCOW_INTERNALS));
+
+	if (os_pread(vd->fd, hdr, QCOW_HEADER_V2_SIZE, 0))
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+
+#if ENDIAN_LITTLE
+	hdr->version = bswap32(hdr->version);
+	hdr->backing_file_offset = bswap64(hdr->backing_file_offset);
+	hdr->backing_file_size = bswap32(hdr->backing_file_size);
+	hdr->cluster_bits = bswap32(hdr->cluster_bits);
+	hdr->size = bswap64(hdr->size);
+	hdr->crypt_method = bswap32(hdr->crypt_method);
+	hdr->l1_size = bswap32(hdr->l1_size);
+	hdr->l1_offset = bswap64(hdr->l1_offset);
+	hdr->refcount_table_offset = bswap64(hdr->refcount_table_offset);
+	hdr->refcount_table_clusters = bswap32(hdr->refcount_table_clusters);
+	hdr->nb_snapshots = bswap32(hdr->nb_snapshots);
+	hdr->snapshots_offset = bswap64(hdr->snapshots_offset);
+#endif
+
+	if (hdr->version < QCOW_VERSION_MIN || hdr->version > QCOW_VERSION_MAX)
+		return vdisk_i_err(vd, VVD_EVDVERSION, __LINE__, __func__);
+	if (hdr->cluster_bits < QCOW_CLUSTER_BITS_MIN ||
+		hdr->cluster_bits > QCOW_CLUSTER_BITS_MAX)
+		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+	if (hdr->crypt_method) //TODO: AES and LUKS encryption
+		return vdisk_i_err(vd, VVD_EVDTODO, __LINE__, __func__);
+	// Unallocated clusters of an overlay are read from its backing file,
+	// reading them as zeros would give corrupted data
+	if (hdr->backing_file_offset) //TODO: Backing file chains
+		return vdisk_i_err(vd, VVD_EVDTODO, __LINE__, __func__);
+
+	uint8_t compression = QCOW_COMPRESSION_ZLIB;
+	if (hdr->version >= 3) {
+		if (os_pread(vd->fd, &hdr->incompatible_features,
+			QCOW_HEADER_V3_SIZE - QCOW_HEADER_V2_SIZE, QCOW_HEADER_V2_SIZE))
+			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+#if ENDIAN_LITTLE
+		hdr->incompatible_features = bswap64(hdr->incompatible_features);
+		hdr->compatible_features = bswap64(hdr->compatible_features);
+		hdr->autoclear_features = bswap64(hdr->autoclear_features);
+		hdr->refcount_order = bswap32(hdr->refcount_order);
+		hdr->header_length = bswap32(hdr->header_length);
+#endif
+		if (hdr->header_length < QCOW_HEADER_V3_SIZE)
+			return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+		// Dirty and corrupt images are still readable
+		if (hdr->incompatible_features & ~(uint64_t)(QCOW_IF_DIRTY |
+			QCOW_IF_CORRUPT | QCOW_IF_COMPRESSION))
+			return vdisk_i_err(vd, VVD_EVDTODO, __LINE__, __func__);
+		if (hdr->incompatible_features & QCOW_IF_COMPRESSION &&
+			hdr->header_length > QCOW_HEADER_V3_SIZE &&
+			os_pread(vd->fd, &compression, 1, QCOW_HEADER_V3_SIZE))
+			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	} else {
+		hdr->refcount_order = 4;
+		hdr->header_length = QCOW_HEADER_V2_SIZE;
+	}
+	if (compression != QCOW_COMPRESSION_ZLIB) //TODO: zstd
+		return vdisk_i_err(vd, VVD_EVDTODO, __LINE__, __func__);
+
+	//
+	// Tables
+	//
+
+	vdisk_qcow_geometry(vd, hdr->cluster_bits, hdr->size);
+
+	uint64_t l1needed = (vd->blkcount + (1ull << in->l2_bits) - 1) >> in->l2_bits;
+	if (l1needed > hdr->l1_size)
+		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+	in->l1_entries = (uint32_t)l1needed;
+
+	if (in->l1_entries) {
+		size_t l1size = (size_t)in->l1_entries * sizeof(uint64_t);
+		if ((in->L1 = malloc(l1size)) == NULL)
+			return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+		if (os_pread(vd->fd, in->L1, l1size, hdr->l1_offset))
+			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+#if ENDIAN_LITTLE
+		for (uint32_t i = 0; i < in->l1_entries; ++i)
+			in->L1[i] = bswap64(in->L1[i]);
+#endif
+	}
+
+	if (vdisk_qcow_L2_cache(vd, QCOW_L2_CACHE_MEMORY))
+		return vd->err.num;
+
+	vd->cb.lba_read = vdisk_qcow_read_sector;
+	vd->cb.lba_readn = vdisk_qcow_read_sectors;
+	vd->cb.blk_locate = vdisk_qcow_locate_block;
+	vd->cb.blk_map = vdisk_qcow_map_block;
+
+	return 0;
+}
+
+int vdisk_qcow_create(VDISK *vd, uint64_t capacity, uint32_t flags) {
+	if ((vd->meta = calloc(1, QCOW_META_ALLOC)) == NULL)
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+
+	switch (flags & VDISK_CREATE_TYPE_MASK) {
+	case 0: // Default
+	case VDISK_CREATE_TYPE_DYNAMIC:
+		break;
+	default:
+		return vdisk_i_err(vd, VVD_EVDTYPE, __LINE__, __func__);
+	}
+
+	QCOW_HDR *hdr = &vd->qcow->hdr;
+	QCOW_INTERNALS *in = &vd->qcow->in;
+
+	vd->format = VDISK_FORMAT_QCOW;
+	vdisk_qcow_geometry(vd, QCOW_CLUSTER_BITS_DEFAULT, capacity);
+
+	uint64_t csize = vd->blksize;
+	uint64_t l2count = (vd->blkcount + (1ull << in->l2_bits) - 1) >> in->l2_bits;
+	if (l2count > UINT32_MAX)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+	uint64_t l1clusters = ((l2count << 3) + csize - 1) >> in->shift;
+
+	// Size the refcount table for a fully allocated image, including
+	// the refcount blocks themselves, so it never needs to be moved
+	in->alloc.ref_bits = in->shift + 3 - QCOW_REFCOUNT_ORDER_DEFAULT;
+	uint64_t refblocks = 1, rtclusters = 1;
+	for (;;) {
+		uint64_t total = 1 + l1clusters + rtclusters + l2count + vd->blkcount + refblocks;
+		uint64_t rb = (total + (1ull << in->alloc.ref_bits) - 1) >> in->alloc.ref_bits;
+		uint64_t rtc = ((rb << 3) + csize - 1) >> in->shift;
+		if (rb == refblocks && rtc == rtclusters)
+			break;
+		refblocks = rb;
+		rtclusters = rtc;
+	}
+
+	hdr->magic = VDISK_FORMAT_QCOW;
+	hdr->version = 3;
+	hdr->cluster_bits = in->shift;
+	hdr->size = capacity;
+	hdr->l1_size = (uint32_t)l2count;
+	hdr->l1_offset = csize;
+	hdr->refcount_table_offset = csize * (1 + l1clusters);
+	hdr->refcount_table_clusters = (uint32_t)rtclusters;
+	hdr->refcount_order = QCOW_REFCOUNT_ORDER_DEFAULT;
+	hdr->header_length = QCOW_HEADER_V3_SIZE;
+
+	in->l1_entries = (uint32_t)l2count;
+	in->alloc.reftable_entries = (uint32_t)((rtclusters << in->shift) >> 3);
+	in->alloc.next = hdr->refcount_table_offset + (rtclusters << in->shift);
+	in->alloc.tables = 1;
+	in->L1 = calloc(l2count, sizeof(uint64_t));
+	in->alloc.L2 = calloc(l2count, sizeof(uint64_t*));
+	in->alloc.reftable = calloc(in->alloc.reftable_entries, sizeof(uint64_t));
+	in->alloc.refblocks = calloc(in->alloc.reftable_entries, sizeof(uint16_t*));
+	in->alloc.dirty = calloc(l2count + in->alloc.reftable_entries, 1);
+	if (in->L1 == NULL || in->alloc.L2 == NULL || in->alloc.reftable == NULL ||
+		in->alloc.refblocks == NULL || in->alloc.dirty == NULL)
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+
+	// Header, L1 table, and refcount table
+	for (uint64_t off = 0, end = in->alloc.next; off < end; off += csize)
+		if (vdisk_qcow_ref(vd, off))
+			return vd->err.num;
+
+	vd->cb.lba_read = vdisk_qcow_read_sector;
+	vd->cb.lba_readn = vdisk_qcow_read_sectors;
+	vd->cb.blk_locate = vdisk_qcow_locate_block;
+	vd->cb.blk_map = vdisk_qcow_map_block;
+	vd->cb.blk_write = vdisk_qcow_write_block;
+
+	return 0;
+}
+
+// Write a table converted to big-endian
+static int vdisk_qcow_write_table(VDISK *vd, const uint64_t *table, uint32_t count, uint64_t offset) {
+	size_t size = (size_t)count * sizeof(uint64_t);
+	uint64_t *buffer = malloc(size ? size : 1);
+	if (buffer == NULL)
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+	for (uint32_t i = 0; i < count; ++i)
+		buffer[i] = QCOW_BE64(table[i]);
+	int e = os_pwrite(vd->fd, buffer, size, offset);
+	free(buffer);
+	return e ? vdisk_i_err(vd, VVD_EOS, __LINE__, __func__) : 0;
+}
+
+int vdisk_qcow_update(VDISK *vd) {
+	QCOW_HDR *hdr = &vd->qcow->hdr;
+	QCOW_INTERNALS *in = &vd->qcow->in;
+	if (in->alloc.L2 == NULL) // Opened images are read-only
+		return vdisk_i_err(vd, VVD_EVDTODO, __LINE__, __func__);
+
+	// Dirty L2 tables and refcount blocks, merged in file order since
+	// both are allocated in ascending order
+	uint8_t *rdirty = in->alloc.dirty + in->l1_entries;
+	uint32_t l = 0, r = 0;
+	for (;;) {
+		while (l < in->l1_entries && in->alloc.dirty[l] == 0) ++l;
+		while (r < in->alloc.reftable_entries && rdirty[r] == 0) ++r;
+		if (l >= in->l1_entries && r >= in->alloc.reftable_entries)
+			break;
+		uint64_t loff = l < in->l1_entries ? in->L1[l] & QCOW_OFFSET_MASK : UINT64_MAX;
+		uint64_t roff = r < in->alloc.reftable_entries ? in->alloc.reftable[r] : UINT64_MAX;
+		if (loff < roff) {
+			if (os_pwrite(vd->fd, in->alloc.L2[l], vd->blksize, loff))
+				return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+			in->alloc.dirty[l++] = 0;
+		} else {
+			if (os_pwrite(vd->fd, in->alloc.refblocks[r], vd->blksize, roff))
+				return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+			rdirty[r++] = 0;
+		}
+	}
+
+	if (in->alloc.tables) {
+		if (vdisk_qcow_write_table(vd, in->L1, in->l1_entries, hdr->l1_offset))
+			return vd->err.num;
+		if (vdisk_qcow_write_table(vd, in->alloc.reftable,
+			in->alloc.reftable_entries, hdr->refcount_table_offset))
+			return vd->err.num;
+		in->alloc.tables = 0;
+	}
+
+	// Header last, the magic is kept as read
+	QCOW_HDR h = *hdr;
+#if ENDIAN_LITTLE
+	h.version = bswap32(h.version);
+	h.backing_file_offset = bswap64(h.backing_file_offset);
+	h.backing_file_size = bswap32(h.backing_file_size);
+	h.cluster_bits = bswap32(h.cluster_bits);
+	h.size = bswap64(h.size);
+	h.crypt_method = bswap32(h.crypt_method);
+	h.l1_size = bswap32(h.l1_size);
+	h.l1_offset = bswap64(h.l1_offset);
+	h.refcount_table_offset = bswap64(h.refcount_table_offset);
+	h.refcount_table_clusters = bswap32(h.refcount_table_clusters);
+	h.nb_snapshots = bswap32(h.nb_snapshots);
+	h.snapshots_offset = bswap64(h.snapshots_offset);
+	h.incompatible_features = bswap64(h.incompatible_features);
+	h.compatible_features = bswap64(h.compatible_features);
+	h.autoclear_features = bswap64(h.autoclear_features);
+	h.refcount_order = bswap32(h.refcount_order);
+	h.header_length = bswap32(h.header_length);
+#endif
+	if (os_pwrite(vd->fd, &h, QCOW_HEADER_V3_SIZE, 0))
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+
+	return 0;
+}
+
+int vdisk_qcow_L2_cache(VDISK *vd, uint64_t memory) {
+	QCOW_INTERNALS *in = &vd->qcow->in;
+	in->L2 = NULL;
+	if (vdisk_table_cache_init(&in->cache, in->slice_size, memory, QCOW_L2_CACHE_MAX))
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+	return 0;
+}
+
+void vdisk_qcow_close(VDISK *vd) {
+	QCOW_INTERNALS *in = &vd->qcow->in;
+	free(in->L1);
+	vdisk_table_cache_free(&in->cache);
+	free(in->compressed.input);
+	free(in->compressed.data);
+	if (in->alloc.L2) {
+		for (uint32_t i = 0; i < in->l1_entries; ++i)
+			free(in->alloc.L2[i]);
+		for (uint32_t i = 0; i < in->alloc.reftable_entries; ++i)
+			free(in->alloc.refblocks[i]);
+	}
+	free(in->alloc.L2);
+	free(in->alloc.refblocks);
+	free(in->alloc.reftable);
+	free(in->alloc.dirty);
+	in->alloc.L2 = NULL;
+	in->alloc.refblocks = NULL;
+	in->alloc.reftable = NULL;
+	in->alloc.dirty = NULL;
+	in->L1 = in->L2 = NULL;
+	in->compressed.input = in->compressed.data = NULL;
+	in->compressed.current = 0;
+}
+
+// Load an L2 slice
+static int vdisk_qcow_L2_load(VDISK *vd, uint64_t offset) {
+	QCOW_INTERNALS *in = &vd->qcow->in;
+	uint64_t *slice = vdisk_table_cache_get(&in->cache, vd->fd, offset);
+	if (slice == NULL)
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	in->L2 = slice;
+	return 0;
+}
+
+// Get the L2 entry of a cluster, 0 if its L2 table is absent. On return,
+// the slice holding the entry is loaded.
+static int vdisk_qcow_L2_entry(VDISK *vd, uint64_t cluster, uint64_t *entry, uint32_t *left) {
+	QCOW_INTERNALS *in = &vd->qcow->in;
+	uint64_t l1 = cluster >> in->l2_bits;
+	if (l1 >= in->l1_entries)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint32_t l2 = cluster & ((1u << in->l2_bits) - 1);
+	uint32_t i = l2 & ((1u << in->slice_bits) - 1);
+	if (left) // Entries left in the slice, including this one
+		*left = (1u << in->slice_bits) - i;
+
+	if (in->alloc.L2) { // Created image, tables are in memory
+		uint64_t *table = in->alloc.L2[l1];
+		if (table == NULL) {
+			*entry = 0;
+			return 0;
+		}
+		in->L2 = table + (l2 - i);
+		*entry = QCOW_BE64(in->L2[i]);
+		return 0;
+	}
+
+	uint64_t table = in->L1[l1] & QCOW_OFFSET_MASK;
+	if (table == 0) {
+		*entry = 0;
+		return 0;
+	}
+	if (vdisk_qcow_L2_load(vd, table + ((uint64_t)(l2 >> in->slice_bits) * in->slice_size)))
+		return vd->err.num;
+
+	*entry = QCOW_BE64(in->L2[i]);
+	return 0;
+}
+
+// Decode a compressed cluster into the decoded cluster buffer
+static int vdisk_qcow_decompress(VDISK *vd, uint64_t entry) {
+	QCOW_INTERNALS *in = &vd->qcow->in;
+	if (in->compressed.current == entry)
+		return 0;
+
+	size_t csize = vd->blksize;
+	if (in->compressed.data == NULL) {
+		// Compressed data spans at most a cluster and its sector slack
+		in->compressed.input = malloc(csize + 512);
+		in->compressed.data = malloc(csize);
+		if (in->compressed.input == NULL || in->compressed.data == NULL)
+			return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+	}
+
+	uint64_t offset = entry & in->coffset_mask;
+	uint64_t sectors = ((entry >> in->csize_shift) & in->csize_mask) + 1;
+	size_t size = (size_t)(sectors * 512 - (offset & 511));
+	if (size > csize + 512)
+		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+
+	in->compressed.current = 0;
+	if (os_pread(vd->fd, in->compressed.input, size, offset))
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+
+	size_t len;
+	if (inflate_raw(in->compressed.data, csize, &len, in->compressed.input, size))
+		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+	if (len < csize)
+		memset(in->compressed.data + len, 0, csize - len);
+
+	in->compressed.current = entry;
+	return 0;
+}
+
+int vdisk_qcow_read_sector(VDISK *vd, void *buffer, uint64_t index) {
+	return vdisk_qcow_read_sectors(vd, buffer, index, 1);
+}
+
+int vdisk_qcow_read_sectors(VDISK *vd, void *buffer, uint64_t index, uint32_t count) {
+	QCOW_INTERNALS *in = &vd->qcow->in;
+	uint8_t *buf = buffer;
+	uint64_t offset = SECTOR_TO_BYTE(index);
+	uint64_t end = offset + SECTOR_TO_BYTE(count);
+
+	if (end > vd->capacity)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint64_t csize = vd->blksize;
+	uint64_t pos = 0;	// Physical offset of the pending run
+	uint64_t run = 0;	// Length of the pending run
+	uint8_t *rbuf = buf;	// Destination of the pending run
+
+	while (offset < end) {
+		uint64_t coff = offset & in->mask;
+		uint64_t len = csize - coff;
+		if (len > end - offset)
+			len = end - offset;
+
+		uint64_t entry = 0;
+		if (vdisk_qcow_L2_entry(vd, offset >> in->shift, &entry, NULL))
+			return vd->err.num;
+
+		uint64_t cluster = 0;
+		if ((entry & QCOW_OFLAG_COMPRESSED) == 0 && (entry & QCOW_OFLAG_ZERO) == 0)
+			cluster = entry & QCOW_OFFSET_MASK;
+		uint64_t cpos = cluster + coff;
+
+		// Flush pending run if this cluster does not extend it
+		if (run && (cluster == 0 || cpos != pos + run)) {
+			if (os_pread(vd->fd, rbuf, run, pos))
+				return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+			run = 0;
+		}
+
+		if (entry & QCOW_OFLAG_COMPRESSED) {
+			if (vdisk_qcow_decompress(vd, entry))
+				return vd->err.num;
+			memcpy(buf, in->compressed.data + coff, len);
+		} else if (cluster == 0) { // Unallocated or zeroed
+			memset(buf, 0, len);
+		} else {
+			if (run == 0) {
+				pos = cpos;
+				rbuf = buf;
+			}
+			run += len;
+		}
+
+		buf += len;
+		offset += len;
+	}
+
+	if (run) {
+		if (os_pread(vd->fd, rbuf, run, pos))
+			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	}
+
+	return 0;
+}
+
+int vdisk_qcow_locate_block(VDISK *vd, uint64_t index, uint64_t *offset) {
+	uint64_t entry;
+	if (vdisk_qcow_L2_entry(vd, index, &entry, NULL))
+		return vd->err.num;
+	if (entry & QCOW_OFLAG_COMPRESSED) // Needs decoding
+		return vdisk_i_err(vd, VVD_EVDTYPE, __LINE__, __func__);
+	if (entry & QCOW_OFLAG_ZERO || (entry & QCOW_OFFSET_MASK) == 0)
+		return vdisk_i_err(vd, VVD_EVDUNALLOC, __LINE__, __func__);
+
+	*offset = entry & QCOW_OFFSET_MASK;
+	return 0;
+}
+
+// Get the extent state of an L2 entry
+static int vdisk_qcow_state(uint64_t entry) {
+	if (entry & QCOW_OFLAG_COMPRESSED)
+		return VDISK_EXTENT_DATA;
+	if (entry & QCOW_OFLAG_ZERO)
+		return VDISK_EXTENT_ZERO;
+	return entry & QCOW_OFFSET_MASK ? VDISK_EXTENT_DATA : VDISK_EXTENT_UNALLOC;
+}
+
+int vdisk_qcow_map_block(VDISK *vd, uint64_t index, uint64_t *offset, uint64_t *count) {
+	QCOW_INTERNALS *in = &vd->qcow->in;
+	uint64_t entry;
+	uint32_t left;
+	if (vdisk_qcow_L2_entry(vd, index, &entry, &left))
+		return vd->err.num;
+
+	// Missing L2 tables cover the rest of the table
+	uint64_t l1 = index >> in->l2_bits;
+	if ((in->L1[l1] & QCOW_OFFSET_MASK) == 0) {
+		uint64_t i = l1 + 1;
+		while (i < in->l1_entries && (in->L1[i] & QCOW_OFFSET_MASK) == 0) ++i;
+		*count = (i << in->l2_bits) - index;
+		return VDISK_EXTENT_UNALLOC;
+	}
+
+	// Runs are limited to the loaded slice
+	int state = vdisk_qcow_state(entry);
+	uint64_t *L2 = in->L2 + ((1u << in->slice_bits) - left);
+	uint64_t cluster = entry & (entry & QCOW_OFLAG_COMPRESSED ?
+		in->coffset_mask : QCOW_OFFSET_MASK);
+	uint32_t i = 1;
+	if (entry & QCOW_OFLAG_COMPRESSED) {
+		// Compressed clusters are not contiguous
+	} else if (state == VDISK_EXTENT_DATA) {
+		for (; i < left; ++i) {
+			uint64_t e = QCOW_BE64(L2[i]);
+			if (vdisk_qcow_state(e) != state || e & QCOW_OFLAG_COMPRESSED ||
+				(e & QCOW_OFFSET_MASK) != cluster + ((uint64_t)i << in->shift))
+				break;
+		}
+	} else {
+		for (; i < left; ++i) {
+			uint64_t e = QCOW_BE64(L2[i]);
+			if (vdisk_qcow_state(e) != state)
+				break;
+		}
+	}
+
+	*offset = state == VDISK_EXTENT_DATA ? cluster : 0;
+	*count = i;
+	return state;
+}
+
+int vdisk_qcow_write_block(VDISK *vd, void *buffer, uint64_t index) {
+	QCOW_INTERNALS *in = &vd->qcow->in;
+	if (in->alloc.L2 == NULL) // Opened images are read-only
+		return vdisk_i_err(vd, VVD_EVDTODO, __LINE__, __func__);
+	if (index >= vd->blkcount)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint64_t l1 = index >> in->l2_bits;
+	uint64_t *table = in->alloc.L2[l1];
+	uint64_t pos;
+	if (table == NULL) {
+		if ((table = calloc(1, vd->blksize)) == NULL)
+			return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+		in->alloc.L2[l1] = table;
+		if (vdisk_qcow_alloc(vd, &pos))
+			return vd->err.num;
+		in->L1[l1] = pos | QCOW_OFLAG_COPIED;
+		in->alloc.tables = 1;
+	}
+
+	uint64_t *entry = table + (index & ((1ull << in->l2_bits) - 1));
+	pos = QCOW_BE64(*entry) & QCOW_OFFSET_MASK;
+	if (pos == 0) {
+		if (vdisk_qcow_alloc(vd, &pos))
+			return vd->err.num;
+		*entry = QCOW_BE64(pos | QCOW_OFLAG_COPIED);
+		in->alloc.dirty[l1] = 1;
+	}
+
+	if (os_pwrite(vd->fd, buffer, vd->blksize, pos))
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
 
 	return 0;
 }
@@ -1,41 +1,168 @@
 /**
  * QCOW: QEMU Copy-On-Write disk
  * 
+ * Big-endian format, version 2 and 3 (qcow2).
+ * 
+ * Like QED, clusters are located with a 2-level table: the L1 table holds
+ * offsets to L2 tables, and L2 tables hold offsets to data clusters. Both
+ * are one cluster in size for L2 tables. An L2 entry may also describe a
+ * zeroed cluster (v3) or a compressed cluster:
+ * 
+ * +----+----+--------------+----------------+-----+
+ * | 63 | 62 | 61 .. x      | x-1 .. 0       |     |
+ * +----+----+--------------+----------------+-----+
+ * | C  | 1  | Sector count | Host offset    |     | x = 62 - (cluster_bits - 8)
+ * +----+----+--------------+----------------+-----+
+ * 
+ * L2 tables are cached in fixed-size slices rather than whole tables, so
+ * large clusters do not waste cache memory on sparse accesses.
+ * 
+ * Created images (v3, 16-bit refcounts) are laid out as the header, L1
+ * table, and refcount table, sized for a fully allocated disk. L2 tables,
+ * refcount blocks, and data clusters are then appended as they are needed.
+ * Metadata is kept in memory and written by vdisk_update.
+ * 
  * https://github.com/qemu/qemu/blob/master/docs/interop/qcow2.txt
  */
 
 #include <stdint.h>
+#include "cache.h"
+
+enum {
+	QCOW_VERSION_MIN	= 2,
+	QCOW_VERSION_MAX	= 3,
+	QCOW_CLUSTER_BITS_MIN	= 9,	// 512 B
+	QCOW_CLUSTER_BITS_MAX	= 21,	// 2 MiB
+	QCOW_HEADER_V2_SIZE	= 72,
+	QCOW_HEADER_V3_SIZE	= 104,
+	QCOW_L2_SLICE_SIZE	= 4096,	// L2 cache slice size, or the cluster size if smaller
+	QCOW_CLUSTER_BITS_DEFAULT	= 16,	// 64 KiB, for created images
+	QCOW_REFCOUNT_ORDER_DEFAULT	= 4,	// 16-bit refcounts, for created images
+
+	// Incompatible features (v3)
+	QCOW_IF_DIRTY	= 1,	// Refcounts may be inconsistent
+	QCOW_IF_CORRUPT	= 2,	// Metadata may be corrupted
+	QCOW_IF_DATA_FILE	= 4,	// External data file
+	QCOW_IF_COMPRESSION	= 8,	// Compression type field is used
+	QCOW_IF_EXTENDED_L2	= 16,	// Subclusters, 128-bit L2 entries
+
+	QCOW_COMPRESSION_ZLIB	= 0,	// Raw DEFLATE
+};
+
+// Default memory budget for the L2 slice cache, can be defined at build time
+#ifndef QCOW_L2_CACHE_MEMORY
+#define QCOW_L2_CACHE_MEMORY	(4 * 1024 * 1024)
+#endif
+// Maximum number of cached L2 slices
+static const uint32_t QCOW_L2_CACHE_MAX	= 1024;
+
+static const uint64_t QCOW_OFLAG_COPIED	= 1ull << 63;	// Refcount is exactly one
+static const uint64_t QCOW_OFLAG_COMPRESSED	= 1ull << 62;	// Compressed cluster
+static const uint64_t QCOW_OFLAG_ZERO	= 1;	// Reads as zeros (v3)
+static const uint64_t QCOW_OFFSET_MASK	= 0x00FFFFFFFFFFFE00ull;	// L1 and L2 offsets
 
 // QCOW header structure
 typedef struct {
-	// 
+	// "QFI\xFB"
 	uint32_t magic;
-	// 
+	// 2 or 3
 	uint32_t version;
-	// 
+	// Offset to the backing file name, 0 if none
 	uint64_t backing_file_offset;
-	// 
+	// Length of the backing file name, not null-terminated
 	uint32_t backing_file_size;
-	// 
+	// Cluster size shift
 	uint32_t cluster_bits;
 	// In bytes
 	uint64_t size;
 	// Encryption method
 	uint32_t crypt_method;
-	// L1 table size in bytes
+	// L1 table size in entries
 	uint32_t l1_size;
 	// L1 table offset in bytes
 	uint64_t l1_offset;
-	// 
+	// Refcount table offset in bytes
 	uint64_t refcount_table_offset;
-	//
+	// Refcount table size in clusters
 	uint32_t refcount_table_clusters;
-	// 
+	// Number of snapshots
 	uint32_t nb_snapshots;
-	// 
+	// Snapshot table offset in bytes
 	uint64_t snapshots_offset;
+	// (v3) Feature bits, see QCOW_IF_* for incompatible features
+	uint64_t incompatible_features;
+	uint64_t compatible_features;
+	uint64_t autoclear_features;
+	// (v3) Refcount width shift, 4 (16-bit) in v2
+	uint32_t refcount_order;
+	// (v3) Header length in bytes
+	uint32_t header_length;
 } QCOW_HDR;
 
+typedef struct {
+	uint64_t *L1;	// L1 table, host order
+	uint64_t *L2;	// Last loaded L2 slice (big-endian), within the cache
+	uint64_t mask;	// Cluster offset mask
+	uint32_t l1_entries;	// Number of L1 entries in use
+	uint32_t l2_bits;	// L2 entries per table shift
+	uint32_t slice_bits;	// L2 entries per slice shift
+	uint32_t slice_size;	// L2 slice size in bytes
+	uint32_t shift;	// Cluster shift
+	uint32_t csize_shift;	// Compressed: sector count shift
+	uint64_t csize_mask;	// Compressed: sector count mask, after shift
+	uint64_t coffset_mask;	// Compressed: host offset mask
+	VDISK_TABLE_CACHE cache;	// L2 slice cache
+	struct {
+		uint8_t *input;	// Compressed data scratch buffer
+		uint8_t *data;	// Last decoded cluster
+		uint64_t current;	// L2 entry of the decoded cluster, 0 if none
+	} compressed;
+	struct {
+		uint64_t **L2;	// L2 tables (big-endian) by L1 index, NULL if absent
+		uint16_t **refblocks;	// Refcount blocks (big-endian), NULL if absent
+		uint64_t *reftable;	// Refcount table, host order
+		uint8_t *dirty;	// Per L2 table, then per refcount block
+		uint64_t next;	// File offset of the next free cluster
+		uint32_t reftable_entries;	// Number of refcount table entries
+		uint32_t ref_bits;	// Refcount entries per block shift
+		int tables;	// L1 or refcount table was modified
+	} alloc;	// Cluster allocator, for created images
+} QCOW_INTERNALS;
+
+typedef struct {
+	QCOW_HDR hdr;
+	QCOW_INTERNALS in;
+} QCOW_META;
+
+static const uint32_t QCOW_META_ALLOC = sizeof(QCOW_META);
+
 struct VDISK;
 
 int vdisk_qcow_open(struct VDISK *vd, uint32_t flags, uint32_t internal);
+
+int vdisk_qcow_create(struct VDISK *vd, uint64_t capacity, uint32_t flags);
+
+/**
+ * Write modified metadata of a created image: L2 tables, refcount blocks,
+ * and tables, in one pass, then the header.
+ */
+int vdisk_qcow_update(struct VDISK *vd);
+
+/**
+ * (Re)size the L2 slice cache to fit within a memory budget, holding at least
+ * one slice and at most QCOW_L2_CACHE_MAX slices. Cached slices and counters
+ * are reset.
+ */
+int vdisk_qcow_L2_cache(struct VDISK *vd, uint64_t memory);
+
+void vdisk_qcow_close(struct VDISK *vd);
+
+int vdisk_qcow_read_sector(struct VDISK *vd, void *buffer, uint64_t index);
+
+int vdisk_qcow_read_sectors(struct VDISK *vd, void *buffer, uint64_t index, uint32_t count);
+
+int vdisk_qcow_locate_block(struct VDISK *vd, uint64_t index, uint64_t *offset);
+
+int vdisk_qcow_map_block(struct VDISK *vd, uint64_t index, uint64_t *offset, uint64_t *count);
+
+int vdisk_qcow_write_block(struct VDISK *vd, void *buffer, uint64_t index);
@@ -2,12 +2,13 @@
 #include "utils.h"
 #include "platform.h"
 #include <assert.h>
+#include <string.h> // memset
 
 int vdisk_qed_open(VDISK *vd, uint32_t flags, uint32_t internal) {
 	if ((vd->meta = malloc(QED_META_ALLOC)) == NULL)
 		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
 
-	if (os_fread(vd->fd, &vd->qed->hdr, sizeof(QED_HDR)))
+	if (os_pread(vd->fd, &vd->qed->hdr, sizeof(QED_HDR), 0))
 		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
 
 	if (vd->qed->hdr.cluster_size < QED_CLUSTER_MIN ||
@@ -32,59 +33,188 @@ int vdisk_qed_open(VDISK *vd, uint32_t flags, uint32_t internal) {
 
 	if ((vd->qed->in.L1.offsets = malloc(table_size)) == NULL)
 		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
-	if ((vd->qed->in.L2.offsets = malloc(table_size)) == NULL)
-		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
-	if (os_fseek(vd->fd, vd->qed->hdr.l1_offset, SEEK_SET))
-		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-	if (os_fread(vd->fd, vd->qed->in.L1.offsets, table_size))
+	memset(&vd->qed->in.cache, 0, sizeof(vd->qed->in.cache));
+	if (vdisk_qed_L2_cache(vd, QED_L2_CACHE_MEMORY))
+		return vd->err.num;
+	if (os_pread(vd->fd, vd->qed->in.L1.offsets, table_size, vd->qed->hdr.l1_offset))
 		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
 
 	// assert(clusterbits + (2 * tablebits) <= 64);
 
 	vd->qed->in.mask	= vd->qed->hdr.cluster_size - 1;
-	vd->qed->in.L2.mask 	= (table_entries - 1) << clusterbits;
+	vd->qed->in.L2.mask 	= table_entries - 1;
 	vd->qed->in.L2.shift	= clusterbits;
-	vd->qed->in.L1.mask 	= (table_entries - 1) << (clusterbits + tablebits);
-	vd->qed->in.L1.mask	= clusterbits + tablebits;
+	vd->qed->in.L1.mask 	= table_entries - 1;
+	vd->qed->in.L1.shift	= clusterbits + tablebits;
 
 	vd->capacity = vd->qed->hdr.capacity;
+	vd->blksize  = vd->qed->hdr.cluster_size;
+	vd->blkcount = (vd->capacity + vd->blksize - 1) >> clusterbits;
 
 	vd->cb.lba_read = vdisk_qed_read_sector;
+	vd->cb.lba_readn = vdisk_qed_read_sectors;
+	vd->cb.blk_locate = vdisk_qed_locate_block;
+	vd->cb.blk_map = vdisk_qed_map_block;
 
 	return 0;
 }
 
-int vdisk_qed_L2_load(VDISK *vd, uint64_t offset) {
-	if (vd->qed->in.L2.current == offset) // L2 already loaded
-		return 0;
-
-	if (os_fseek(vd->fd, offset, SEEK_SET))
-		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-	if (os_fread(vd->fd, vd->qed->in.L2.offsets, vd->qed->in.tablesize))
-		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+int vdisk_qed_L2_cache(VDISK *vd, uint64_t memory) {
+	QED_INTERNALS *in = &vd->qed->in;
+	in->L2.offsets = NULL;
+	if (vdisk_table_cache_init(&in->cache, in->tablesize, memory, QED_L2_CACHE_MAX))
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+	return 0;
+}
 
-	vd->qed->in.L2.current = offset;
+void vdisk_qed_close(VDISK *vd) {
+	QED_INTERNALS *in = &vd->qed->in;
+	vdisk_table_cache_free(&in->cache);
+	in->L2.offsets = NULL;
+}
 
+int vdisk_qed_L2_load(VDISK *vd, uint64_t offset) {
+	QED_INTERNALS *in = &vd->qed->in;
+	uint64_t *table = vdisk_table_cache_get(&in->cache, vd->fd, offset);
+	if (table == NULL)
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	in->L2.offsets = table;
 	return 0;
 }
 
 int vdisk_qed_read_sector(VDISK *vd, void *buffer, uint64_t index) {
 	uint64_t offset = SECTOR_TO_BYTE(index);
 
-	uint32_t l1 = (offset >> vd->qed->in.L1.shift) & vd->qed->in.L1.mask;
+	uint32_t l1 = (uint32_t)(offset >> vd->qed->in.L1.shift);
 	uint32_t l2 = (offset >> vd->qed->in.L2.shift) & vd->qed->in.L2.mask;
 
 	if (l1 >= vd->qed->in.entries || l2 >= vd->qed->in.entries)
 		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+	if (vd->qed->in.L1.offsets[l1] == 0)
+		return vdisk_i_err(vd, VVD_EVDUNALLOC, __LINE__, __func__);
 	if (vdisk_qed_L2_load(vd, vd->qed->in.L1.offsets[l1]))
 		return vd->err.num;
+	if (vd->qed->in.L2.offsets[l2] == 0)
+		return vdisk_i_err(vd, VVD_EVDUNALLOC, __LINE__, __func__);
 
 	offset = (uint64_t)vd->qed->in.L2.offsets[l2] + (offset & vd->qed->in.mask);
 
-	if (os_fseek(vd->fd, offset, SEEK_SET))
-		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-	if (os_fread(vd->fd, buffer, 512))
+	if (os_pread(vd->fd, buffer, 512, offset))
 		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
 
 	return 0;
 }
+
+int vdisk_qed_read_sectors(VDISK *vd, void *buffer, uint64_t index, uint32_t count) {
+	uint8_t *buf = buffer;
+	uint64_t offset = SECTOR_TO_BYTE(index);
+	uint64_t end = offset + SECTOR_TO_BYTE(count);
+
+	if (end > vd->capacity)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint64_t csize = vd->qed->hdr.cluster_size;
+	uint64_t pos = 0;	// Physical offset of the pending run
+	uint64_t run = 0;	// Length of the pending run
+	uint8_t *rbuf = buf;	// Destination of the pending run
+
+	while (offset < end) {
+		uint32_t l1 = (uint32_t)(offset >> vd->qed->in.L1.shift);
+		uint32_t l2 = (offset >> vd->qed->in.L2.shift) & vd->qed->in.L2.mask;
+
+		if (l1 >= vd->qed->in.entries)
+			return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+		uint64_t len = csize - (offset & vd->qed->in.mask);
+		if (len > end - offset)
+			len = end - offset;
+
+		uint64_t cluster = 0;
+		uint64_t l2off = vd->qed->in.L1.offsets[l1];
+		if (l2off) {
+			if (vdisk_qed_L2_load(vd, l2off))
+				return vd->err.num;
+			cluster = vd->qed->in.L2.offsets[l2];
+		}
+
+		uint64_t cpos = cluster + (offset & vd->qed->in.mask);
+
+		// Flush pending run if this cluster does not extend it
+		if (run && (cluster == 0 || cpos != pos + run)) {
+				if (os_pread(vd->fd, rbuf, run, pos))
+				return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+			run = 0;
+		}
+
+		if (cluster == 0) { // Unallocated
+			memset(buf, 0, len);
+		} else {
+			if (run == 0) {
+				pos = cpos;
+				rbuf = buf;
+			}
+			run += len;
+		}
+
+		buf += len;
+		offset += len;
+	}
+
+	if (run) {
+		if (os_pread(vd->fd, rbuf, run, pos))
+			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	}
+
+	return 0;
+}
+
+int vdisk_qed_locate_block(VDISK *vd, uint64_t index, uint64_t *offset) {
+	uint64_t l1 = index >> (vd->qed->in.L1.shift - vd->qed->in.L2.shift);
+	uint32_t l2 = index & vd->qed->in.L2.mask;
+
+	if (l1 >= vd->qed->in.entries)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+	if (vd->qed->in.L1.offsets[l1] == 0)
+		return vdisk_i_err(vd, VVD_EVDUNALLOC, __LINE__, __func__);
+	if (vdisk_qed_L2_load(vd, vd->qed->in.L1.offsets[l1]))
+		return vd->err.num;
+	if (vd->qed->in.L2.offsets[l2] == 0)
+		return vdisk_i_err(vd, VVD_EVDUNALLOC, __LINE__, __func__);
+
+	*offset = vd->qed->in.L2.offsets[l2];
+	return 0;
+}
+
+int vdisk_qed_map_block(VDISK *vd, uint64_t index, uint64_t *offset, uint64_t *count) {
+	uint32_t entries = vd->qed->in.entries;
+	uint64_t l1 = index >> (vd->qed->in.L1.shift - vd->qed->in.L2.shift);
+	uint32_t l2 = index & vd->qed->in.L2.mask;
+
+	if (l1 >= entries)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	// Missing L2 tables cover a whole table of clusters
+	if (vd->qed->in.L1.offsets[l1] == 0) {
+		uint64_t i = l1 + 1;
+		while (i < entries && vd->qed->in.L1.offsets[i] == 0) ++i;
+		*count = ((i - l1) * entries) - l2;
+		return VDISK_EXTENT_UNALLOC;
+	}
+	if (vdisk_qed_L2_load(vd, vd->qed->in.L1.offsets[l1]))
+		return vd->err.num;
+
+	// Runs are limited to the loaded L2 table
+	uint64_t *L2 = vd->qed->in.L2.offsets;
+	uint64_t cluster = L2[l2];
+	uint64_t csize = vd->qed->hdr.cluster_size;
+	uint32_t i = l2 + 1;
+	if (cluster == 0) {
+		while (i < entries && L2[i] == 0) ++i;
+		*count = i - l2;
+		return VDISK_EXTENT_UNALLOC;
+	}
+	while (i < entries && L2[i] == cluster + ((i - l2) * csize)) ++i;
+	*offset = cluster;
+	*count = i - l2;
+	return VDISK_EXTENT_DATA;
+}
@@ -35,6 +35,7 @@
  */
 
 #include <stdint.h>
+#include "cache.h"
 
 static const uint32_t QED_CLUSTER_DEFAULT	= 64 * 1024; // 64K
 static const uint32_t QED_TABLE_DEFAULT	= 4; // 4 clusters
@@ -43,6 +44,13 @@ static const uint32_t QED_CLUSTER_MAX	= 67108864; // 2^26, or 64 * 1024 * 1024
 static const uint32_t QED_TABLE_MIN	= 1;
 static const uint32_t QED_TABLE_MAX	= 16;
 
+// Default memory budget for the L2 table cache, can be defined at build time
+#ifndef QED_L2_CACHE_MEMORY
+#define QED_L2_CACHE_MEMORY	(4 * 1024 * 1024)
+#endif
+// Maximum number of cached L2 tables
+static const uint32_t QED_L2_CACHE_MAX	= 1024;
+
 // Disk image uses a backup file for unallocated clusters
 static const uint64_t QED_F_BACKING_FILE	= 1; // bit 0
 // Disk image needs to be checked before use
@@ -97,11 +105,11 @@ typedef struct {
 		uint32_t shift;
 	} L1;	// L1 table
 	struct {
-		uint64_t *offsets;
+		uint64_t *offsets;	// Last loaded table, within the cache
 		uint64_t mask;
 		uint32_t shift;
-		uint64_t current;	// Last L2 offset loaded
 	} L2;	// L2 table
+	VDISK_TABLE_CACHE cache;	// L2 table cache
 } QED_INTERNALS;
 
 typedef struct {
@@ -117,4 +125,19 @@ int vdisk_qed_open(struct VDISK *vd, uint32_t flags, uint32_t internal);
 
 int vdisk_qed_L2_load(struct VDISK *vd, uint64_t index);
 
+/**
+ * (Re)size the L2 table cache to fit within a memory budget, holding at least
+ * one table and at most QED_L2_CACHE_MAX tables. Cached tables and counters
+ * are reset.
+ */
+int vdisk_qed_L2_cache(struct VDISK *vd, uint64_t memory);
+
+void vdisk_qed_close(struct VDISK *vd);
+
 int vdisk_qed_read_sector(struct VDISK *vd, void *buffer, uint64_t index);
+
+int vdisk_qed_read_sectors(struct VDISK *vd, void *buffer, uint64_t index, uint32_t count);
+
+int vdisk_qed_locate_block(struct VDISK *vd, uint64_t index, uint64_t *offset);
+
+int vdisk_qed_map_block(struct VDISK *vd, uint64_t index, uint64_t *offset, uint64_t *count);
@@ -7,7 +7,30 @@ int vdisk_raw_open(VDISK *vd, uint32_t flags, uint32_t internal) {
 		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
 	vd->format = VDISK_FORMAT_RAW;
 	vd->offset = 0;
+	vd->blksize = VDISK_BLOCKSIZE_RAW;
+	vd->blkcount = (vd->capacity + VDISK_BLOCKSIZE_RAW - 1) / VDISK_BLOCKSIZE_RAW;
 	vd->cb.lba_read = vdisk_raw_read_lba;
+	vd->cb.lba_readn = vdisk_raw_read_lbas;
+	vd->cb.blk_locate = vdisk_raw_locate_block;
+	vd->cb.blk_map = vdisk_raw_map_block;
+	vd->cb.blk_write = vdisk_raw_write_block;
+	return 0;
+}
+
+int vdisk_raw_create(VDISK *vd, uint64_t capacity, uint32_t flags) {
+	int e = vdisk_i_falloc(vd, 0, capacity, flags, OS_FALLOC_SPARSE);
+	if (e)
+		return e;
+	vd->format = VDISK_FORMAT_RAW;
+	vd->offset = 0;
+	vd->capacity = capacity;
+	vd->blksize = VDISK_BLOCKSIZE_RAW;
+	vd->blkcount = (capacity + VDISK_BLOCKSIZE_RAW - 1) / VDISK_BLOCKSIZE_RAW;
+	vd->cb.lba_read = vdisk_raw_read_lba;
+	vd->cb.lba_readn = vdisk_raw_read_lbas;
+	vd->cb.blk_locate = vdisk_raw_locate_block;
+	vd->cb.blk_map = vdisk_raw_map_block;
+	vd->cb.blk_write = vdisk_raw_write_block;
 	return 0;
 }
 
@@ -18,10 +41,52 @@ int vdisk_raw_read_lba(VDISK *vd, void *buffer, uint64_t index) {
 	if (offset >= vd->capacity)
 		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
 
-	if (os_fseek(vd->fd, offset, SEEK_SET))
+	if (os_pread(vd->fd, buffer, 512, offset))
 		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-	if (os_fread(vd->fd, buffer, 512))
+
+	return 0;
+}
+
+int vdisk_raw_read_lbas(VDISK *vd, void *buffer, uint64_t index, uint32_t count) {
+
+	uint64_t offset = SECTOR_TO_BYTE(index);
+	uint64_t size = SECTOR_TO_BYTE(count);
+
+	if (offset + size > vd->capacity)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	if (os_pread(vd->fd, buffer, size, offset))
 		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
 
 	return 0;
-}
\ No newline at end of file
+}
+
+int vdisk_raw_locate_block(VDISK *vd, uint64_t index, uint64_t *offset) {
+	if (index >= vd->blkcount)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+	*offset = index * vd->blksize;
+	return 0;
+}
+
+int vdisk_raw_map_block(VDISK *vd, uint64_t index, uint64_t *offset, uint64_t *count) {
+	if (index >= vd->blkcount)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+	*offset = index * vd->blksize;
+	*count = vd->blkcount - index;
+	return VDISK_EXTENT_DATA;
+}
+
+int vdisk_raw_write_block(VDISK *vd, void *buffer, uint64_t index) {
+	if (index >= vd->blkcount)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint64_t offset = index * vd->blksize;
+	uint64_t size = vd->blksize;
+	if (offset + size > vd->capacity)
+		size = vd->capacity - offset;
+
+	if (os_pwrite(vd->fd, buffer, size, offset))
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+
+	return 0;
+}
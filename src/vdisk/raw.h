@@ -1,4 +1,9 @@
 struct VDISK;
 
 int vdisk_raw_open(struct VDISK *vd, uint32_t flags, uint32_t internal);
-int vdisk_raw_read_lba(struct VDISK *vd, void *buffer, uint64_t index);
\ No newline at end of file
+int vdisk_raw_create(struct VDISK *vd, uint64_t capacity, uint32_t flags);
+int vdisk_raw_read_lba(struct VDISK *vd, void *buffer, uint64_t index);
+int vdisk_raw_read_lbas(struct VDISK *vd, void *buffer, uint64_t index, uint32_t count);
+int vdisk_raw_locate_block(struct VDISK *vd, uint64_t index, uint64_t *offset);
+int vdisk_raw_map_block(struct VDISK *vd, uint64_t index, uint64_t *offset, uint64_t *count);
+int vdisk_raw_write_block(struct VDISK *vd, void *buffer, uint64_t index);
@@ -15,20 +15,18 @@ int vdisk_vdi_open(VDISK *vd, uint32_t flags, uint32_t internal) {
 	if ((vd->meta = malloc(VDI_META_ALLOC)) == NULL)
 		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
 
-	if (os_fseek(vd->fd, 0, SEEK_SET))
-		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-	if (os_fread(vd->fd, &vd->vdi->hdr, sizeof(VDI_HDR)))
+	if (os_pread(vd->fd, &vd->vdi->hdr, sizeof(VDI_HDR), 0))
 		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
 	if (vd->vdi->hdr.magic != VDI_HEADER_MAGIC)
 		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
 
 	switch (vd->vdi->hdr.majorver) { // Use latest major version natively
 	case 1: // v1.1
-		if (os_fread(vd->fd, &vd->vdi->v1, sizeof(VDI_HEADERv1)))
+		if (os_pread(vd->fd, &vd->vdi->v1, sizeof(VDI_HEADERv1), sizeof(VDI_HDR)))
 			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
 		break;
 	/*case 0:
-		if (os_fread(vd->fd, &vd->vdi->v0, sizeof(VDI_HEADERv0)))
+		if (os_pread(vd->fd, &vd->vdi->v0, sizeof(VDI_HEADERv0), sizeof(VDI_HDR)))
 			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
 		break;*/
 	default:
@@ -47,24 +45,35 @@ int vdisk_vdi_open(VDISK *vd, uint32_t flags, uint32_t internal) {
 	//TODO: Consider if this is an error (or warning)
 	if (vd->vdi->v1.blk_size == 0)
 		vd->vdi->v1.blk_size = VDI_BLOCKSIZE;
-	if (os_fseek(vd->fd, vd->vdi->v1.offBlocks, SEEK_SET))
-		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-
-	int bsize = vd->vdi->v1.blk_total << 2; // * sizeof(u32)
-	if ((vd->vdi->in.offsets = malloc(bsize)) == NULL)
-		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
-	if (os_fread(vd->fd, vd->vdi->in.offsets, bsize))
-		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	size_t bsize = (size_t)vd->vdi->v1.blk_total << 2; // * sizeof(u32)
+	vd->vdi->in.map = NULL;
+	if (flags & VDISK_OPEN_MMAP) {
+		vd->vdi->in.offsets = os_mmap(vd->fd, vd->vdi->v1.offBlocks, bsize,
+			&vd->vdi->in.map, &vd->vdi->in.maplen);
+		if (vd->vdi->in.offsets == NULL)
+			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	} else {
+		if ((vd->vdi->in.offsets = malloc(bsize)) == NULL)
+			return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+		if (os_pread(vd->fd, vd->vdi->in.offsets, bsize, vd->vdi->v1.offBlocks))
+			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	}
 
 	// Internals / calculated values
 
 	vd->capacity     = vd->vdi->v1.capacity;
+	vd->blksize      = vd->vdi->v1.blk_size;
+	vd->blkcount     = vd->vdi->v1.blk_total;
 	vd->vdi->in.mask  = vd->vdi->v1.blk_size - 1;
 	vd->vdi->in.shift = fpow2(vd->vdi->v1.blk_size);
 
 	// Function pointers
 
 	vd->cb.lba_read = vdisk_vdi_read_sector;
+	vd->cb.lba_readn = vdisk_vdi_read_sectors;
+	vd->cb.blk_locate = vdisk_vdi_locate_block;
+	vd->cb.blk_map = vdisk_vdi_map_block;
+	vd->cb.blk_write = vdisk_vdi_write_block;
 
 	return 0;
 }
@@ -76,15 +85,19 @@ int vdisk_vdi_create(VDISK *vd, uint64_t capacity, uint32_t flags) {
 	if (capacity == 0)
 		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
 
-	uint32_t bcount = capacity / VDI_BLOCKSIZE;
+	uint32_t bcount = (uint32_t)((capacity + VDI_BLOCKSIZE - 1) / VDI_BLOCKSIZE);
+	// Block table, rounded to the block size
+	uint32_t bsize = ((bcount << 2) + VDI_BLOCKSIZE - 1) & ~(VDI_BLOCKSIZE - 1);
 
-	if ((vd->vdi->in.offsets = malloc(bcount << 2)) == NULL)
+	vd->vdi->in.map = NULL;
+	if ((vd->vdi->in.offsets = malloc((size_t)bcount << 2)) == NULL)
 		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
 
 	vd->format = VDISK_FORMAT_VDI;
 
 	// Pre-header
 
+	memset(vd->vdi->hdr.signature, 0, VDI_SIGNATURE_SIZE);
 	strcpy(vd->vdi->hdr.signature, VDI_SIGNATURE);
 	vd->vdi->hdr.magic = VDI_HEADER_MAGIC;
 	vd->vdi->hdr.majorver = 1;
@@ -106,8 +119,8 @@ int vdisk_vdi_create(VDISK *vd, uint64_t capacity, uint32_t flags) {
 	vd->vdi->v1.fFlags = 0;
 	vd->vdi->v1.hdrsize = (uint32_t)sizeof(VDI_HEADERv1);
 	vd->vdi->v1.offBlocks = VDI_BLOCKSIZE;
-	vd->vdi->v1.offData = VDI_BLOCKSIZE * 2;
-	vd->vdi->v1.blk_total = 0;
+	vd->vdi->v1.offData = VDI_BLOCKSIZE + bsize;
+	vd->vdi->v1.blk_total = bcount;
 	vd->vdi->v1.type = VDI_DISK_DYN;
 	vd->vdi->v1.u32Dummy = 0;	// Always
 	memset(vd->vdi->v1.szComment, 0, VDI_COMMENT_SIZE);
@@ -119,29 +132,48 @@ int vdisk_vdi_create(VDISK *vd, uint64_t capacity, uint32_t flags) {
 	// Data
 
 	uint32_t *offsets = vd->vdi->in.offsets;
-	uint8_t  *buffer;
 	uint32_t blk_total = vd->vdi->v1.blk_total;
+	int e;
 
 	switch (flags & VDISK_CREATE_TYPE_MASK) {
+	case 0: // Default
 	case VDISK_CREATE_TYPE_DYNAMIC:
 		vd->vdi->v1.type = VDI_DISK_DYN;
 		for (size_t i = 0; i < blk_total; ++i)
-			offsets[i] = VDI_BLOCK_ZERO;
+			offsets[i] = VDI_BLOCK_FREE;
 		break;
 	case VDISK_CREATE_TYPE_FIXED:
 		vd->vdi->v1.type = VDI_DISK_FIXED;
-		if ((buffer = calloc(1, vd->vdi->v1.blk_size)) == NULL)
-			return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
-		os_fseek(vd->fd, vd->vdi->v1.offData, SEEK_SET);
-		for (size_t i = 0; i < blk_total; ++i) {
-			offsets[i] = VDI_BLOCK_FREE;
-			os_fwrite(vd->fd, buffer, vd->vdi->v1.blk_size);
-		}
+		for (size_t i = 0; i < blk_total; ++i)
+			offsets[i] = (uint32_t)i;
+		// Blocks are all allocated in order but not written, reserving
+		// the data region is enough for them to read as zero
+		e = vdisk_i_falloc(vd, vd->vdi->v1.offData,
+			(uint64_t)blk_total * vd->vdi->v1.blk_size, flags, OS_FALLOC_RESERVE);
+		if (e)
+			return e;
+		vd->vdi->v1.blk_alloc = blk_total;
 		break;
 	default:
 		return vdisk_i_err(vd, VVD_EVDTYPE, __LINE__, __func__);
 	}
 
+	// Internals / calculated values
+
+	vd->capacity     = capacity;
+	vd->blksize      = VDI_BLOCKSIZE;
+	vd->blkcount     = bcount;
+	vd->vdi->in.mask  = VDI_BLOCKSIZE - 1;
+	vd->vdi->in.shift = fpow2(VDI_BLOCKSIZE);
+
+	// Function pointers
+
+	vd->cb.lba_read = vdisk_vdi_read_sector;
+	vd->cb.lba_readn = vdisk_vdi_read_sectors;
+	vd->cb.blk_locate = vdisk_vdi_locate_block;
+	vd->cb.blk_map = vdisk_vdi_map_block;
+	vd->cb.blk_write = vdisk_vdi_write_block;
+
 	return 0;
 }
 
@@ -158,8 +190,7 @@ int vdisk_vdi_read_sector(VDISK *vd, void *buffer, uint64_t index) {
 
 	uint32_t block = vd->vdi->in.offsets[bi];
 	switch (block) {
-	case VDI_BLOCK_ZERO: //TODO: Should this be zero'd too?
-		return vdisk_i_err(vd, VVD_EVDUNALLOC, __LINE__, __func__);
+	case VDI_BLOCK_ZERO:
 	case VDI_BLOCK_FREE:
 		memset(buffer, 0, 512);
 		return 0;
@@ -173,9 +204,132 @@ int vdisk_vdi_read_sector(VDISK *vd, void *buffer, uint64_t index) {
 	printf("%s: lba=%" PRId64 " -> offset=0x%" PRIX64 "\n", __func__, index, offset);
 #endif
 
-	if (os_fseek(vd->fd, offset, SEEK_SET))
+	if (os_pread(vd->fd, buffer, 512, offset))
 		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-	if (os_fread(vd->fd, buffer, 512))
+
+	return 0;
+}
+
+//
+// vdisk_vdi_read_sectors
+//
+
+int vdisk_vdi_read_sectors(VDISK *vd, void *buffer, uint64_t index, uint32_t count) {
+	uint8_t *buf = buffer;
+	uint64_t offset = SECTOR_TO_BYTE(index); // Byte offset
+	uint64_t end = offset + SECTOR_TO_BYTE(count);
+
+	if (end > vd->vdi->v1.capacity) // out of bounds
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint32_t *offsets = vd->vdi->in.offsets;
+	uint64_t bsize = vd->vdi->v1.blk_size;
+
+	while (offset < end) {
+		size_t bi = offset >> vd->vdi->in.shift;
+		if (bi >= vd->vdi->v1.blk_total)
+			return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+		uint64_t len = bsize - (offset & vd->vdi->in.mask);
+		if (len > end - offset)
+			len = end - offset;
+
+		uint32_t block = offsets[bi];
+		if (VDI_IS_ALLOCATED(block) == 0) {
+			memset(buf, 0, len);
+			buf += len;
+			offset += len;
+			continue;
+		}
+
+		// Extend the run while the next blocks follow physically
+		uint64_t run = len;
+		for (uint32_t n = 1; offset + run < end; ++n) {
+			if (bi + n >= vd->vdi->v1.blk_total ||
+				offsets[bi + n] != block + n)
+				break;
+			uint64_t left = end - offset - run;
+			run += left < bsize ? left : bsize;
+		}
+
+		uint64_t pos = vd->vdi->v1.offData +
+			((uint64_t)block * bsize) +
+			(offset & vd->vdi->in.mask);
+
+#ifdef TRACE
+		printf("%s: offset=0x%" PRIX64 " -> pos=0x%" PRIX64 " len=%" PRIu64 "\n",
+			__func__, offset, pos, run);
+#endif
+
+		if (os_pread(vd->fd, buf, run, pos))
+			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+
+		buf += run;
+		offset += run;
+	}
+
+	return 0;
+}
+
+//
+// vdisk_vdi_locate_block
+//
+
+int vdisk_vdi_locate_block(VDISK *vd, uint64_t index, uint64_t *offset) {
+	if (index >= vd->vdi->v1.blk_total)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint32_t block = vd->vdi->in.offsets[index];
+	if (VDI_IS_ALLOCATED(block) == 0)
+		return vdisk_i_err(vd, VVD_EVDUNALLOC, __LINE__, __func__);
+
+	*offset = vd->vdi->v1.offData + ((uint64_t)block * vd->vdi->v1.blk_size);
+	return 0;
+}
+
+//
+// vdisk_vdi_map_block
+//
+
+int vdisk_vdi_map_block(VDISK *vd, uint64_t index, uint64_t *offset, uint64_t *count) {
+	uint32_t total = vd->vdi->v1.blk_total;
+	if (index >= total)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint32_t *offsets = vd->vdi->in.offsets;
+	uint32_t block = offsets[index];
+	uint32_t i = (uint32_t)index + 1;
+	switch (block) {
+	case VDI_BLOCK_FREE:
+	case VDI_BLOCK_ZERO:
+		while (i < total && offsets[i] == block) ++i;
+		*count = i - index;
+		return block == VDI_BLOCK_ZERO ? VDISK_EXTENT_ZERO : VDISK_EXTENT_UNALLOC;
+	}
+
+	while (i < total && offsets[i] == block + (i - index)) ++i;
+	*offset = vd->vdi->v1.offData + ((uint64_t)block * vd->vdi->v1.blk_size);
+	*count = i - index;
+	return VDISK_EXTENT_DATA;
+}
+
+//
+// vdisk_vdi_write_block
+//
+
+int vdisk_vdi_write_block(VDISK *vd, void *buffer, uint64_t index) {
+	if (index >= vd->vdi->v1.blk_total)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint32_t block = vd->vdi->in.offsets[index];
+	if (VDI_IS_ALLOCATED(block) == 0) { // Append
+		if (vd->vdi->v1.blk_alloc >= vd->vdi->v1.blk_total)
+			return vdisk_i_err(vd, VVD_EVDFULL, __LINE__, __func__);
+		block = vd->vdi->in.offsets[index] = vd->vdi->v1.blk_alloc++;
+	}
+
+	uint64_t pos = vd->vdi->v1.offData +
+		((uint64_t)block * vd->vdi->v1.blk_size);
+	if (os_pwrite(vd->fd, buffer, vd->vdi->v1.blk_size, pos))
 		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
 
 	return 0;
@@ -191,6 +345,7 @@ int vdisk_vdi_compact(VDISK *vd, void(*cb)(uint32_t type, void *data)) {
 
 	uint32_t *blks2;	// back resolving array
 	uint32_t bk_alloc;	// blocks allocated (alt)
+	uint32_t bsize = vd->vdi->v1.blk_size;
 
 	// 1. Allocate block array for back resolving.
 
@@ -199,61 +354,228 @@ int vdisk_vdi_compact(VDISK *vd, void(*cb)(uint32_t type, void *data)) {
 		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
 
 	// This verifies that there are actually data blocks available
-	bk_alloc = (uint32_t)((fsize - vd->vdi->v1.offData - vd->vdi->v1.offBlocks) >> vd->vdi->in.shift);
+	if (fsize <= vd->vdi->v1.offData)
+		return 0;
+	bk_alloc = (uint32_t)((fsize - vd->vdi->v1.offData) >> vd->vdi->in.shift);
 	if (bk_alloc == 0 || vd->vdi->v1.blk_alloc == 0)
 		return 0;
 
-	blks2 = malloc(bk_alloc << 2);
+	blks2 = malloc((size_t)bk_alloc << 2);
 	if (blks2 == NULL)
 		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
-	for (uint32_t i; i < bk_alloc; ++i)
+	for (uint32_t i = 0; i < bk_alloc; ++i)
 		blks2[i] = VDI_BLOCK_FREE;
 
-	uint32_t d = 0;
 	uint32_t blk_index = 0;
 	uint32_t *blks = vd->vdi->in.offsets;
+	uint32_t blk_count = vd->vdi->v1.blk_total;
 
 	// 2. Check and fix allocation errors before compacting
 
-	for (; blk_index < vd->vdi->v1.blk_total; ++blk_index) {
+	for (; blk_index < blk_count; ++blk_index) {
 		uint32_t bi = blks[blk_index]; // block index
-		if (bi >= VDI_BLOCK_FREE) {
+		if (VDI_IS_ALLOCATED(bi) == 0)
 			continue;
-		}
 
-		if (bi < vd->vdi->v1.blk_alloc) {
-			if (blks[bi] == VDI_BLOCK_FREE) {
-				blks[bi] = blk_index;
-			} else {
-				blks[bi] = VDI_BLOCK_FREE;
-				//TODO: Update header once manipulating source
-				//rc = vdiUpdateBlockInfo(pImage, i);
-				//vdisk_write_block_at(vd, buffer, i, d++);
+		// Out of file or cross-linked blocks are dropped
+		if (bi < bk_alloc && blks2[bi] == VDI_BLOCK_FREE)
+			blks2[bi] = blk_index;
+		else
+			blks[blk_index] = VDI_BLOCK_FREE;
+	}
+
+	// 3. Find redundant information and update the block pointers accordingly
+	//    Blocks are read in file order, several at a time, and blocks
+	//    only containing zeros are marked as such.
+
+	// Copy unit, in blocks, for scanning and relocating. The buffer holds
+	// VDI_COMPACT_DEPTH units, which are all kept in flight.
+	uint32_t chunk = VDI_COMPACT_BUFSIZE / VDI_COMPACT_DEPTH / bsize;
+	if (chunk == 0)
+		chunk = 1;
+	size_t usize = (size_t)bsize * chunk;
+	uint8_t *buffer = os_amalloc(usize * VDI_COMPACT_DEPTH);
+	if (buffer == NULL) {
+		free(blks2);
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+	}
+	struct os_aio_t aio;
+	if (os_aio_init(&aio, VDI_COMPACT_DEPTH, buffer, usize * VDI_COMPACT_DEPTH)) {
+		os_afree(buffer);
+		free(blks2);
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+	}
+	struct {
+		uint32_t src;	// First block read
+		uint32_t dst;	// First block written (relocation)
+		uint32_t n;	// Number of blocks
+	} runs[VDI_COMPACT_DEPTH];	// Indexed by unit
+	uint32_t units[VDI_COMPACT_DEPTH];	// Free units (stack)
+	uint32_t nunits = VDI_COMPACT_DEPTH;
+	for (uint32_t u = 0; u < VDI_COMPACT_DEPTH; ++u)
+		units[u] = u;
+
+	int e = 0;
+	uint64_t tag;
+	if (cb) cb(VVD_NOTIF_VDISK_TOTAL_BLOCKS, &bk_alloc);
+
+	// Blocks are scanned once in file order
+	vdisk_i_advise(vd, OS_ADVICE_SEQUENTIAL);
+
+	for (uint32_t bi = 0;;) {
+		// Queue runs of referenced blocks into free units, skipping
+		// unreferenced blocks
+		while (nunits && bi < bk_alloc) {
+			if (blks2[bi] == VDI_BLOCK_FREE) {
+				++bi;
+				continue;
 			}
-		} else {
-			blks[bi] = VDI_BLOCK_FREE;
-			//TODO: Update header once manipulating source
-			//blocks[bi] = VDI_BLOCK_FREE;
-			//vdisk_write_block_at(vd, buffer, i, d++);
+			uint32_t n = 1;
+			while (n < chunk && bi + n < bk_alloc && blks2[bi + n] != VDI_BLOCK_FREE)
+				++n;
+			uint32_t u = units[--nunits];
+			runs[u].src = bi;
+			runs[u].n = n;
+			os_aio_read(&aio, vd->fd, buffer + u * usize, (size_t)n * bsize,
+				vd->vdi->v1.offData + ((uint64_t)bi * bsize), u);
+			bi += n;
+		}
+
+		// Runs complete in any order
+		int r = os_aio_wait(&aio, &tag);
+		if (r == -2)
+			break;
+		if (r) {
+			e = vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+			goto L_EXIT;
 		}
+		uint32_t u = (uint32_t)tag;
+		uint8_t *data = buffer + u * usize;
+		vdisk_i_drop(vd, vd->vdi->v1.offData + ((uint64_t)runs[u].src * bsize),
+			(uint64_t)runs[u].n * bsize);
+
+		for (uint32_t i = 0; i < runs[u].n; ++i) {
+			uint32_t b = runs[u].src + i;
+			if (iszero(data + ((size_t)i * bsize), bsize) == 0)
+				continue;
+			blks[blks2[b]] = VDI_BLOCK_ZERO;
+			blks2[b] = VDI_BLOCK_FREE;
+		}
+		units[nunits++] = u;
+
+		if (cb) cb(VVD_NOTIF_VDISK_CURRENT_BLOCK, &bi);
 	}
 
-	// 3. Find redundant information and update the block pointers accordingly
+	if (cb) cb(VVD_NOTIF_DONE, NULL);
 
-	uint32_t blk_count = vd->vdi->v1.blk_total;
+	// Ordering for crash safety: Holes are only written once the on-disk
+	// block table no longer references them, new locations are only
+	// referenced once their data is on disk, and the file is only truncated
+	// once nothing references the old locations. Until the truncation, the
+	// old locations remain valid copies.
 
-	for (blk_index = 0; blk_index < blk_count; ++blk_index) {
-		uint32_t bi = blks[blk_index]; // block index
-		if (bi >= VDI_BLOCK_FREE) {
-			continue;
-		}
+	if (vdisk_update(vd)) {
+		e = vd->err.num;
+		goto L_EXIT;
+	}
+	if (os_fsync(vd->fd)) {
+		e = vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+		goto L_EXIT;
 	}
 
 	// 4. Fill bubbles with other data if available
+	//    Runs of blocks at the end of the file are moved into runs of holes
+	//    at the start of the file, keeping their order.
+
+	uint32_t lo = 0;	// First hole
+	uint32_t hi = bk_alloc;	// Past the last referenced block
+	while (lo < hi && blks2[lo] != VDI_BLOCK_FREE) ++lo;
+	while (hi > lo && blks2[hi - 1] == VDI_BLOCK_FREE) --hi;
+
+	if (cb) cb(VVD_NOTIF_VDISK_TOTAL_BLOCKS, &hi);
+
+	while (lo < hi) {
+		// Plan a batch of moves, one per unit. Destinations are below
+		// lo and sources are at or above hi, so moves never overlap.
+		uint32_t batch = 0;
+		for (; batch < VDI_COMPACT_DEPTH && lo < hi; ++batch) {
+			uint32_t n = 1;	// Hole run
+			while (n < chunk && lo + n < hi && blks2[lo + n] == VDI_BLOCK_FREE)
+				++n;
+			uint32_t t = 1;	// Tail run, cannot overlap the hole run
+			while (t < n && hi - t - 1 > lo + t && blks2[hi - t - 1] != VDI_BLOCK_FREE)
+				++t;
+
+			runs[batch].src = hi - t;
+			runs[batch].dst = lo;
+			runs[batch].n = t;
+			for (uint32_t i = 0; i < t; ++i) {
+				blks2[lo + i] = blks2[hi - t + i];
+				blks2[hi - t + i] = VDI_BLOCK_FREE;
+			}
 
-//	for (i = 0; o < vd->vdiold.blk_alloc
+			while (lo < hi && blks2[lo] != VDI_BLOCK_FREE) ++lo;
+			while (hi > lo && blks2[hi - 1] == VDI_BLOCK_FREE) --hi;
+		}
+
+		// Read all sources, then write all destinations
+		for (int write = 0; write < 2; ++write) {
+			for (uint32_t b = 0; b < batch; ++b) {
+				uint32_t at = write ? runs[b].dst : runs[b].src;
+				uint64_t pos = vd->vdi->v1.offData + ((uint64_t)at * bsize);
+				size_t size = (size_t)runs[b].n * bsize;
+				if (write)
+					os_aio_write(&aio, vd->fd, buffer + b * usize, size, pos, b);
+				else
+					os_aio_read(&aio, vd->fd, buffer + b * usize, size, pos, b);
+			}
+			int r;
+			while ((r = os_aio_wait(&aio, &tag)) != -2) {
+				if (r) {
+					e = vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+					goto L_EXIT;
+				}
+			}
+		}
+
+		// The block table only references new locations once written
+		for (uint32_t b = 0; b < batch; ++b) {
+			size_t size = (size_t)runs[b].n * bsize;
+			// Neither is accessed again, the source is truncated later
+			vdisk_i_drop(vd, vd->vdi->v1.offData + ((uint64_t)runs[b].src * bsize), size);
+			vdisk_i_drop(vd, vd->vdi->v1.offData + ((uint64_t)runs[b].dst * bsize), size);
+			for (uint32_t i = 0; i < runs[b].n; ++i)
+				blks[blks2[runs[b].dst + i]] = runs[b].dst + i;
+		}
+
+		if (cb) cb(VVD_NOTIF_VDISK_CURRENT_BLOCK, &lo);
+	}
 
 	// 5. Update fields in-memory and on-disk
 
-	return 0;
+	if (os_fsync(vd->fd)) {
+		e = vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+		goto L_EXIT;
+	}
+
+	vd->vdi->v1.blk_alloc = hi;
+	if (vdisk_update(vd)) {
+		e = vd->err.num;
+		goto L_EXIT;
+	}
+
+	if (os_fsync(vd->fd) ||
+		os_ftruncate(vd->fd, vd->vdi->v1.offData + ((uint64_t)hi * bsize)) ||
+		os_fsync(vd->fd))
+		e = vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+
+	if (cb) cb(VVD_NOTIF_DONE, NULL);
+
+L_EXIT:
+	os_fadvise(vd->fd, 0, 0, OS_ADVICE_DONTNEED);
+	vdisk_i_advise(vd, OS_ADVICE_NORMAL);
+	os_aio_end(&aio);
+	os_afree(buffer);
+	free(blks2);
+	return e;
 }
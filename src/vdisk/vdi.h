@@ -39,6 +39,8 @@ enum {
 	VDI_DISK_DIFF	= 4,
 
 	VDI_BLOCKSIZE	= 1048576,	// Default block size, 1 MiB
+	VDI_COMPACT_BUFSIZE	= 32 * 1048576,	// Compact buffer, 32 MiB
+	VDI_COMPACT_DEPTH	= 8,	// Compact copy units in flight
 };
 
 typedef struct {
@@ -96,6 +98,8 @@ typedef struct { // v1.1
 
 typedef struct {
 	uint32_t *offsets;	// Offset table
+	void *map;	// Offset table mapping (VDISK_OPEN_MMAP), otherwise NULL
+	size_t maplen;	// Offset table mapping length
 	uint32_t mask;	// Block bit mask
 	uint32_t shift;	// Block shift positions
 	uint16_t majorver;
@@ -120,4 +124,12 @@ int vdisk_vdi_create(struct VDISK *vd, uint64_t capacity, uint32_t flags);
 
 int vdisk_vdi_read_sector(struct VDISK *vd, void *buffer, uint64_t index);
 
+int vdisk_vdi_read_sectors(struct VDISK *vd, void *buffer, uint64_t index, uint32_t count);
+
+int vdisk_vdi_locate_block(struct VDISK *vd, uint64_t index, uint64_t *offset);
+
+int vdisk_vdi_map_block(struct VDISK *vd, uint64_t index, uint64_t *offset, uint64_t *count);
+
+int vdisk_vdi_write_block(struct VDISK *vd, void *buffer, uint64_t index);
+
 int vdisk_vdi_compact(struct VDISK *vd, void(*cb)(uint32_t type, void *data));
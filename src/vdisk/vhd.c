@@ -1,12 +1,21 @@
+#include <string.h> // memset
 #include "vdisk.h"
 #include "utils.h"
 #include "platform.h"
-#include "utils.h"
 #ifdef TRACE
 #include <stdio.h>
 #include <inttypes.h>
 #endif
 
+// BAT entries are decoded on access
+#if ENDIAN_LITTLE
+#define VHD_BAT(vhd, i) bswap32((vhd)->in.offsets[i])
+#else
+#define VHD_BAT(vhd, i) ((vhd)->in.offsets[i])
+#endif
+
+static int vdisk_vhd_open_chain(VDISK *vd, uint32_t flags, uint32_t depth);
+
 //
 // vdisk_vhd_open
 //
@@ -15,12 +24,23 @@ int vdisk_vhd_open(VDISK *vd, uint32_t flags, uint32_t internal) {
 	if ((vd->vmdk = malloc(VHD_META_ALLOC)) == NULL)
 		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
 
+	vd->vhd->in.offsets = NULL;
+	vd->vhd->in.map = NULL;
+	vd->vhd->in.bitmaps = NULL;
+	vd->vhd->in.parent = NULL;
+	vd->vhd->in.chain = NULL;
+	vd->vhd->in.resolved = NULL;
+	vd->vhd->in.depth = 0;
+	vd->vhd->dyn.max_entries = 0;
+
+	uint64_t hpos = 0; // Footer position
 	if (internal & 2) {
-		if (os_fseek(vd->fd, -512, SEEK_END))
+		if (os_fsize(vd->fd, &hpos) || hpos < 512)
 			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+		hpos -= 512;
 	}
 
-	if (os_fread(vd->fd, &vd->vhd->hdr, sizeof(VHD_HDR)))
+	if (os_pread(vd->fd, &vd->vhd->hdr, sizeof(VHD_HDR), hpos))
 		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
 	if (vd->vhd->hdr.magic != VHD_MAGIC)
 		return vdisk_i_err(vd, VVD_EVDMAGIC, __LINE__, __func__);
@@ -60,9 +80,7 @@ int vdisk_vhd_open(VDISK *vd, uint32_t flags, uint32_t internal) {
 #endif
 
 	if (vd->vhd->hdr.type != VHD_DISK_FIXED) {
-		if (os_fseek(vd->fd, vd->vhd->hdr.offset, SEEK_SET))
-			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-		if (os_fread(vd->fd, &vd->vhd->dyn, sizeof(VHD_DYN_HDR)))
+		if (os_pread(vd->fd, &vd->vhd->dyn, sizeof(VHD_DYN_HDR), vd->vhd->hdr.offset))
 			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
 		if (vd->vhd->dyn.magic != VHD_DYN_MAGIC)
 			return vdisk_i_err(vd, VVD_EVDMAGIC, __LINE__, __func__);
@@ -96,30 +114,339 @@ int vdisk_vhd_open(VDISK *vd, uint32_t flags, uint32_t internal) {
 
 		vd->vhd->in.mask  = vd->vhd->dyn.blocksize - 1;
 		vd->vhd->in.shift = fpow2(vd->vhd->dyn.blocksize);
+		// One bit per sector, padded to a sector
+		vd->vhd->in.bitmap = ((((vd->vhd->dyn.blocksize >> 9) + 7) >> 3) + 511) & ~511u;
 
 		if (vd->vhd->dyn.max_entries == 0)
 			return vdisk_i_err(vd, VVD_EVDMAGIC, __LINE__, __func__);
-		if (os_fseek(vd->fd, vd->vhd->dyn.table_offset, SEEK_SET))
-			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-
-		int batsize = vd->vhd->dyn.max_entries << 2; // "* 4"
-		if ((vd->vhd->in.offsets = malloc(batsize)) == NULL)
+		size_t batsize = (size_t)vd->vhd->dyn.max_entries << 2; // "* 4"
+		if (flags & VDISK_OPEN_MMAP) {
+			vd->vhd->in.offsets = os_mmap(vd->fd, vd->vhd->dyn.table_offset,
+				batsize, &vd->vhd->in.map, &vd->vhd->in.maplen);
+			if (vd->vhd->in.offsets == NULL)
+				return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+		} else {
+			if ((vd->vhd->in.offsets = malloc(batsize)) == NULL)
+				return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+			if (os_pread(vd->fd, vd->vhd->in.offsets, batsize, vd->vhd->dyn.table_offset))
+				return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+		}
+		if ((vd->vhd->in.bitmaps = calloc(vd->vhd->dyn.max_entries, sizeof(uint8_t*))) == NULL)
 			return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
-		if (os_fread(vd->fd, vd->vhd->in.offsets, batsize))
-			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-#if ENDIAN_LITTLE
-		for (size_t i = 0; i < vd->vhd->dyn.max_entries; ++i)
-			vd->vhd->in.offsets[i] = bswap32(vd->vhd->in.offsets[i]);
-#endif
 		vd->cb.lba_read = vdisk_vhd_dyn_read_lba;
+		vd->cb.lba_readn = vdisk_vhd_dyn_read_lbas;
+		vd->cb.blk_locate = vdisk_vhd_dyn_locate_block;
+		vd->cb.blk_map = vdisk_vhd_dyn_map_block;
+		vd->blksize = vd->vhd->dyn.blocksize;
+		vd->blkcount = vd->vhd->dyn.max_entries;
 	} else { // Fixed
 		vd->cb.lba_read = vdisk_vhd_fixed_read_lba;
+		vd->cb.lba_readn = vdisk_vhd_fixed_read_lbas;
+		vd->cb.blk_locate = vdisk_vhd_fixed_locate_block;
+		vd->cb.blk_map = vdisk_vhd_fixed_map_block;
+		vd->blksize = VDISK_BLOCKSIZE_RAW;
+		vd->blkcount = (vd->vhd->hdr.size_original + VDISK_BLOCKSIZE_RAW - 1) /
+			VDISK_BLOCKSIZE_RAW;
 	}
 
 	vd->capacity = vd->vhd->hdr.size_original;
+
+	// Upper bits of internal flags hold the depth within a chain
+	if (vd->vhd->hdr.type == VHD_DISK_DIFF)
+		return vdisk_vhd_open_chain(vd, flags, internal >> 8);
+
+	return 0;
+}
+
+//
+// vdisk_vhd_close
+//
+
+void vdisk_vhd_close(VDISK *vd) {
+	if (vd->vhd == NULL)
+		return;
+	VHD_INTERNALS *in = &vd->vhd->in;
+	if (in->parent) { // Closes its own ancestors
+		vdisk_close(in->parent);
+		free(in->parent);
+		in->parent = NULL;
+	}
+	free(in->chain);
+	free(in->resolved);
+	in->chain = NULL;
+	in->resolved = NULL;
+	if (in->bitmaps) {
+		for (uint32_t i = 0; i < vd->vhd->dyn.max_entries; ++i)
+			free(in->bitmaps[i]);
+		free(in->bitmaps);
+		in->bitmaps = NULL;
+	}
+	if (in->map)
+		os_munmap(in->map, in->maplen);
+	else
+		free(in->offsets);
+	in->offsets = NULL;
+	in->map = NULL;
+}
+
+// Convert a parent name to a path, relative to the directory of the
+// child unless absolute. If base is set, the directory part of the name
+// is dropped.
+static int vdisk_vhd_path(const oschar *child, oschar *out, const char16 *name, size_t n, int be, int base) {
+	size_t len = 0;
+	for (size_t i = 0; i < n; ++i) {
+		uint32_t c = name[i];
+#if ENDIAN_LITTLE
+		if (be) c = bswap16((uint16_t)c);
+#else
+		if (be == 0) c = bswap16((uint16_t)c);
+#endif
+		if (c == 0)
+			break;
+#ifdef _WIN32
+		if (len + 1 >= VHD_PATH_MAX)
+			return 1;
+		out[len++] = (oschar)c;
+#else
+		if (c == '\\')
+			c = '/';
+		if (c >= 0xD800 && c < 0xDC00 && i + 1 < n) { // Surrogate pair
+			uint32_t lo = name[i + 1];
+#if ENDIAN_LITTLE
+			if (be) lo = bswap16((uint16_t)lo);
+#else
+			if (be == 0) lo = bswap16((uint16_t)lo);
+#endif
+			if (lo >= 0xDC00 && lo < 0xE000) {
+				c = 0x10000 + ((c - 0xD800) << 10) + (lo - 0xDC00);
+				++i;
+			}
+		}
+		if (len + 5 >= VHD_PATH_MAX)
+			return 1;
+		if (c < 0x80) {
+			out[len++] = (char)c;
+		} else if (c < 0x800) {
+			out[len++] = (char)(0xC0 | (c >> 6));
+			out[len++] = (char)(0x80 | (c & 0x3F));
+		} else if (c < 0x10000) {
+			out[len++] = (char)(0xE0 | (c >> 12));
+			out[len++] = (char)(0x80 | ((c >> 6) & 0x3F));
+			out[len++] = (char)(0x80 | (c & 0x3F));
+		} else {
+			out[len++] = (char)(0xF0 | (c >> 18));
+			out[len++] = (char)(0x80 | ((c >> 12) & 0x3F));
+			out[len++] = (char)(0x80 | ((c >> 6) & 0x3F));
+			out[len++] = (char)(0x80 | (c & 0x3F));
+		}
+#endif
+	}
+	out[len] = 0;
+	if (len == 0)
+		return 1;
+
+	if (base) {
+		size_t start = 0;
+		for (size_t i = 0; i < len; ++i)
+			if (out[i] == '/' || out[i] == '\\')
+				start = i + 1;
+		len -= start;
+		memmove(out, out + start, (len + 1) * sizeof(oschar));
+		if (len == 0)
+			return 1;
+	} else {
+#ifdef _WIN32
+		if ((len >= 2 && out[1] == ':') || out[0] == '\\' || out[0] == '/')
+			return 0;
+#else
+		if (out[0] == '/')
+			return 0;
+#endif
+	}
+
+	// Prefix with the directory of the child
+	size_t dir = 0;
+	if (child) {
+		for (size_t i = 0; child[i]; ++i) {
+#ifdef _WIN32
+			if (child[i] == '\\' || child[i] == '/' || child[i] == ':')
+#else
+			if (child[i] == '/')
+#endif
+				dir = i + 1;
+		}
+	}
+	if (dir + len >= VHD_PATH_MAX)
+		return 1;
+	memmove(out + dir, out, (len + 1) * sizeof(oschar));
+	memcpy(out, child, dir * sizeof(oschar));
+	return 0;
+}
+
+// Open a parent. Returns 1 if the file could not be opened.
+static int vdisk_vhd_open_parent(VDISK *vd, const oschar *path, uint32_t flags, uint32_t depth) {
+	VDISK *p = malloc(sizeof(VDISK));
+	if (p == NULL)
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+	p->fd = flags & VDISK_OPEN_DIRECT ? os_fopen_direct(path) : 0;
+	if (p->fd == 0 && (p->fd = os_fopen(path)) == 0) {
+		free(p);
+		return 1;
+	}
+	vdisk_i_pre_init(p);
+	p->path = path;
+	p->format = VDISK_FORMAT_VHD;
+
+	// Fixed disks only have a footer
+	uint64_t magic;
+	uint32_t internal = (depth + 1) << 8;
+	if (os_pread(p->fd, &magic, sizeof(magic), 0)) {
+		vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+		goto L_ERROR;
+	}
+	if (magic != VHD_MAGIC)
+		internal |= 2;
+
+	if (vdisk_vhd_open(p, flags, internal)) {
+		vd->err = p->err;
+		goto L_ERROR;
+	}
+
+	VHD_META *child = vd->vhd, *parent = p->vhd;
+	if (uid_cmp(&parent->hdr.uuid, &child->dyn.parent_uuid) == 0 ||
+		p->capacity < vd->capacity ||
+		(parent->hdr.type != VHD_DISK_FIXED &&
+		parent->dyn.blocksize != child->dyn.blocksize)) {
+		vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+		goto L_ERROR;
+	}
+
+	p->path = NULL;
+	vd->vhd->in.parent = p;
+	return 0;
+
+L_ERROR:
+	vdisk_close(p);
+	free(p);
+	return vd->err.num;
+}
+
+// Find and open the parent chain of a differencing disk
+static int vdisk_vhd_open_chain(VDISK *vd, uint32_t flags, uint32_t depth) {
+	VHD_INTERNALS *in = &vd->vhd->in;
+	if (depth >= VHD_CHAIN_MAX)
+		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+
+	oschar *path = malloc(VHD_PATH_MAX * sizeof(oschar));
+	char16 *name = malloc(VHD_LOCATOR_MAX);
+	if (path == NULL || name == NULL) {
+		free(path);
+		free(name);
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+	}
+
+	// Locators, then the parent name, then the parent file name alone
+	int e = 1;
+	for (int i = 0; e == 1 && i < 10; ++i) {
+		size_t n;
+		int be = 0;
+		if (i < 8) {
+			VHD_PARENT_LOCATOR *loc = vd->vhd->dyn.parent_locator + i;
+			if (loc->code != VHD_PLAT_W2RU && loc->code != VHD_PLAT_W2KU)
+				continue;
+			if (loc->datasize == 0 || loc->datasize > VHD_LOCATOR_MAX)
+				continue;
+			if (os_pread(vd->fd, name, loc->datasize, loc->offset))
+				continue;
+			n = loc->datasize >> 1;
+		} else {
+			memcpy(name, vd->vhd->dyn.parent_name, sizeof(vd->vhd->dyn.parent_name));
+			n = sizeof(vd->vhd->dyn.parent_name) >> 1;
+			be = 1;
+		}
+		if (vdisk_vhd_path(vd->path, path, name, n, be, i == 9))
+			continue;
+		e = vdisk_vhd_open_parent(vd, path, flags, depth);
+	}
+	free(name);
+	free(path);
+	if (e == 1) // Not found
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	if (e)
+		return e;
+
+	// Ancestors, parent first
+	VDISK *p = in->parent;
+	uint32_t pdepth = p->vhd->in.depth;
+	in->depth = pdepth + 1;
+	in->chain = malloc(in->depth * sizeof(VDISK*));
+	in->resolved = calloc(vd->vhd->dyn.max_entries, 1);
+	if (in->chain == NULL || in->resolved == NULL)
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+	in->chain[0] = p;
+	for (uint32_t i = 0; i < pdepth; ++i)
+		in->chain[i + 1] = p->vhd->in.chain[i];
+
+	return 0;
+}
+
+// Get the nearest ancestor allocating a block, NULL if none
+static VDISK* vdisk_vhd_ancestor(VDISK *vd, uint32_t bi) {
+	VHD_INTERNALS *in = &vd->vhd->in;
+	if (in->parent == NULL)
+		return NULL;
+	uint8_t r = in->resolved[bi];
+	if (r == 0) {
+		r = VHD_LAYER_NONE;
+		for (uint32_t i = 0; i < in->depth; ++i) {
+			VHD_META *a = in->chain[i]->vhd;
+			if (a->hdr.type == VHD_DISK_FIXED || VHD_BAT(a, bi) != VHD_BLOCK_UNALLOC) {
+				r = (uint8_t)(i + 1);
+				break;
+			}
+		}
+		in->resolved[bi] = r;
+	}
+	return r == VHD_LAYER_NONE ? NULL : in->chain[r - 1];
+}
+
+// Read sectors absent from a block from the nearest ancestor, or zero them.
+// Ancestors are read through their backend, without a readahead buffer each.
+static int vdisk_vhd_read_absent(VDISK *vd, uint32_t bi, void *buffer, uint64_t offset, size_t size) {
+	VDISK *a = vdisk_vhd_ancestor(vd, bi);
+	if (a == NULL) {
+		memset(buffer, 0, size);
+		return 0;
+	}
+	if (a->cb.lba_readn(a, buffer, BYTE_TO_SECTOR(offset), (uint32_t)BYTE_TO_SECTOR(size))) {
+		vd->err = a->err;
+		return vd->err.num;
+	}
 	return 0;
 }
 
+// Get the sector bitmap of an allocated block, NULL on error
+static uint8_t* vdisk_vhd_bitmap(VDISK *vd, uint32_t bi, uint32_t block) {
+	VHD_INTERNALS *in = &vd->vhd->in;
+	uint8_t *bitmap = in->bitmaps[bi];
+	if (bitmap)
+		return bitmap;
+
+	if ((bitmap = malloc(in->bitmap)) == NULL) {
+		vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+		return NULL;
+	}
+	if (os_pread(vd->fd, bitmap, in->bitmap, SECTOR_TO_BYTE(block))) {
+		free(bitmap);
+		vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+		return NULL;
+	}
+	return in->bitmaps[bi] = bitmap;
+}
+
+// Sector bits are stored most significant bit first
+#define VHD_BIT(bitmap, i) (((bitmap)[(i) >> 3] >> (7 - ((i) & 7))) & 1)
+
 //
 // vdisk_vhd_fixed_read_lba
 //
@@ -127,9 +454,24 @@ int vdisk_vhd_open(VDISK *vd, uint32_t flags, uint32_t internal) {
 int vdisk_vhd_fixed_read_lba(VDISK *vd, void *buffer, uint64_t index) {
 	uint64_t offset = SECTOR_TO_BYTE(index); // Byte offset
 
-	if (os_fseek(vd->fd, offset, SEEK_SET))
+	if (os_pread(vd->fd, buffer, 512, offset))
 		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-	if (os_fread(vd->fd, buffer, 512))
+
+	return 0;
+}
+
+//
+// vdisk_vhd_fixed_read_lbas
+//
+
+int vdisk_vhd_fixed_read_lbas(VDISK *vd, void *buffer, uint64_t index, uint32_t count) {
+	uint64_t offset = SECTOR_TO_BYTE(index); // Byte offset
+	uint64_t size = SECTOR_TO_BYTE(count);
+
+	if (offset + size > vd->capacity)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	if (os_pread(vd->fd, buffer, size, offset))
 		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
 
 	return 0;
@@ -140,27 +482,181 @@ int vdisk_vhd_fixed_read_lba(VDISK *vd, void *buffer, uint64_t index) {
 //
 
 int vdisk_vhd_dyn_read_lba(VDISK *vd, void *buffer, uint64_t index) {
-	uint64_t offset = SECTOR_TO_BYTE(index);
-	uint32_t bi = (uint32_t)(offset >> vd->vhd->in.shift);
+	uint32_t bi = (uint32_t)(SECTOR_TO_BYTE(index) >> vd->vhd->in.shift);
 #ifdef TRACE
 	printf("%s: bi=%u\n", __func__, bi);
 #endif
 	if (bi >= vd->vhd->dyn.max_entries)
 		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
 
-	uint32_t block = vd->vhd->in.offsets[bi];
-	if (block == VHD_BLOCK_UNALLOC) // Unallocated
+	if (VHD_BAT(vd->vhd, bi) == VHD_BLOCK_UNALLOC && // Unallocated
+		vdisk_vhd_ancestor(vd, bi) == NULL)
 		return vdisk_i_err(vd, VVD_EVDUNALLOC, __LINE__, __func__);
 
-	uint64_t base = SECTOR_TO_BYTE(block) + 512;
-	offset = base + (offset & vd->vhd->in.mask);
+	return vdisk_vhd_dyn_read_lbas(vd, buffer, index, 1);
+}
+
+//
+// vdisk_vhd_dyn_read_lbas
+//
+
+int vdisk_vhd_dyn_read_lbas(VDISK *vd, void *buffer, uint64_t index, uint32_t count) {
+	uint8_t *buf = buffer;
+	uint64_t offset = SECTOR_TO_BYTE(index);
+	uint64_t end = offset + SECTOR_TO_BYTE(count);
+
+	if (end > vd->capacity)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	// Each block is preceded by its sector bitmap, so data from two
+	// blocks is never contiguous: one read per run of present sectors.
+	while (offset < end) {
+		uint32_t bi = (uint32_t)(offset >> vd->vhd->in.shift);
+		if (bi >= vd->vhd->dyn.max_entries)
+			return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+		uint64_t len = vd->vhd->dyn.blocksize - (offset & vd->vhd->in.mask);
+		if (len > end - offset)
+			len = end - offset;
+
+		uint32_t block = VHD_BAT(vd->vhd, bi);
+		if (block == VHD_BLOCK_UNALLOC) {
+			if (vdisk_vhd_read_absent(vd, bi, buf, offset, len))
+				return vd->err.num;
+		} else {
+			uint8_t *bitmap = vdisk_vhd_bitmap(vd, bi, block);
+			if (bitmap == NULL)
+				return vd->err.num;
+			uint64_t base = SECTOR_TO_BYTE(block) + vd->vhd->in.bitmap;
+			uint32_t s = (uint32_t)((offset & vd->vhd->in.mask) >> 9);
+			uint32_t n = (uint32_t)(len >> 9);
+			for (uint32_t i = 0; i < n;) {
+				uint32_t bit = VHD_BIT(bitmap, s + i);
+				uint32_t j = i + 1;
+				while (j < n) {
+					uint32_t k = s + j;
+					if ((k & 7) == 0 && j + 8 <= n &&
+						bitmap[k >> 3] == (bit ? 0xFF : 0)) {
+						j += 8;
+						continue;
+					}
+					if (VHD_BIT(bitmap, k) != bit)
+						break;
+					++j;
+				}
+				uint8_t *b = buf + SECTOR_TO_BYTE(i);
+				size_t size = (size_t)SECTOR_TO_BYTE(j - i);
 #ifdef TRACE
-	printf("%s: block=%u  offset=%" PRIu64 "\n", __func__, block, offset);
+				printf("%s: block=%u  sector=%u  count=%u  present=%u\n",
+					__func__, block, s + i, j - i, bit);
 #endif
-	if (os_fseek(vd->fd, offset, SEEK_SET))
-		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-	if (os_fread(vd->fd, buffer, 512))
-		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+				if (bit == 0) {
+					if (vdisk_vhd_read_absent(vd, bi, b,
+						offset + SECTOR_TO_BYTE(i), size))
+						return vd->err.num;
+				} else if (os_pread(vd->fd, b, size, base + SECTOR_TO_BYTE(s + i)))
+					return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+				i = j;
+			}
+		}
+
+		buf += len;
+		offset += len;
+	}
 
 	return 0;
 }
+
+//
+// vdisk_vhd_fixed_locate_block
+//
+
+int vdisk_vhd_fixed_locate_block(VDISK *vd, uint64_t index, uint64_t *offset) {
+	if (index >= vd->blkcount)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+	*offset = index * vd->blksize;
+	return 0;
+}
+
+//
+// vdisk_vhd_dyn_locate_block
+//
+
+int vdisk_vhd_dyn_locate_block(VDISK *vd, uint64_t index, uint64_t *offset) {
+	if (index >= vd->vhd->dyn.max_entries)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	// Blocks held by ancestors are read by sectors
+	uint32_t block = VHD_BAT(vd->vhd, index);
+	if (block == VHD_BLOCK_UNALLOC)
+		return vdisk_i_err(vd, vdisk_vhd_ancestor(vd, (uint32_t)index) ?
+			VVD_EVDTYPE : VVD_EVDUNALLOC, __LINE__, __func__);
+
+	// Only blocks with all sectors present can be copied as-is
+	uint8_t *bitmap = vdisk_vhd_bitmap(vd, (uint32_t)index, block);
+	if (bitmap == NULL)
+		return vd->err.num;
+	uint32_t sectors = vd->vhd->dyn.blocksize >> 9;
+	uint32_t set = 0;
+	for (uint32_t i = 0; i < sectors >> 3; ++i) {
+		switch (bitmap[i]) {
+		case 0xFF: set += 8; continue;
+		case 0: continue;
+		}
+		return vdisk_i_err(vd, VVD_EVDTYPE, __LINE__, __func__);
+	}
+	for (uint32_t i = sectors & ~7u; i < sectors; ++i)
+		set += VHD_BIT(bitmap, i);
+	if (set == 0)
+		return vdisk_i_err(vd, vdisk_vhd_ancestor(vd, (uint32_t)index) ?
+			VVD_EVDTYPE : VVD_EVDUNALLOC, __LINE__, __func__);
+	if (set != sectors) // Partially present, read by sectors
+		return vdisk_i_err(vd, VVD_EVDTYPE, __LINE__, __func__);
+
+	*offset = SECTOR_TO_BYTE(block) + vd->vhd->in.bitmap;
+	return 0;
+}
+
+//
+// vdisk_vhd_fixed_map_block
+//
+
+int vdisk_vhd_fixed_map_block(VDISK *vd, uint64_t index, uint64_t *offset, uint64_t *count) {
+	if (index >= vd->blkcount)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+	*offset = index * vd->blksize;
+	*count = vd->blkcount - index;
+	return VDISK_EXTENT_DATA;
+}
+
+//
+// vdisk_vhd_dyn_map_block
+//
+
+int vdisk_vhd_dyn_map_block(VDISK *vd, uint64_t index, uint64_t *offset, uint64_t *count) {
+	uint32_t total = vd->vhd->dyn.max_entries;
+	if (index >= total)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint32_t *offsets = vd->vhd->in.offsets;	// Unallocated is endian-neutral
+	uint32_t block = VHD_BAT(vd->vhd, index);
+	uint32_t i = (uint32_t)index + 1;
+	if (block == VHD_BLOCK_UNALLOC) {
+		if (vdisk_vhd_ancestor(vd, (uint32_t)index)) { // Data within a parent
+			while (i < total && offsets[i] == VHD_BLOCK_UNALLOC &&
+				vdisk_vhd_ancestor(vd, i)) ++i;
+			*count = i - index;
+			return VDISK_EXTENT_PARENT;
+		}
+		while (i < total && offsets[i] == VHD_BLOCK_UNALLOC &&
+			vdisk_vhd_ancestor(vd, i) == NULL) ++i;
+		*count = i - index;
+		return VDISK_EXTENT_UNALLOC;
+	}
+
+	// Each block is preceded by its sector bitmap, so blocks are never
+	// contiguous within the file
+	*offset = SECTOR_TO_BYTE(block) + vd->vhd->in.bitmap;
+	*count = 1;
+	return VDISK_EXTENT_DATA;
+}
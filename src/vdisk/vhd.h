@@ -1,5 +1,16 @@
 /**
  * VHD: (Connectix) Virtual Hard Disk
+ * 
+ * Big-endian. In dynamic and differencing disks, each allocated block is
+ * preceded by its sector bitmap, one bit per sector (most significant bit
+ * first), padded to a sector. Sectors with a clear bit are not present in
+ * the block and read as zeros, or from the parent for differencing disks.
+ * 
+ * Parents of differencing disks are found with the Windows parent locators
+ * (relative, then absolute path), then the parent name, relative to the
+ * child. The chain is opened with the child. Each layer remembers, per
+ * block, the nearest ancestor allocating that block, so reads go straight
+ * to it after the first lookup.
  */
 
 #include <stdint.h>
@@ -20,8 +31,19 @@ enum {
 	VHD_DISK_RES3	= 6
 };
 
+#define VHD_PLAT_W2RU	0x57327275	// "W2ru" Windows relative path, UTF-16LE
+#define VHD_PLAT_W2KU	0x57326B75	// "W2ku" Windows absolute path, UTF-16LE
+
+enum {
+	VHD_CHAIN_MAX	= 64,	// Maximum number of parents
+	VHD_LOCATOR_MAX	= 4096,	// Maximum parent locator size in bytes
+	VHD_PATH_MAX	= 4096,	// Maximum parent path length in characters
+	VHD_LAYER_NONE	= 0xFF,	// No ancestor allocates the block
+};
+
+static const uint32_t VHD_BLOCK_UNALLOC = 0xFFFFFFFF;	// Block not allocated on disk
+
 enum {
-	VHD_BLOCK_UNALLOC	= -1,	// Block not allocated on disk
 	VHD_FEAT_TEMP	= 1,
 	VHD_FEAT_RES	= 2	// reserved, but always set
 };
@@ -74,10 +96,20 @@ typedef struct { // v1
 	uint8_t  res1[256];
 } VHD_DYN_HDR;
 
+struct VDISK;
+
 typedef struct {
-	uint32_t *offsets;
+	uint32_t *offsets;	// BAT, entries are kept big-endian (see VHD_BAT)
+	void *map;	// BAT mapping (VDISK_OPEN_MMAP), otherwise NULL
+	size_t maplen;	// BAT mapping length
+	uint8_t **bitmaps;	// Sector bitmap of each block, loaded on first access
+	uint32_t bitmap;	// Sector bitmap size in bytes, padded to a sector
 	uint32_t mask;
 	uint32_t shift;
+	struct VDISK *parent;	// Parent (differencing), otherwise NULL
+	struct VDISK **chain;	// Ancestors, parent first
+	uint8_t *resolved;	// Per block: 1-based chain index, 0 if unresolved
+	uint32_t depth;	// Number of ancestors
 } VHD_INTERNALS;
 
 typedef struct {
@@ -88,10 +120,22 @@ typedef struct {
 
 static const uint32_t VHD_META_ALLOC = sizeof(VHD_META);
 
-struct VDISK;
-
 int vdisk_vhd_open(struct VDISK *vd, uint32_t flags, uint32_t internal);
 
+void vdisk_vhd_close(struct VDISK *vd);
+
 int vdisk_vhd_dyn_read_lba(struct VDISK *vd, void *buffer, uint64_t index);
 
 int vdisk_vhd_fixed_read_lba(struct VDISK *vd, void *buffer, uint64_t index);
+
+int vdisk_vhd_dyn_read_lbas(struct VDISK *vd, void *buffer, uint64_t index, uint32_t count);
+
+int vdisk_vhd_fixed_read_lbas(struct VDISK *vd, void *buffer, uint64_t index, uint32_t count);
+
+int vdisk_vhd_dyn_locate_block(struct VDISK *vd, uint64_t index, uint64_t *offset);
+
+int vdisk_vhd_fixed_locate_block(struct VDISK *vd, uint64_t index, uint64_t *offset);
+
+int vdisk_vhd_dyn_map_block(struct VDISK *vd, uint64_t index, uint64_t *offset, uint64_t *count);
+
+int vdisk_vhd_fixed_map_block(struct VDISK *vd, uint64_t index, uint64_t *offset, uint64_t *count);
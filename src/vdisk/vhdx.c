@@ -1,61 +1,901 @@
+#include <string.h> // memcpy, memset
 #include "vdisk.h"
 #include "utils.h"
 #include "platform.h"
-#include <assert.h>
+#ifdef TRACE
+#include <stdio.h>
+#include <inttypes.h>
+#endif
 
-int vdisk_vhdx_open(VDISK *vd, uint32_t flags, uint32_t internal) {
-	assert(0); //TODO: Continue VHDX
+// Get the BAT index of a payload block
+#define VHDX_PAYLOAD_INDEX(in, block) ((block) + ((block) / (in)->chunkratio))
+// Get the file offset from a BAT entry
+#define VHDX_BAT_OFFSET(e) (((e) >> VHDX_BAT_OFFSET_SHIFT) << VHDX_BAT_OFFSET_SHIFT)
+
+// Verify a header or region table checksum, the checksum field is at 4
+static int vdisk_vhdx_checksum(uint8_t *buffer, size_t size) {
+	uint32_t sum;
+	memcpy(&sum, buffer + 4, 4);
+	memset(buffer + 4, 0, 4);
+	uint32_t crc = crc32c(0, buffer, size);
+	memcpy(buffer + 4, &sum, 4);
+	return crc == sum;
+}
+
+static const uint64_t hlocs[2] = { VHDX_HEADER1_LOC, VHDX_HEADER2_LOC };
+
+//
+// Log overlay
+//
+
+// Apply the replayed log ranges over a buffer read from the file
+static void vdisk_vhdx_log_patch(VHDX_INTERNALS *in, void *buffer, size_t size, uint64_t offset) {
+	VHDX_LOG_RANGE *ranges = in->log.ranges;
+	uint64_t end = offset + size;
+
+	// First range ending after offset
+	uint32_t lo = 0, hi = in->log.count;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) >> 1;
+		if (ranges[mid].offset + ranges[mid].length <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < in->log.count && ranges[lo].offset < end; ++lo) {
+		VHDX_LOG_RANGE *r = ranges + lo;
+		uint64_t start = r->offset > offset ? r->offset : offset;
+		uint64_t stop = r->offset + r->length < end ? r->offset + r->length : end;
+		uint8_t *dst = (uint8_t*)buffer + (start - offset);
+		if (r->index == UINT32_MAX)
+			memset(dst, 0, stop - start);
+		else
+			memcpy(dst, in->log.data + ((size_t)r->index * VDHX_LOG_ALIGN) +
+				(start - r->offset), stop - start);
+	}
+}
+
+static void vdisk_vhdx_log_free(VHDX_INTERNALS *in) {
+	free(in->log.ranges);
+	free(in->log.data);
+	in->log.ranges = NULL;
+	in->log.data = NULL;
+	in->log.count = in->log.datacount = 0;
+}
+
+// Read from the file, through the log overlay if any
+static int vdisk_vhdx_pread(VDISK *vd, void *buffer, size_t size, uint64_t offset) {
+	if (os_pread(vd->fd, buffer, size, offset))
+		return -1;
+	if (vd->vhdx->in.log.count)
+		vdisk_vhdx_log_patch(&vd->vhdx->in, buffer, size, offset);
+	return 0;
+}
+
+//
+// Log replay
+//
+
+// Copy a log entry out of the circular log and validate it, along with its
+// descriptors and data sectors. Returns the entry length, or 0 if invalid.
+static uint32_t vdisk_vhdx_log_entry(uint8_t *log, uint32_t logsize, uint32_t pos, UID *guid, uint8_t *entry) {
+	VHDX_LOG_HDR *hdr = (VHDX_LOG_HDR*)(log + pos);
+	uint32_t len = hdr->count;
+	if (hdr->magic != VHDX_LOG_HDR_MAGIC || len == 0 || len > logsize ||
+		len % VDHX_LOG_ALIGN || hdr->tail % VDHX_LOG_ALIGN || hdr->tail >= logsize ||
+		uid_cmp(&hdr->guid, guid) == 0)
+		return 0;
+	uint32_t descsize = (uint32_t)((sizeof(VHDX_LOG_HDR) + ((uint64_t)hdr->desccount *
+		sizeof(VDHX_LOG_DESC)) + VDHX_LOG_ALIGN - 1) & ~(uint64_t)(VDHX_LOG_ALIGN - 1));
+	if (descsize > len)
+		return 0;
+
+	// Entries may wrap around the end of the log
+	uint32_t first = logsize - pos;
+	if (first >= len)
+		memcpy(entry, log + pos, len);
+	else {
+		memcpy(entry, log + pos, first);
+		memcpy(entry + first, log, len - first);
+	}
+	if (vdisk_vhdx_checksum(entry, len) == 0)
+		return 0;
+
+	hdr = (VHDX_LOG_HDR*)entry;
+	uint64_t seq = hdr->sequence;
+	VDHX_LOG_DESC *desc = (VDHX_LOG_DESC*)(entry + sizeof(VHDX_LOG_HDR));
+	uint32_t data = descsize;
+	for (uint32_t i = 0; i < hdr->desccount; ++i, ++desc) {
+		if (desc->sequence != seq || desc->offset % VDHX_LOG_ALIGN)
+			return 0;
+		switch (desc->magic) {
+		case VHDX_LOG_ZERO_MAGIC: {
+			uint64_t length = ((VHDX_LOG_ZERO*)desc)->length;
+			if (length % VDHX_LOG_ALIGN || length > UINT64_MAX - desc->offset)
+				return 0;
+			continue;
+		}
+		case VHDX_LOG_DESC_MAGIC: {
+			if (data + sizeof(VHDX_LOG_DATA) > len)
+				return 0;
+			VHDX_LOG_DATA *sector = (VHDX_LOG_DATA*)(entry + data);
+			if (sector->magic != VHDX_LOG_DATA_MAGIC ||
+				sector->sequenceh != (uint32_t)(seq >> 32) ||
+				sector->sequencel != (uint32_t)seq)
+				return 0;
+			data += sizeof(VHDX_LOG_DATA);
+			continue;
+		}
+		default: return 0;
+		}
+	}
+	return data == len ? len : 0;
+}
+
+// Add a replayed range in replay order, data is NULL for a zero range,
+// otherwise the range is a single page
+static int vdisk_vhdx_log_add(VHDX_INTERNALS *in, uint64_t offset, uint64_t length,
+	const void *lead, const void *data, const void *trail) {
+	if ((in->log.count & 1023) == 0) {
+		void *p = realloc(in->log.ranges, ((size_t)in->log.count + 1024) * sizeof(VHDX_LOG_RANGE));
+		if (p == NULL)
+			return 1;
+		in->log.ranges = p;
+	}
+
+	VHDX_LOG_RANGE *range = in->log.ranges + in->log.count++;
+	range->offset = offset;
+	range->length = length;
+	range->index = UINT32_MAX;
+	if (data == NULL)
+		return 0;
+
+	if ((in->log.datacount & 255) == 0) {
+		void *p = realloc(in->log.data, (size_t)(in->log.datacount + 256) * VDHX_LOG_ALIGN);
+		if (p == NULL)
+			return 1;
+		in->log.data = p;
+	}
+	uint8_t *buffer = in->log.data + ((size_t)in->log.datacount * VDHX_LOG_ALIGN);
+	memcpy(buffer, lead, 8);
+	memcpy(buffer + 8, (uint8_t*)data + 8, VDHX_LOG_ALIGN - 12);
+	memcpy(buffer + VDHX_LOG_ALIGN - 4, trail, 4);
+	range->index = in->log.datacount++;
+	return 0;
+}
+
+static int vdisk_vhdx_log_cmp(const void *a, const void *b) {
+	const uint64_t *o1 = a, *o2 = b;
+	return *o1 < *o2 ? -1 : *o1 > *o2;
+}
+
+// Find the first unclaimed segment from i, compressing the path
+static uint32_t vdisk_vhdx_log_next(uint32_t *next, uint32_t i) {
+	uint32_t root = i;
+	while (next[root] != root)
+		root = next[root];
+	while (next[i] != root) {
+		uint32_t j = next[i];
+		next[i] = root;
+		i = j;
+	}
+	return root;
+}
+
+// Index of the first boundary not below offset
+static uint32_t vdisk_vhdx_log_bound(const uint64_t *bounds, uint32_t count, uint64_t offset) {
+	uint32_t lo = 0, hi = count;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) >> 1;
+		if (bounds[mid] < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Turn the ranges, in replay order, into disjoint ranges sorted by file
+// offset where the last replayed range wins. The file is cut into segments
+// at every range boundary, and segments are claimed by ranges from the last
+// one replayed to the first. Range boundaries are page-aligned, so a data
+// page is always a single segment.
+static int vdisk_vhdx_log_resolve(VHDX_INTERNALS *in) {
+	uint32_t count = in->log.count;
+	if (count == 0)
+		return 0;
+
+	size_t nb = (size_t)count * 2;
+	uint64_t *bounds = malloc(nb * sizeof(uint64_t));
+	uint32_t *owner = malloc(nb * sizeof(uint32_t));
+	uint32_t *next = malloc((nb + 1) * sizeof(uint32_t));
+	VHDX_LOG_RANGE *ranges = malloc(nb * sizeof(VHDX_LOG_RANGE));
+	int e = 1;
+	if (bounds == NULL || owner == NULL || next == NULL || ranges == NULL)
+		goto L_FREE;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		bounds[i * 2] = in->log.ranges[i].offset;
+		bounds[i * 2 + 1] = in->log.ranges[i].offset + in->log.ranges[i].length;
+	}
+	qsort(bounds, nb, sizeof(uint64_t), vdisk_vhdx_log_cmp);
+	uint32_t m = 1;	// Unique boundaries, m - 1 segments
+	for (size_t i = 1; i < nb; ++i)
+		if (bounds[i] != bounds[m - 1])
+			bounds[m++] = bounds[i];
+	for (uint32_t i = 0; i < m; ++i)
+		owner[i] = UINT32_MAX;
+	for (uint32_t i = 0; i <= m; ++i)
+		next[i] = i;
+
+	for (uint32_t k = count; k-- > 0;) {
+		VHDX_LOG_RANGE *r = in->log.ranges + k;
+		uint32_t t = vdisk_vhdx_log_bound(bounds, m, r->offset + r->length);
+		uint32_t i = vdisk_vhdx_log_next(next, vdisk_vhdx_log_bound(bounds, m, r->offset));
+		for (; i < t; i = vdisk_vhdx_log_next(next, i + 1)) {
+			owner[i] = k;
+			next[i] = i + 1;
+		}
+	}
+
+	// Adjacent zero segments are merged
+	uint32_t n = 0;
+	for (uint32_t i = 0; i + 1 < m; ++i) {
+		if (owner[i] == UINT32_MAX)
+			continue;
+		uint32_t index = in->log.ranges[owner[i]].index;
+		if (index == UINT32_MAX && n && ranges[n - 1].index == UINT32_MAX &&
+			ranges[n - 1].offset + ranges[n - 1].length == bounds[i]) {
+			ranges[n - 1].length += bounds[i + 1] - bounds[i];
+			continue;
+		}
+		ranges[n].offset = bounds[i];
+		ranges[n].length = bounds[i + 1] - bounds[i];
+		ranges[n].index = index;
+		++n;
+	}
+
+	free(in->log.ranges);
+	in->log.ranges = ranges;
+	in->log.count = n;
+	ranges = NULL;
+	e = 0;
+
+L_FREE:
+	free(bounds);
+	free(owner);
+	free(next);
+	free(ranges);
+	return e;
+}
+
+// Write the replayed ranges to the file in batches of contiguous ranges,
+// zero ranges may span several batches
+static int vdisk_vhdx_log_write(VDISK *vd) {
+	VHDX_INTERNALS *in = &vd->vhdx->in;
+	uint8_t *batch = malloc(VHDX_LOG_BATCH);
+	if (batch == NULL)
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+
+	uint64_t done = 0;	// Written part of the current range
+	for (uint32_t i = 0; i < in->log.count;) {
+		uint64_t offset = in->log.ranges[i].offset + done;
+		size_t size = 0;
+		while (i < in->log.count && size < VHDX_LOG_BATCH &&
+			in->log.ranges[i].offset + done == offset + size) {
+			VHDX_LOG_RANGE *r = in->log.ranges + i;
+			size_t n = VHDX_LOG_BATCH - size;
+			if (r->length - done < n)
+				n = (size_t)(r->length - done);
+			if (r->index == UINT32_MAX)
+				memset(batch + size, 0, n);
+			else
+				memcpy(batch + size, in->log.data +
+					((size_t)r->index * VDHX_LOG_ALIGN) + done, n);
+			size += n;
+			if ((done += n) == r->length) {
+				done = 0;
+				++i;
+			}
+		}
+		if (os_pwrite(vd->fd, batch, size, offset)) {
+			free(batch);
+			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+		}
+	}
+
+	free(batch);
+	return 0;
+}
+
+// Write the inactive header with a nil log GUID, making it current
+static int vdisk_vhdx_log_clear(VDISK *vd) {
+	VHDX_INTERNALS *in = &vd->vhdx->in;
+	VHDX_HEADER1 *headers[2] = { &vd->vhdx->v1, &vd->vhdx->v1_2 };
+	uint32_t next = in->header ^ 1;
+	VHDX_HEADER1 *header = headers[next];
+
+	*header = *headers[in->header];
+	++header->seqnumber;
+	header->crc32 = 0;
+	memset(&header->log, 0, sizeof(UID));
+
+	uint8_t *buffer = calloc(1, VHDX_HEADER_SIZE);
+	if (buffer == NULL)
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+	memcpy(buffer, header, sizeof(VHDX_HEADER1));
+	header->crc32 = crc32c(0, buffer, VHDX_HEADER_SIZE);
+	memcpy(buffer, header, sizeof(VHDX_HEADER1));
+
+	int e = os_pwrite(vd->fd, buffer, VHDX_HEADER_SIZE, hlocs[next]) ||
+		os_fsync(vd->fd);
+	free(buffer);
+	if (e)
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+
+	in->header = next;
+	return 0;
+}
+
+//
+// vdisk_vhdx_log_replay
+//
+
+// Replay the log in memory, then into the file with VDISK_OPEN_LOG_REPLAY.
+// Otherwise, the replayed ranges are kept as an overlay for all reads.
+static int vdisk_vhdx_log_replay(VDISK *vd, VHDX_HEADER1 *header, uint32_t flags) {
+	VHDX_INTERNALS *in = &vd->vhdx->in;
+	uint32_t logsize = header->logsize;
+	uint64_t fsize;
+
+	if (logsize == 0 || logsize > VHDX_LOG_MAX || logsize % VHDX_BLOCK_MIN ||
+		header->logoffset % VHDX_BLOCK_MIN)
+		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+	if (os_fsize(vd->fd, &fsize))
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+
+	uint8_t *log = malloc(logsize);
+	uint8_t *entry = malloc(logsize);
+	if (log == NULL || entry == NULL) {
+		free(log);
+		free(entry);
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+	}
+	if (os_pread(vd->fd, log, logsize, header->logoffset)) {
+		free(log);
+		free(entry);
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	}
+
+	//
+	// Find the active sequence
+	//
+	// A sequence is a run of valid entries with incrementing sequence
+	// numbers. It is complete if the tail of its head entry is part of
+	// it. Starting within a sequence only gives a shorter one with the
+	// same head, so these positions are skipped.
+	//
+
+	int found = 0;
+	uint64_t headseq = 0;
+	uint32_t tail = 0;
+	for (uint32_t start = 0; start < logsize; start += VDHX_LOG_ALIGN) {
+		uint32_t len = vdisk_vhdx_log_entry(log, logsize, start, &header->log, entry);
+		if (len == 0)
+			continue;
+
+		VHDX_LOG_HDR *hdr = (VHDX_LOG_HDR*)entry;
+		uint64_t seq = hdr->sequence;
+		uint32_t headtail = hdr->tail;
+		uint32_t total = len;
+		while (total < logsize) {
+			uint32_t next = (start + total) % logsize;
+			uint32_t nlen = vdisk_vhdx_log_entry(log, logsize, next, &header->log, entry);
+			if (nlen == 0 || hdr->sequence != seq + 1 || total + nlen > logsize)
+				break;
+			++seq;
+			headtail = hdr->tail;
+			total += nlen;
+		}
+
+		if (((headtail - start + logsize) % logsize) < total &&
+			(found == 0 || seq > headseq)) {
+			found = 1;
+			headseq = seq;
+			tail = headtail;
+		}
+
+		if (start + total > logsize) // Wrapped, rest is covered
+			break;
+		start += total - VDHX_LOG_ALIGN;
+	}
+
+	if (found == 0) { // Nothing to replay
+		free(log);
+		free(entry);
+		return 0;
+	}
+
+	//
+	// Replay, tail to head
+	//
+
+	uint64_t flushed = 0, last = 0;
+	for (uint32_t pos = tail;;) {
+		uint32_t len = vdisk_vhdx_log_entry(log, logsize, pos, &header->log, entry);
+		if (len == 0) // Tail is not an entry of the sequence
+			goto L_CORRUPT;
+
+		VHDX_LOG_HDR *hdr = (VHDX_LOG_HDR*)entry;
+		VDHX_LOG_DESC *desc = (VDHX_LOG_DESC*)(entry + sizeof(VHDX_LOG_HDR));
+		uint8_t *data = entry + ((sizeof(VHDX_LOG_HDR) + (hdr->desccount *
+			sizeof(VDHX_LOG_DESC)) + VDHX_LOG_ALIGN - 1) & ~(VDHX_LOG_ALIGN - 1));
+		for (uint32_t i = 0; i < hdr->desccount; ++i, ++desc) {
+			if (desc->magic == VHDX_LOG_ZERO_MAGIC) {
+				VHDX_LOG_ZERO *zero = (VHDX_LOG_ZERO*)desc;
+				if (zero->length &&
+					vdisk_vhdx_log_add(in, zero->offset, zero->length, NULL, NULL, NULL))
+					goto L_NOMEM;
+			} else {
+				if (vdisk_vhdx_log_add(in, desc->offset, VDHX_LOG_ALIGN,
+					&desc->leading, data, &desc->trail))
+					goto L_NOMEM;
+				data += sizeof(VHDX_LOG_DATA);
+			}
+		}
+
+		flushed = hdr->flushedoffset;
+		last = hdr->lastoffset;
+		if (hdr->sequence == headseq)
+			break;
+		pos = (pos + len) % logsize;
+	}
+
+	free(log);
+	free(entry);
+
+	// The file was truncated after the log was written
+	if (fsize < flushed)
+		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+
+	// Keep the last write of every byte
+	if (vdisk_vhdx_log_resolve(in))
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+
+	if ((flags & VDISK_OPEN_LOG_REPLAY) == 0)
+		return 0;
+
+	//
+	// Write replay
+	//
+	// Pages are written in file order, the file is extended to the last
+	// known size, and flushed once before the log is cleared.
+	//
+
+	if (vdisk_vhdx_log_write(vd))
+		return vd->err.num;
+	if (fsize < last && os_ftruncate(vd->fd, last))
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	if (os_fsync(vd->fd))
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	if (vdisk_vhdx_log_clear(vd))
+		return vd->err.num;
 
+	vdisk_vhdx_log_free(in);
+	return 0;
+
+L_CORRUPT:
+	free(log);
+	free(entry);
+	return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+L_NOMEM:
+	free(log);
+	free(entry);
+	return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+}
+
+int vdisk_vhdx_open(VDISK *vd, uint32_t flags, uint32_t internal) {
 	if ((vd->meta = malloc(VHDX_META_ALLOC)) == NULL)
 		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
 
-	//TODO: Check both headers and regions before doing an error
+	VHDX_INTERNALS *in = &vd->vhdx->in;
+	memset(in, 0, sizeof(VHDX_INTERNALS));
 
 	//
-	// Headers
+	// File identifier
 	//
 
-	if (os_fread(vd->fd, &vd->vhdx->hdr, sizeof(VHDX_HDR)))
+	if (os_pread(vd->fd, &vd->vhdx->hdr, sizeof(VHDX_HDR), 0))
 		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
 	if (vd->vhdx->hdr.magic != VHDX_MAGIC)
 		return vdisk_i_err(vd, VVD_EVDMAGIC, __LINE__, __func__);
 
-	if (os_fseek(vd->fd, VHDX_HEADER1_LOC, SEEK_SET))
-		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-	if (os_fread(vd->fd, &vd->vhdx->v1, sizeof(VHDX_HEADER1)))
-		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	uint8_t *buffer = malloc(VHDX_REGION_SIZE);
+	if (buffer == NULL)
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
 
-	if (os_fseek(vd->fd, VHDX_HEADER2_LOC, SEEK_SET))
-		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-	if (os_fread(vd->fd, &vd->vhdx->v1_2, sizeof(VHDX_HEADER1)))
-		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	//
+	// Headers
+	//
+	// Both headers are read, the valid one with the highest sequence
+	// number is the current one.
+	//
 
-	if (vd->vhdx->v1.magic != VHDX_HDR1_MAGIC || vd->vhdx->v1_2.magic != VHDX_HDR1_MAGIC)
+	int valid[2];
+	VHDX_HEADER1 *headers[2] = { &vd->vhdx->v1, &vd->vhdx->v1_2 };
+	for (int i = 0; i < 2; ++i) {
+		if (os_pread(vd->fd, buffer, VHDX_HEADER_SIZE, hlocs[i])) {
+			free(buffer);
+			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+		}
+		memcpy(headers[i], buffer, sizeof(VHDX_HEADER1));
+		valid[i] = headers[i]->magic == VHDX_HDR1_MAGIC &&
+			vdisk_vhdx_checksum(buffer, VHDX_HEADER_SIZE);
+	}
+	if (valid[0] == 0 && valid[1] == 0) {
+		free(buffer);
 		return vdisk_i_err(vd, VVD_EVDMAGIC, __LINE__, __func__);
-	if (vd->vhdx->v1.version != 1 || vd->vhdx->v1_2.version != 1)
+	}
+	in->header = valid[0] && valid[1] ?
+		headers[1]->seqnumber > headers[0]->seqnumber :
+		valid[1];
+	VHDX_HEADER1 *header = headers[in->header];
+	if (header->version != 1) {
+		free(buffer);
 		return vdisk_i_err(vd, VVD_EVDVERSION, __LINE__, __func__);
+	}
+
+	//
+	// Log
+	//
+
+	if (uid_nil(&header->log) == 0) {
+		free(buffer);
+		if (vdisk_vhdx_log_replay(vd, header, flags))
+			return vd->err.num;
+		if ((buffer = malloc(VHDX_REGION_SIZE)) == NULL)
+			return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+	}
 
 	//
 	// Regions
 	//
+	// The first valid region table is used.
+	//
 
-	if (os_fseek(vd->fd, VHDX_REGION1_LOC, SEEK_SET))
-		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-	if (os_fread(vd->fd, &vd->vhdx->reg, sizeof(VHDX_REGION_HDR)))
-		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-	if (vd->vhdx->reg.magic != VHDX_REGION_MAGIC)
+	VHDX_REGION_HDR *regions[2] = { &vd->vhdx->reg, &vd->vhdx->reg2 };
+	static const uint64_t rlocs[2] = { VHDX_REGION1_LOC, VHDX_REGION2_LOC };
+	int r = 0;
+	for (; r < 2; ++r) {
+		if (vdisk_vhdx_pread(vd, buffer, VHDX_REGION_SIZE, rlocs[r])) {
+			free(buffer);
+			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+		}
+		memcpy(regions[r], buffer, sizeof(VHDX_REGION_HDR));
+		if (regions[r]->magic == VHDX_REGION_MAGIC &&
+			regions[r]->count <= VHDX_REGION_MAX &&
+			vdisk_vhdx_checksum(buffer, VHDX_REGION_SIZE))
+			break;
+	}
+	if (r == 2) {
+		free(buffer);
 		return vdisk_i_err(vd, VVD_EVDMAGIC, __LINE__, __func__);
+	}
+
+	memset(&vd->vhdx->batreg, 0, sizeof(VHDX_REGION_ENTRY));
+	memset(&vd->vhdx->metareg, 0, sizeof(VHDX_REGION_ENTRY));
+	VHDX_REGION_ENTRY *entries = (VHDX_REGION_ENTRY*)(buffer + sizeof(VHDX_REGION_HDR));
+	for (uint32_t i = 0; i < regions[r]->count; ++i) {
+		VHDX_REGION_ENTRY *e = entries + i;
+		if (uid_cmp(&e->guid, (UID*)&VHDX_GUID_BAT))
+			vd->vhdx->batreg = *e;
+		else if (uid_cmp(&e->guid, (UID*)&VHDX_GUID_METADATA))
+			vd->vhdx->metareg = *e;
+		else if (e->required & 1) { // Unknown required region
+			free(buffer);
+			return vdisk_i_err(vd, VVD_EVDVERSION, __LINE__, __func__);
+		}
+	}
+	free(buffer);
+
+	if (vd->vhdx->batreg.offset == 0 || vd->vhdx->metareg.offset == 0 ||
+		vd->vhdx->metareg.length < sizeof(VHDX_METADATA_HDR))
+		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
 
 	//
-	//TODO: Log
+	// Metadata
 	//
 
+	uint32_t metalen = vd->vhdx->metareg.length;
+	uint8_t *meta = malloc(metalen);
+	if (meta == NULL)
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+	if (vdisk_vhdx_pread(vd, meta, metalen, vd->vhdx->metareg.offset)) {
+		free(meta);
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	}
+	memcpy(&vd->vhdx->meta, meta, sizeof(VHDX_METADATA_HDR));
+	if (vd->vhdx->meta.magic != VHDX_METADATA_MAGIC ||
+		vd->vhdx->meta.count > VHDX_METADATA_MAX ||
+		sizeof(VHDX_METADATA_HDR) + (vd->vhdx->meta.count * sizeof(VHDX_METADATA_ENTRY)) > metalen) {
+		free(meta);
+		return vdisk_i_err(vd, VVD_EVDMAGIC, __LINE__, __func__);
+	}
+
+	uint64_t capacity = 0;
+	VHDX_METADATA_ENTRY *items = (VHDX_METADATA_ENTRY*)(meta + sizeof(VHDX_METADATA_HDR));
+	for (uint32_t i = 0; i < vd->vhdx->meta.count; ++i) {
+		VHDX_METADATA_ENTRY *e = items + i;
+		void *data = meta + e->offset;
+		if ((uint64_t)e->offset + e->length > metalen) {
+			free(meta);
+			return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+		}
+		if (uid_cmp(&e->type, (UID*)&VHDX_GUID_FILE_PARAMETERS) && e->length >= 8) {
+			memcpy(&in->blocksize, data, 4);
+			memcpy(&in->fileflags, (uint8_t*)data + 4, 4);
+		} else if (uid_cmp(&e->type, (UID*)&VHDX_GUID_DISK_SIZE) && e->length >= 8) {
+			memcpy(&capacity, data, 8);
+		} else if (uid_cmp(&e->type, (UID*)&VHDX_GUID_LOGICAL_SECTOR) && e->length >= 4) {
+			memcpy(&in->sectorsize, data, 4);
+		} else if (uid_cmp(&e->type, (UID*)&VHDX_GUID_PHYSICAL_SECTOR) && e->length >= 4) {
+			memcpy(&in->physsize, data, 4);
+		}
+	}
+	free(meta);
+
+	// Differencing disks read through their parent
+	if (in->fileflags & VHDX_FILE_HAS_PARENT) //TODO: Parent chains
+		return vdisk_i_err(vd, VVD_EVDTODO, __LINE__, __func__);
+
+	if (in->blocksize < VHDX_BLOCK_MIN || in->blocksize > VHDX_BLOCK_MAX ||
+		pow2(in->blocksize) == 0)
+		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+	if (in->sectorsize != 512 && in->sectorsize != 4096)
+		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+	if (capacity == 0 || capacity % in->sectorsize)
+		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+
 	//
 	// BAT
 	//
-	
-	// Chunk ratio
-	//(8388608 * ) / // 8 KiB * 512
-	
+	// Chunk ratio: Number of payload blocks covered by one sector bitmap
+	// block, (2^23 * logical sector size) / block size.
+	//
+
+	in->chunkratio = (uint32_t)(((uint64_t)1 << 23) * in->sectorsize / in->blocksize);
+	in->shift = fpow2(in->blocksize);
+	in->mask = in->blocksize - 1;
+	in->blocks = (capacity + in->blocksize - 1) >> in->shift;
+	in->batcount = in->blocks + ((in->blocks - 1) / in->chunkratio);
+
+	size_t batsize = (size_t)in->batcount << 3;
+	if (batsize > vd->vhdx->batreg.length)
+		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+	if (flags & VDISK_OPEN_MMAP) {
+		in->bat = os_mmap(vd->fd, vd->vhdx->batreg.offset, batsize,
+			&in->map, &in->maplen);
+		if (in->bat == NULL)
+			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+		// Mapping is private, the overlay does not reach the file
+		if (in->log.count)
+			vdisk_vhdx_log_patch(in, in->bat, batsize, vd->vhdx->batreg.offset);
+	} else {
+		if ((in->bat = malloc(batsize)) == NULL)
+			return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+		if (vdisk_vhdx_pread(vd, in->bat, batsize, vd->vhdx->batreg.offset))
+			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	}
+
+	vd->capacity = capacity;
+	vd->blksize = in->blocksize;
+	vd->blkcount = in->blocks;
+
+	vd->cb.lba_read = vdisk_vhdx_read_sector;
+	vd->cb.lba_readn = vdisk_vhdx_read_sectors;
+	// Data read at located positions would miss the log overlay
+	if (in->log.count)
+		vd->cb.blk_read = vdisk_vhdx_read_block;
+	else
+		vd->cb.blk_locate = vdisk_vhdx_locate_block;
+	vd->cb.blk_map = vdisk_vhdx_map_block;
+
+	return 0;
+}
+
+//
+// vdisk_vhdx_close
+//
+
+void vdisk_vhdx_close(VDISK *vd) {
+	VHDX_INTERNALS *in = &vd->vhdx->in;
+	if (in->map)
+		os_munmap(in->map, in->maplen);
+	else
+		free(in->bat);
+	vdisk_vhdx_log_free(in);
+	in->bat = NULL;
+	in->map = NULL;
+}
+
+//
+// vdisk_vhdx_read_sector
+//
+
+int vdisk_vhdx_read_sector(VDISK *vd, void *buffer, uint64_t index) {
+	VHDX_INTERNALS *in = &vd->vhdx->in;
+	uint64_t offset = SECTOR_TO_BYTE(index);
+	if (offset >= vd->capacity)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint64_t block = offset >> in->shift;
+	uint64_t e = in->bat[VHDX_PAYLOAD_INDEX(in, block)];
+	switch (e & VHDX_BAT_STATE_MASK) {
+	case VHDX_PAYLOAD_FULLY_PRESENT:
+		if (vdisk_vhdx_pread(vd, buffer, 512, VHDX_BAT_OFFSET(e) + (offset & in->mask)))
+			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+		return 0;
+	case VHDX_PAYLOAD_PARTIALLY_PRESENT: // Differencing disks only
+		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+	default:
+		memset(buffer, 0, 512);
+		return 0;
+	}
+}
+
+//
+// vdisk_vhdx_read_sectors
+//
+
+int vdisk_vhdx_read_sectors(VDISK *vd, void *buffer, uint64_t index, uint32_t count) {
+	VHDX_INTERNALS *in = &vd->vhdx->in;
+	uint8_t *buf = buffer;
+	uint64_t offset = SECTOR_TO_BYTE(index);
+	uint64_t end = offset + SECTOR_TO_BYTE(count);
+
+	if (end > vd->capacity)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint64_t bsize = in->blocksize;
+
+	while (offset < end) {
+		uint64_t block = offset >> in->shift;
+		uint64_t len = bsize - (offset & in->mask);
+		if (len > end - offset)
+			len = end - offset;
+
+		uint64_t e = in->bat[VHDX_PAYLOAD_INDEX(in, block)];
+		uint64_t pos = VHDX_BAT_OFFSET(e);
+		switch (e & VHDX_BAT_STATE_MASK) {
+		case VHDX_PAYLOAD_FULLY_PRESENT: break;
+		case VHDX_PAYLOAD_PARTIALLY_PRESENT: // Differencing disks only
+			return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+		default:
+			memset(buf, 0, len);
+			buf += len;
+			offset += len;
+			continue;
+		}
+
+		// Extend the run while the next blocks follow within the file
+		uint64_t run = len;
+		for (uint64_t n = 1; offset + run < end; ++n) {
+			uint64_t next = in->bat[VHDX_PAYLOAD_INDEX(in, block + n)];
+			if ((next & VHDX_BAT_STATE_MASK) != VHDX_PAYLOAD_FULLY_PRESENT ||
+				VHDX_BAT_OFFSET(next) != pos + (n * bsize))
+				break;
+			uint64_t left = end - offset - run;
+			run += left < bsize ? left : bsize;
+		}
+
+		pos += offset & in->mask;
+
+#ifdef TRACE
+		printf("%s: offset=0x%" PRIX64 " -> pos=0x%" PRIX64 " len=%" PRIu64 "\n",
+			__func__, offset, pos, run);
+#endif
+
+		if (vdisk_vhdx_pread(vd, buf, run, pos))
+			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+
+		buf += run;
+		offset += run;
+	}
+
+	return 0;
+}
+
+//
+// vdisk_vhdx_locate_block
+//
+
+int vdisk_vhdx_locate_block(VDISK *vd, uint64_t index, uint64_t *offset) {
+	VHDX_INTERNALS *in = &vd->vhdx->in;
+	if (index >= in->blocks)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint64_t e = in->bat[VHDX_PAYLOAD_INDEX(in, index)];
+	switch (e & VHDX_BAT_STATE_MASK) {
+	case VHDX_PAYLOAD_FULLY_PRESENT:
+		*offset = VHDX_BAT_OFFSET(e);
+		return 0;
+	case VHDX_PAYLOAD_PARTIALLY_PRESENT: // Differencing disks only
+		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+	default:
+		return vdisk_i_err(vd, VVD_EVDUNALLOC, __LINE__, __func__);
+	}
+}
+
+//
+// vdisk_vhdx_read_block
+//
+
+int vdisk_vhdx_read_block(VDISK *vd, void *buffer, uint64_t index) {
+	VHDX_INTERNALS *in = &vd->vhdx->in;
+	if (index >= in->blocks)
+		return VVD_EVDBOUND;
+
+	uint64_t e = in->bat[VHDX_PAYLOAD_INDEX(in, index)];
+	switch (e & VHDX_BAT_STATE_MASK) {
+	case VHDX_PAYLOAD_FULLY_PRESENT: break;
+	case VHDX_PAYLOAD_PARTIALLY_PRESENT: // Differencing disks only
+		return VVD_EVDMISC;
+	default:
+		memset(buffer, 0, in->blocksize);
+		return 0;
+	}
+
+	uint64_t size = vd->capacity - (index << in->shift);
+	if (size > in->blocksize)
+		size = in->blocksize;
+	else
+		memset((uint8_t*)buffer + size, 0, in->blocksize - size);
+	if (vdisk_vhdx_pread(vd, buffer, (size_t)size, VHDX_BAT_OFFSET(e)))
+		return VVD_EOS;
 	return 0;
 }
+
+//
+// vdisk_vhdx_map_block
+//
+
+// Get the extent state of a payload BAT entry
+static int vdisk_vhdx_state(uint64_t e) {
+	switch (e & VHDX_BAT_STATE_MASK) {
+	case VHDX_PAYLOAD_FULLY_PRESENT:
+		return VDISK_EXTENT_DATA;
+	case VHDX_PAYLOAD_PARTIALLY_PRESENT: // Differencing disks only
+		return -1;
+	case VHDX_PAYLOAD_ZERO:
+	case VHDX_PAYLOAD_UNMAPPED:
+		return VDISK_EXTENT_ZERO;
+	default:
+		return VDISK_EXTENT_UNALLOC;
+	}
+}
+
+int vdisk_vhdx_map_block(VDISK *vd, uint64_t index, uint64_t *offset, uint64_t *count) {
+	VHDX_INTERNALS *in = &vd->vhdx->in;
+	if (index >= in->blocks)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint64_t e = in->bat[VHDX_PAYLOAD_INDEX(in, index)];
+	int state = vdisk_vhdx_state(e);
+	if (state < 0)
+		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+	uint64_t pos = VHDX_BAT_OFFSET(e);
+	uint64_t i = index + 1;
+	for (; i < in->blocks; ++i) {
+		uint64_t next = in->bat[VHDX_PAYLOAD_INDEX(in, i)];
+		if (vdisk_vhdx_state(next) != state)
+			break;
+		if (state == VDISK_EXTENT_DATA &&
+			VHDX_BAT_OFFSET(next) != pos + ((i - index) << in->shift))
+			break;
+	}
+
+	*offset = state == VDISK_EXTENT_DATA ? pos : 0;
+	*count = i - index;
+	return state;
+}
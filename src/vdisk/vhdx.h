@@ -3,6 +3,30 @@
  * 
  * Little Endian
  * 
+ * Layout:
+ * +-----------------+----------+----------+----------+----------+-----+
+ * | File identifier | Header 1 | Header 2 | Region 1 | Region 2 | ... |
+ * +-----------------+----------+----------+----------+----------+-----+
+ * 0                 64K        128K       192K       256K       1M
+ * 
+ * The region table locates the BAT and the metadata region. The BAT holds
+ * one entry per payload block, and after every "chunk ratio" payload
+ * entries, one entry for a sector bitmap block:
+ * 
+ * +----+----+-----+--------+----+----+-----+--------+-----+
+ * | P0 | P1 | ... | SB0    | Pn | ...      | SB1    | ... |
+ * +----+----+-----+--------+----+----+-----+--------+-----+
+ * 
+ * Sector bitmap blocks are only used by differencing disks, where they
+ * tell which sectors of a partially present block are in the file.
+ * Differencing disks are not supported yet.
+ * 
+ * The log is a circular buffer of entries, each holding descriptors of
+ * 4 KiB pages (data or zero) to write to the file. A header with a
+ * non-nil log GUID means the log must be replayed before the file is
+ * consistent. The active sequence is the valid run of entries with the
+ * highest sequence number, replayed from its tail entry to its head.
+ * 
  * Source: MS-VHDX v20160714
  */
 
@@ -24,8 +48,60 @@ enum {
 	VHDX_REGION1_LOC = VHDX_HEADER1_LOC * 3,	// 192 KiB
 	VHDX_REGION2_LOC = VHDX_HEADER1_LOC * 4,	// 256 KiB
 	VDHX_LOG_ALIGN = 4 * 1024,	// 4 KiB
+	VHDX_HEADER_SIZE = 4 * 1024,	// Header size for checksum
+	VHDX_REGION_SIZE = 64 * 1024,	// Region table size for checksum
+	VHDX_REGION_MAX = 2047,	// Maximum number of region entries
+	VHDX_METADATA_MAX = 2047,	// Maximum number of metadata entries
+	VHDX_BLOCK_MIN = 1024 * 1024,	// 1 MiB
+	VHDX_BLOCK_MAX = 256 * 1024 * 1024,	// 256 MiB
+	VHDX_LOG_MAX = 256 * 1024 * 1024,	// Largest log read in memory
+	VHDX_LOG_BATCH = 1024 * 1024,	// Replay write size
+};
+
+enum {	// BAT entry states
+	// Payload blocks
+	VHDX_PAYLOAD_NOT_PRESENT	= 0,
+	VHDX_PAYLOAD_UNDEFINED	= 1,
+	VHDX_PAYLOAD_ZERO	= 2,
+	VHDX_PAYLOAD_UNMAPPED	= 3,
+	VHDX_PAYLOAD_FULLY_PRESENT	= 6,
+	VHDX_PAYLOAD_PARTIALLY_PRESENT	= 7,
+	// Sector bitmap blocks
+	VHDX_SB_NOT_PRESENT	= 0,
+	VHDX_SB_PRESENT	= 6,
+
+	VHDX_BAT_STATE_MASK	= 7,
+	VHDX_BAT_OFFSET_SHIFT	= 20,	// File offset in MiB
 };
 
+enum {	// Metadata flags
+	// File parameters
+	VHDX_FILE_LEAVE_ALLOCATED	= 1,	// Fixed disk
+	VHDX_FILE_HAS_PARENT	= 2,	// Differencing disk
+	// Entries
+	VHDX_METADATA_REQUIRED	= 4,
+};
+
+// Region and metadata item GUIDs, as stored
+static const UID VHDX_GUID_BAT = { { {
+	0x66, 0x77, 0xC2, 0x2D, 0x23, 0xF6, 0x00, 0x42,
+	0x9D, 0x64, 0x11, 0x5E, 0x9B, 0xFD, 0x4A, 0x08 } } };
+static const UID VHDX_GUID_METADATA = { { {
+	0x06, 0xA2, 0x7C, 0x8B, 0x90, 0x47, 0x9A, 0x4B,
+	0xB8, 0xFE, 0x57, 0x5F, 0x05, 0x0F, 0x88, 0x6E } } };
+static const UID VHDX_GUID_FILE_PARAMETERS = { { {
+	0x37, 0x67, 0xA1, 0xCA, 0x36, 0xFA, 0x43, 0x4D,
+	0xB3, 0xB6, 0x33, 0xF0, 0xAA, 0x44, 0xE7, 0x6B } } };
+static const UID VHDX_GUID_DISK_SIZE = { { {
+	0x24, 0x42, 0xA5, 0x2F, 0x1B, 0xCD, 0x76, 0x48,
+	0xB2, 0x11, 0x5D, 0xBE, 0xD8, 0x3B, 0xF4, 0xB8 } } };
+static const UID VHDX_GUID_LOGICAL_SECTOR = { { {
+	0x1D, 0xBF, 0x41, 0x81, 0x6F, 0xA9, 0x09, 0x47,
+	0xBA, 0x47, 0xF2, 0x33, 0xA8, 0xFA, 0xAB, 0x5F } } };
+static const UID VHDX_GUID_PHYSICAL_SECTOR = { { {
+	0xC7, 0x48, 0xA3, 0xCD, 0x5D, 0x44, 0x71, 0x44,
+	0x9C, 0xC9, 0xE9, 0x88, 0x52, 0x51, 0xC5, 0x56 } } };
+
 typedef struct {
 	uint64_t magic;
 	union {
@@ -37,7 +113,7 @@ typedef struct {
 typedef struct {
 	uint32_t magic;
 	uint32_t crc32;
-	uint32_t seqnumber;
+	uint64_t seqnumber;
 	UID      filewrite;
 	UID      datawrite;
 	UID      log;
@@ -78,31 +154,35 @@ typedef struct {
 
 typedef struct {
 	uint32_t magic;
-	uint32_t trail;	// resolution
-	uint64_t leading;	// Multiple of 4 KiB, length
+	uint32_t res;
+	uint64_t length;	// Multiple of 4 KiB
+	uint64_t offset;	// Multiple of 4 KiB
+	uint64_t sequence;
+} VHDX_LOG_ZERO;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t trail;	// Last 4 bytes of the page
+	uint64_t leading;	// First 8 bytes of the page
 	uint64_t offset;	// Multiple of 4 KiB
 	uint64_t sequence;
 } VDHX_LOG_DESC;
 
+// A data sector holds a 4 KiB page, except for the first 8 and last 4
+// bytes which are in its descriptor
 typedef struct {
 	uint32_t magic;
-	union {
-		uint8_t cdata[4096];	// Cluster
-		struct {
-			uint32_t sequenceh;
-			union {
-				uint8_t data[4084]; // as per doc
-				struct {
-					uint64_t lead;
-					uint8_t rdata[4068];	// The real data
-					uint64_t trail;
-				};
-			};
-			uint32_t sequencel;
-		};
-	};
+	uint32_t sequenceh;	// High 32 bits of the entry sequence number
+	uint8_t  data[4084];
+	uint32_t sequencel;	// Low 32 bits of the entry sequence number
 } VHDX_LOG_DATA;
 
+typedef struct {
+	uint64_t offset;	// File offset
+	uint64_t length;	// Range length, VDHX_LOG_ALIGN if it has data
+	uint32_t index;	// Page data index, UINT32_MAX if zero
+} VHDX_LOG_RANGE;
+
 typedef struct {
 	uint64_t magic;
 	uint16_t res;
@@ -120,11 +200,30 @@ typedef struct {
 	UID      type;	// itemID GUID
 	uint32_t offset;
 	uint32_t length;
-	uint32_t flags;	// ...plus 2 bits? what the hell?
+	uint32_t flags;	// IsUser (bit 0), IsVirtualDisk (1), IsRequired (2)
+	uint32_t res;
 } VHDX_METADATA_ENTRY;
 
 typedef struct {
-	
+	uint64_t *bat;	// Block allocation table
+	void *map;	// BAT mapping (VDISK_OPEN_MMAP), otherwise NULL
+	size_t maplen;	// BAT mapping length
+	uint64_t batcount;	// Number of BAT entries
+	uint64_t blocks;	// Number of payload blocks
+	uint32_t blocksize;	// Payload block size
+	uint32_t sectorsize;	// Logical sector size
+	uint32_t physsize;	// Physical sector size
+	uint32_t chunkratio;	// Payload blocks per sector bitmap block
+	uint32_t shift;	// Payload block shift
+	uint32_t mask;	// Payload block offset mask
+	uint32_t fileflags;	// File parameters flags
+	uint32_t header;	// Current header (0 or 1)
+	struct {
+		VHDX_LOG_RANGE *ranges;	// Replayed ranges, disjoint and sorted by file offset
+		uint8_t *data;	// Page data
+		uint32_t count;	// Number of ranges
+		uint32_t datacount;	// Number of pages with data
+	} log;	// Log overlay, read-only replay
 } VHDX_INTERNALS;
 
 typedef struct {
@@ -133,6 +232,8 @@ typedef struct {
 	VHDX_HEADER1 v1_2;
 	VHDX_REGION_HDR reg;
 	VHDX_REGION_HDR reg2;
+	VHDX_REGION_ENTRY batreg;	// BAT region
+	VHDX_REGION_ENTRY metareg;	// Metadata region
 	VHDX_LOG_HDR log;
 	VHDX_METADATA_HDR meta;
 	VHDX_INTERNALS in;
@@ -143,3 +244,21 @@ static const uint32_t VHDX_META_ALLOC = sizeof(VHDX_META);
 struct VDISK;
 
 int vdisk_vhdx_open(struct VDISK *vd, uint32_t flags, uint32_t internal);
+
+int vdisk_vhdx_read_sector(struct VDISK *vd, void *buffer, uint64_t index);
+
+int vdisk_vhdx_read_sectors(struct VDISK *vd, void *buffer, uint64_t index, uint32_t count);
+
+int vdisk_vhdx_locate_block(struct VDISK *vd, uint64_t index, uint64_t *offset);
+
+/**
+ * Read a payload block through the log overlay, used instead of locating
+ * blocks while a log is pending. The BAT and overlay are not modified after
+ * opening, so it can be called from several threads. The error code is
+ * returned without being set in the VDISK structure.
+ */
+int vdisk_vhdx_read_block(struct VDISK *vd, void *buffer, uint64_t index);
+
+int vdisk_vhdx_map_block(struct VDISK *vd, uint64_t index, uint64_t *offset, uint64_t *count);
+
+void vdisk_vhdx_close(struct VDISK *vd);
@@ -1,46 +1,450 @@
 #include "vdisk.h"
 #include "utils.h"
 #include "platform.h"
+#include "inflate.h"
+#include <string.h> // memset
+
+static int vdisk_vmdk_stream_open(VDISK *vd);
 
 int vdisk_vmdk_open(VDISK *vd, uint32_t flags, uint32_t internal) {
 	if ((vd->vmdk = malloc(VMDK_META_ALLOC)) == NULL)
 		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
 
-	if (os_fread(vd->fd, &vd->vmdk->hdr, sizeof(VMDK_HDR)))
+	if (os_pread(vd->fd, &vd->vmdk->hdr, sizeof(VMDK_HDR), 0))
 		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-	if (vd->vmdk->hdr.version != 1)
+	if (vd->vmdk->hdr.version < 1 || vd->vmdk->hdr.version > 3)
 		return vdisk_i_err(vd, VVD_EVDVERSION, __LINE__, __func__);
 	if (vd->vmdk->hdr.grainSize < 8 ||	// < 4KiB
 		vd->vmdk->hdr.grainSize > 128 ||	// > 64KiB
 		pow2(vd->vmdk->hdr.grainSize) == 0)
 		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+	if (vd->vmdk->hdr.numGTEsPerGT == 0 ||
+		vd->vmdk->hdr.numGTEsPerGT > VMDK_GTE_MAX ||
+		pow2(vd->vmdk->hdr.numGTEsPerGT) == 0)
+		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+
+	VMDK_INTERNALS *in = &vd->vmdk->in;
+	memset(in, 0, sizeof(VMDK_INTERNALS));
 
 	vd->capacity = SECTOR_TO_BYTE(vd->vmdk->hdr.capacity);
 
-	vd->vmdk->in.mask = vd->vmdk->hdr.grainSize - 1;
-	vd->vmdk->in.shift = fpow2((uint32_t)vd->vmdk->hdr.grainSize);
-	vd->vmdk->in.overhead = SECTOR_TO_BYTE(vd->vmdk->hdr.overHead);
+	uint32_t grainsize = (uint32_t)SECTOR_TO_BYTE(vd->vmdk->hdr.grainSize);
+	in->mask = grainsize - 1;
+	in->shift = fpow2(grainsize);
+	in->overhead = SECTOR_TO_BYTE(vd->vmdk->hdr.overHead);
+
+	vd->blksize = grainsize;
+	vd->blkcount = (vd->capacity + grainsize - 1) >> in->shift;
+
+	if (vd->vmdk->hdr.flags & VDMK_F_COMPRESSED) {
+		if (vd->vmdk->hdr.compressAlgorithm != VMDK_C_DEFLATE ||
+			(vd->vmdk->hdr.flags & VMDK_F_MARKERS) == 0)
+			return vdisk_i_err(vd, VVD_EVDTODO, __LINE__, __func__);
+		return vdisk_vmdk_stream_open(vd);
+	}
+
+	//TODO: Uncompressed extents with the grain directory at the end
+	if (vd->vmdk->hdr.gdOffset == VMDK_GD_AT_END)
+		return vdisk_i_err(vd, VVD_EVDTODO, __LINE__, __func__);
+
+	//
+	// Grain directory
+	//
+
+	uint64_t gtcoverage = vd->vmdk->hdr.grainSize * vd->vmdk->hdr.numGTEsPerGT;
+	uint64_t gdentries = (vd->vmdk->hdr.capacity + gtcoverage - 1) / gtcoverage;
+	if (gdentries == 0 || gdentries > UINT32_MAX)
+		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+
+	in->l0_entries = (uint32_t)gdentries;
+	in->l1_entries = vd->vmdk->hdr.numGTEsPerGT;
+	in->l1_shift = fpow2(in->l1_entries);
+	in->l1_size = in->l1_entries * sizeof(uint32_t);
+
+	size_t gdsize = (size_t)in->l0_entries * sizeof(uint32_t);
+	if ((in->l0_offsets = malloc(gdsize)) == NULL)
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+	if (os_pread(vd->fd, in->l0_offsets, gdsize, SECTOR_TO_BYTE(vd->vmdk->hdr.gdOffset)))
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	if (vdisk_vmdk_GT_cache(vd, VMDK_GT_CACHE_MEMORY))
+		return vd->err.num;
 
 	vd->cb.lba_read = vdisk_vmdk_sparse_read_lba;
+	vd->cb.lba_readn = vdisk_vmdk_sparse_read_lbas;
+	vd->cb.blk_locate = vdisk_vmdk_sparse_locate_block;
+	vd->cb.blk_map = vdisk_vmdk_sparse_map_block;
+
+	return 0;
+}
+
+int vdisk_vmdk_GT_cache(VDISK *vd, uint64_t memory) {
+	VMDK_INTERNALS *in = &vd->vmdk->in;
+	in->l1_offsets = NULL;
+	if (vdisk_table_cache_init(&in->cache, in->l1_size, memory, VMDK_GT_CACHE_MAX))
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+	return 0;
+}
+
+void vdisk_vmdk_close(VDISK *vd) {
+	VMDK_INTERNALS *in = &vd->vmdk->in;
+	free(in->l0_offsets);
+	vdisk_table_cache_free(&in->cache);
+	in->l0_offsets = in->l1_offsets = NULL;
+	free(in->stream.offsets);
+	free(in->stream.sizes);
+	free(in->stream.cache);
+	in->stream.offsets = NULL;
+	in->stream.sizes = NULL;
+	in->stream.cache = NULL;
+}
 
+int vdisk_vmdk_GT_load(VDISK *vd, uint32_t sector) {
+	VMDK_INTERNALS *in = &vd->vmdk->in;
+	uint32_t *table = vdisk_table_cache_get(&in->cache, vd->fd, SECTOR_TO_BYTE((uint64_t)sector));
+	if (table == NULL)
+		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	in->l1_offsets = table;
+	return 0;
+}
+
+// Get the grain table entry of a grain, 0 if its grain table is absent
+static int vdisk_vmdk_GTE(VDISK *vd, uint64_t grain, uint32_t *entry) {
+	VMDK_INTERNALS *in = &vd->vmdk->in;
+	uint64_t l0 = grain >> in->l1_shift;
+
+	if (l0 >= in->l0_entries)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+	if (in->l0_offsets[l0] == 0) {
+		*entry = 0;
+		return 0;
+	}
+	if (vdisk_vmdk_GT_load(vd, in->l0_offsets[l0]))
+		return vd->err.num;
+
+	*entry = in->l1_offsets[grain & (in->l1_entries - 1)];
 	return 0;
 }
 
 int vdisk_vmdk_sparse_read_lba(VDISK *vd, void *buffer, uint64_t index) {
-	
 	uint64_t offset = SECTOR_TO_BYTE(index); // Byte offset
 
 	if (offset >= vd->capacity)
-		return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint32_t gte = 0;
+	if (vdisk_vmdk_GTE(vd, offset >> vd->vmdk->in.shift, &gte))
+		return vd->err.num;
+	if (gte == 0)
+		return vdisk_i_err(vd, VVD_EVDUNALLOC, __LINE__, __func__);
+	if (gte == VMDK_GTE_ZERO) {
+		memset(buffer, 0, 512);
+		return 0;
+	}
 
-	//bi = offset / SECTOR_TO_BYTE(vd->vmdkold.grainSize);
-	//TODO: Work with the grainSize
-	offset += vd->vmdk->in.overhead;
+	offset = SECTOR_TO_BYTE((uint64_t)gte) + (offset & vd->vmdk->in.mask);
 
-	if (os_fseek(vd->fd, offset, SEEK_SET))
+	if (os_pread(vd->fd, buffer, 512, offset))
 		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
-	if (os_fread(vd->fd, buffer, 512))
+
+	return 0;
+}
+
+int vdisk_vmdk_sparse_read_lbas(VDISK *vd, void *buffer, uint64_t index, uint32_t count) {
+	VMDK_INTERNALS *in = &vd->vmdk->in;
+	uint8_t *buf = buffer;
+	uint64_t offset = SECTOR_TO_BYTE(index);
+	uint64_t end = offset + SECTOR_TO_BYTE(count);
+
+	if (end > vd->capacity)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint64_t gsize = vd->blksize;
+	uint64_t pos = 0;	// Physical offset of the pending run
+	uint64_t run = 0;	// Length of the pending run
+	uint8_t *rbuf = buf;	// Destination of the pending run
+
+	while (offset < end) {
+		uint64_t len = gsize - (offset & in->mask);
+		if (len > end - offset)
+			len = end - offset;
+
+		uint32_t gte = 0;
+		if (vdisk_vmdk_GTE(vd, offset >> in->shift, &gte))
+			return vd->err.num;
+		if (gte == VMDK_GTE_ZERO)
+			gte = 0;
+
+		uint64_t gpos = SECTOR_TO_BYTE((uint64_t)gte) + (offset & in->mask);
+
+		// Flush pending run if this grain does not extend it
+		if (run && (gte == 0 || gpos != pos + run)) {
+			if (os_pread(vd->fd, rbuf, run, pos))
+				return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+			run = 0;
+		}
+
+		if (gte == 0) { // Unallocated or zeroed
+			memset(buf, 0, len);
+		} else {
+			if (run == 0) {
+				pos = gpos;
+				rbuf = buf;
+			}
+			run += len;
+		}
+
+		buf += len;
+		offset += len;
+	}
+
+	if (run) {
+		if (os_pread(vd->fd, rbuf, run, pos))
+			return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+	}
+
+	return 0;
+}
+
+int vdisk_vmdk_sparse_locate_block(VDISK *vd, uint64_t index, uint64_t *offset) {
+	uint32_t gte = 0;
+	if (vdisk_vmdk_GTE(vd, index, &gte))
+		return vd->err.num;
+	if (gte == 0 || gte == VMDK_GTE_ZERO)
+		return vdisk_i_err(vd, VVD_EVDUNALLOC, __LINE__, __func__);
+
+	*offset = SECTOR_TO_BYTE((uint64_t)gte);
+	return 0;
+}
+
+int vdisk_vmdk_sparse_map_block(VDISK *vd, uint64_t index, uint64_t *offset, uint64_t *count) {
+	VMDK_INTERNALS *in = &vd->vmdk->in;
+	uint32_t entries = in->l1_entries;
+	uint64_t l0 = index >> in->l1_shift;
+	uint32_t l1 = index & (entries - 1);
+
+	if (l0 >= in->l0_entries)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	// Missing grain tables cover a whole table of grains
+	if (in->l0_offsets[l0] == 0) {
+		uint64_t i = l0 + 1;
+		while (i < in->l0_entries && in->l0_offsets[i] == 0) ++i;
+		*count = ((i - l0) * entries) - l1;
+		return VDISK_EXTENT_UNALLOC;
+	}
+	if (vdisk_vmdk_GT_load(vd, in->l0_offsets[l0]))
+		return vd->err.num;
+
+	// Runs are limited to the loaded grain table
+	uint32_t *GT = in->l1_offsets;
+	uint32_t gte = GT[l1];
+	uint32_t i = l1 + 1;
+	if (gte == 0 || gte == VMDK_GTE_ZERO) {
+		while (i < entries && GT[i] == gte) ++i;
+		*count = i - l1;
+		return gte ? VDISK_EXTENT_ZERO : VDISK_EXTENT_UNALLOC;
+	}
+	uint32_t gsectors = (uint32_t)vd->vmdk->hdr.grainSize;
+	while (i < entries && GT[i] == gte + ((i - l1) * gsectors)) ++i;
+	*offset = SECTOR_TO_BYTE((uint64_t)gte);
+	*count = i - l1;
+	return VDISK_EXTENT_DATA;
+}
+
+//
+// streamOptimized
+//
+
+// Index the grains by walking the markers, in a single sequential pass
+static int vdisk_vmdk_stream_open(VDISK *vd) {
+	VMDK_INTERNALS *in = &vd->vmdk->in;
+	uint64_t fsize;
+
+	if (os_fsize(vd->fd, &fsize))
 		return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
 
+	in->stream.offsets = calloc(vd->blkcount, sizeof(uint64_t));
+	in->stream.sizes = calloc(vd->blkcount, sizeof(uint32_t));
+	in->stream.cache = malloc(vd->blksize);
+	in->stream.current = UINT64_MAX;
+	uint8_t *buffer = malloc(VMDK_STREAM_BUFSIZE);
+	if (in->stream.offsets == NULL || in->stream.sizes == NULL ||
+		in->stream.cache == NULL || buffer == NULL) {
+		free(buffer);
+		return vdisk_i_err(vd, VVD_ENOMEM, __LINE__, __func__);
+	}
+
+	// Compressed grains can be slightly larger than grains
+	uint64_t maxsize = (uint64_t)vd->blksize * 2;
+	uint64_t pos = in->overhead;	// Current marker
+	uint64_t bufpos = 0;	// File offset of buffer
+	uint64_t buflen = 0;	// Valid bytes in buffer
+	while (pos + sizeof(VMDK_MARKER) <= fsize) {
+		if (pos < bufpos || pos + sizeof(VMDK_MARKER) > bufpos + buflen) {
+			bufpos = pos;
+			buflen = fsize - pos < VMDK_STREAM_BUFSIZE ? fsize - pos : VMDK_STREAM_BUFSIZE;
+			if (os_pread(vd->fd, buffer, buflen, bufpos)) {
+				free(buffer);
+				return vdisk_i_err(vd, VVD_EOS, __LINE__, __func__);
+			}
+		}
+
+		VMDK_MARKER *marker = (VMDK_MARKER*)(buffer + (pos - bufpos));
+		if (marker->cbSize) { // Grain: LBA, compressed size, data
+			uint64_t lba = marker->uSector;
+			if (lba >= vd->vmdk->hdr.capacity || lba & (vd->vmdk->hdr.grainSize - 1) ||
+				marker->cbSize > maxsize) {
+				free(buffer);
+				return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+			}
+			uint64_t grain = lba / vd->vmdk->hdr.grainSize;
+			in->stream.offsets[grain] = pos;
+			in->stream.sizes[grain] = marker->cbSize;
+			pos += (12 + (uint64_t)marker->cbSize + 511) & ~511ull;
+			continue;
+		}
+
+		switch (marker->uType) { // Metadata: sector count, followed by data
+		case VMDK_MARKER_EOS:
+			pos = fsize;
+			continue;
+		case VMDK_MARKER_GT:
+		case VMDK_MARKER_GD:
+		case VMDK_MARKER_FOOTER:
+			pos += sizeof(VMDK_MARKER) + SECTOR_TO_BYTE(marker->uSector);
+			continue;
+		default:
+			free(buffer);
+			return vdisk_i_err(vd, VVD_EVDMISC, __LINE__, __func__);
+		}
+	}
+	free(buffer);
+
+	vd->cb.lba_read = vdisk_vmdk_stream_read_lba;
+	vd->cb.lba_readn = vdisk_vmdk_stream_read_lbas;
+	vd->cb.blk_read = vdisk_vmdk_stream_read_block;
+	vd->cb.blk_map = vdisk_vmdk_stream_map_block;
+
+	return 0;
+}
+
+int vdisk_vmdk_stream_read_block(VDISK *vd, void *buffer, uint64_t index) {
+	VMDK_INTERNALS *in = &vd->vmdk->in;
+	if (index >= vd->blkcount)
+		return VVD_EVDBOUND;
+
+	uint64_t pos = in->stream.offsets[index];
+	if (pos == 0) {
+		memset(buffer, 0, vd->blksize);
+		return 0;
+	}
+
+	size_t size = 12 + (size_t)in->stream.sizes[index];
+	uint8_t *data = malloc(size);
+	if (data == NULL)
+		return VVD_ENOMEM;
+	if (os_pread(vd->fd, data, size, pos)) {
+		free(data);
+		return VVD_EOS;
+	}
+
+	size_t len;
+	int e = inflate_zlib(buffer, vd->blksize, &len, data + 12, size - 12);
+	free(data);
+	if (e)
+		return VVD_EVDMISC;
+	if (len < vd->blksize)
+		memset((uint8_t*)buffer + len, 0, vd->blksize - len);
+
+	return 0;
+}
+
+// Decode a grain in the cache, for partial grain reads
+static int vdisk_vmdk_stream_cache(VDISK *vd, uint64_t grain) {
+	VMDK_INTERNALS *in = &vd->vmdk->in;
+	if (in->stream.current == grain)
+		return 0;
+	in->stream.current = UINT64_MAX;
+	int e = vdisk_vmdk_stream_read_block(vd, in->stream.cache, grain);
+	if (e)
+		return vdisk_i_err(vd, e, __LINE__, __func__);
+	in->stream.current = grain;
+	return 0;
+}
+
+int vdisk_vmdk_stream_read_lba(VDISK *vd, void *buffer, uint64_t index) {
+	uint64_t offset = SECTOR_TO_BYTE(index);
+	if (offset >= vd->capacity)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint64_t grain = offset >> vd->vmdk->in.shift;
+	if (vd->vmdk->in.stream.offsets[grain] == 0)
+		return vdisk_i_err(vd, VVD_EVDUNALLOC, __LINE__, __func__);
+	if (vdisk_vmdk_stream_cache(vd, grain))
+		return vd->err.num;
+
+	memcpy(buffer, vd->vmdk->in.stream.cache + (offset & vd->vmdk->in.mask), 512);
 	return 0;
 }
+
+int vdisk_vmdk_stream_read_lbas(VDISK *vd, void *buffer, uint64_t index, uint32_t count) {
+	VMDK_INTERNALS *in = &vd->vmdk->in;
+	uint8_t *buf = buffer;
+	uint64_t offset = SECTOR_TO_BYTE(index);
+	uint64_t end = offset + SECTOR_TO_BYTE(count);
+
+	if (end > vd->capacity)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint64_t gsize = vd->blksize;
+
+	while (offset < end) {
+		uint64_t grain = offset >> in->shift;
+		uint64_t goff = offset & in->mask;
+		uint64_t len = gsize - goff;
+		if (len > end - offset)
+			len = end - offset;
+
+		if (in->stream.offsets[grain] == 0) {
+			memset(buf, 0, len);
+		} else if (len == gsize && in->stream.current != grain) {
+			// Whole grain, decoded in place
+			int e = vdisk_vmdk_stream_read_block(vd, buf, grain);
+			if (e)
+				return vdisk_i_err(vd, e, __LINE__, __func__);
+		} else {
+			if (vdisk_vmdk_stream_cache(vd, grain))
+				return vd->err.num;
+			memcpy(buf, in->stream.cache + goff, len);
+		}
+
+		buf += len;
+		offset += len;
+	}
+
+	return 0;
+}
+
+int vdisk_vmdk_stream_map_block(VDISK *vd, uint64_t index, uint64_t *offset, uint64_t *count) {
+	VMDK_INTERNALS *in = &vd->vmdk->in;
+	if (index >= vd->blkcount)
+		return vdisk_i_err(vd, VVD_EVDBOUND, __LINE__, __func__);
+
+	uint64_t *offsets = in->stream.offsets;
+	uint64_t i = index + 1;
+	if (offsets[index] == 0) {
+		while (i < vd->blkcount && offsets[i] == 0) ++i;
+		*count = i - index;
+		return VDISK_EXTENT_UNALLOC;
+	}
+
+	// Runs of grains stored one after another in the stream
+	for (; i < vd->blkcount; ++i) {
+		uint64_t prev = offsets[i - 1];
+		if (offsets[i] != prev + ((12 + (uint64_t)in->stream.sizes[i - 1] + 511) & ~511ull))
+			break;
+	}
+	*offset = offsets[index];
+	*count = i - index;
+	return VDISK_EXTENT_DATA;
+}
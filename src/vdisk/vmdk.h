@@ -10,12 +10,29 @@
  * +---
  * | 1 Grain Table Entries
  * 
+ * The grain directory holds sector offsets to grain tables, each covering
+ * numGTEsPerGT grains. Grain tables hold sector offsets to grains. An entry
+ * of 0 is unallocated, and a grain table entry of 1 is a zeroed grain.
+ * The directory is loaded at open, grain tables are read on demand through
+ * a cache.
+ * 
+ * streamOptimized extents (e.g. OVA exports) hold DEFLATE compressed grains,
+ * each preceded by a grain marker, with grain tables and the grain
+ * directory written as marker-prefixed metadata along the stream:
+ * 
+ * +--------+--------+-----+-----------+----+-----------+----+--------+-----+
+ * | Header | Grain  | ... | GT marker | GT | GD marker | GD | Footer | EOS |
+ * +--------+--------+-----+-----------+----+-----------+----+--------+-----+
+ * 
+ * The markers are walked once at open to index the grains.
+ * 
  * Sources:
  * - VMware Virtual Disks Virtual Disk Format 1.1
  * - VMware Virtual Disk Format 5.0
  */
 
 #include <stdint.h>
+#include "cache.h"
 
 enum {
 	VMDK_F_VALID_NL	= 0x1,	// Valid newline detection
@@ -29,8 +46,20 @@ enum {
 
 	VMDK_2G_SPLIT_SIZE	= 2047 * 1024 * 1024, // grainSize*sectorSize = 2 GiB
 	VMDK_TEXT_LENGTH	= 10 * 1024,	// 10K text overhead buffer
-	VMDK_GRAINSIZE_DEFAULT	= 64 * 1024	// Default being 64K
+	VMDK_GRAINSIZE_DEFAULT	= 64 * 1024,	// Default being 64K
+	VMDK_GTE_MAX	= 4096,	// Maximum number of grain table entries
+	VMDK_GTE_ZERO	= 1,	// Zeroed grain (grain table entry)
+	VMDK_STREAM_BUFSIZE	= 1024 * 1024,	// Marker walk read size
 };
+
+// Default memory budget for the grain table cache, can be defined at build time
+#ifndef VMDK_GT_CACHE_MEMORY
+#define VMDK_GT_CACHE_MEMORY	(2 * 1024 * 1024)
+#endif
+// Maximum number of cached grain tables
+static const uint32_t VMDK_GT_CACHE_MAX	= 1024;
+// Grain directory is at the end of the file (streamOptimized)
+static const uint64_t VMDK_GD_AT_END	= 0xFFFFFFFFFFFFFFFF;
 enum {
 	VMDK_MARKER_EOS	= 0,	// end-of-stream
 	VMDK_MARKER_GT	= 1,	// grain table marker
@@ -70,11 +99,22 @@ typedef struct {
 } VMDK_MARKER;
 
 typedef struct {
-	uint32_t *l0_offsets;	// Grain Directory offsets
-	uint32_t *l1_offsets;	// Grain Table offsets
-	uint32_t mask;	// Bit offset mask
-	uint32_t shift;	// Bit offset shift
+	uint32_t *l0_offsets;	// Grain Directory, grain table sector offsets
+	uint32_t *l1_offsets;	// Last loaded Grain Table, within the cache
+	uint32_t l0_entries;	// Number of grain directory entries
+	uint32_t l1_entries;	// Number of grain table entries (numGTEsPerGT)
+	uint32_t l1_shift;	// Grain table entries shift
+	uint32_t l1_size;	// Grain table size in bytes
+	uint32_t mask;	// Grain offset mask in bytes
+	uint32_t shift;	// Grain shift in bytes
 	uint64_t overhead;	// data overhead in bytes
+	VDISK_TABLE_CACHE cache;	// Grain table cache
+	struct {
+		uint64_t *offsets;	// Per grain: grain marker file offset, 0 if absent
+		uint32_t *sizes;	// Per grain: compressed size
+		uint8_t *cache;	// Last decoded grain, for sector reads
+		uint64_t current;	// Grain held in cache, UINT64_MAX if none
+	} stream;	// streamOptimized grain index
 } VMDK_INTERNALS;
 
 typedef struct {
@@ -88,4 +128,34 @@ struct VDISK;
 
 int vdisk_vmdk_open(struct VDISK *vd, uint32_t flags, uint32_t internal);
 
+/**
+ * (Re)size the grain table cache to fit within a memory budget, holding at
+ * least one table and at most VMDK_GT_CACHE_MAX tables. Cached tables and
+ * counters are reset.
+ */
+int vdisk_vmdk_GT_cache(struct VDISK *vd, uint64_t memory);
+
+int vdisk_vmdk_GT_load(struct VDISK *vd, uint32_t sector);
+
+void vdisk_vmdk_close(struct VDISK *vd);
+
 int vdisk_vmdk_sparse_read_lba(struct VDISK *vd, void *buffer, uint64_t index);
+
+int vdisk_vmdk_sparse_read_lbas(struct VDISK *vd, void *buffer, uint64_t index, uint32_t count);
+
+int vdisk_vmdk_sparse_locate_block(struct VDISK *vd, uint64_t index, uint64_t *offset);
+
+int vdisk_vmdk_sparse_map_block(struct VDISK *vd, uint64_t index, uint64_t *offset, uint64_t *count);
+
+int vdisk_vmdk_stream_read_lba(struct VDISK *vd, void *buffer, uint64_t index);
+
+int vdisk_vmdk_stream_read_lbas(struct VDISK *vd, void *buffer, uint64_t index, uint32_t count);
+
+/**
+ * Read and decompress a grain. This only uses the grain index, which is
+ * not modified after opening, so it can be called from several threads.
+ * The error code is returned without being set in the VDISK structure.
+ */
+int vdisk_vmdk_stream_read_block(struct VDISK *vd, void *buffer, uint64_t index);
+
+int vdisk_vmdk_stream_map_block(struct VDISK *vd, uint64_t index, uint64_t *offset, uint64_t *count);
@@ -42,7 +42,9 @@ void vvd_cb_progress(uint32_t type, void *data) {
 	case VVD_NOTIF_VDISK_TOTAL_BLOCKS:
 	case VVD_NOTIF_VDISK_TOTAL_BLOCKS64:
 		if (g_flags & VVD_PROGRESS)
-		if (os_pinit(&g_progress, PROG_MODE_POURCENT, 0)) {
+		if (os_pinit(&g_progress, PROG_MODE_POURCENT,
+			type == VVD_NOTIF_VDISK_TOTAL_BLOCKS ?
+			*(uint32_t*)data : (uint32_t)*(uint64_t*)data)) {
 			fputs("os_pinit: Could not init progress bar\n", stderr);
 			exit(1);
 		}
@@ -50,7 +52,9 @@ void vvd_cb_progress(uint32_t type, void *data) {
 	case VVD_NOTIF_VDISK_CURRENT_BLOCK:
 	case VVD_NOTIF_VDISK_CURRENT_BLOCK64:
 		if (g_flags & VVD_PROGRESS)
-		if (os_pupdate(&g_progress, 0)) {
+		if (os_pupdate(&g_progress,
+			type == VVD_NOTIF_VDISK_CURRENT_BLOCK ?
+			*(uint32_t*)data : (uint32_t)*(uint64_t*)data + 1)) {
 			fputs("os_pinit: Could not update progress bar\n", stderr);
 			exit(1);
 		}
@@ -494,12 +498,83 @@ int vvd_info(VDISK *vd, uint32_t flags) {
 			type, vd->vhd->hdr.major, vd->vhd->hdr.minor, sizecur, disksize
 			);
 		}
+		if (vd->vhd->in.depth)
+			printf("+ Parent chain of %u disk(s)\n", vd->vhd->in.depth);
 
 		if (vd->vhd->hdr.savedState)
 			puts("+ Saved state");
 	}
 		break;
-//	case VDISK_FORMAT_VHDX:
+	//
+	// VHDX
+	//
+	case VDISK_FORMAT_VHDX: {
+		VHDX_INTERNALS *in = &vd->vhdx->in;
+		VHDX_HEADER1 *header = in->header ? &vd->vhdx->v1_2 : &vd->vhdx->v1;
+
+		if (in->fileflags & VHDX_FILE_LEAVE_ALLOCATED)
+			type = "fixed";
+		else
+			type = "dynamic";
+
+		bintostr(disksize, vd->capacity);
+		bintostr(blocksize, in->blocksize);
+
+		if (flags & VVD_INFO_RAW) {
+			uid_str(uid1, &header->filewrite, UID_GUID);
+			uid_str(uid2, &header->datawrite, UID_GUID);
+			uid_str(uid3, &header->log, UID_GUID);
+
+			printf(
+			"disk format        : VHDX\n"
+			"version            : %u\n"
+			"type               : %s\n"
+			"capacity           : %s (%"PRIu64")\n"
+			"block size         : %s (%u)\n"
+			"blocks total       : %"PRIu64"\n"
+			"bat entries        : %"PRIu64"\n"
+			"chunk ratio        : %u\n"
+			"sector size        : %u\n"
+			"physical sector    : %u\n"
+			"active header      : %u\n"
+			"sequence number    : %"PRIu64"\n"
+			"file write guid    : %s\n"
+			"data write guid    : %s\n"
+			"log guid           : %s\n"
+			"log version        : %u\n"
+			"log offset         : 0x%"PRIX64"\n"
+			"log size           : %u\n"
+			"bat offset         : 0x%"PRIX64"\n"
+			"metadata offset    : 0x%"PRIX64"\n",
+			header->version,
+			type,
+			disksize, vd->capacity,
+			blocksize, in->blocksize,
+			in->blocks,
+			in->batcount,
+			in->chunkratio,
+			in->sectorsize,
+			in->physsize,
+			in->header + 1,
+			header->seqnumber,
+			uid1, uid2, uid3,
+			header->logversion,
+			header->logoffset,
+			header->logsize,
+			vd->vhdx->batreg.offset,
+			vd->vhdx->metareg.offset
+			);
+		} else {
+			printf(
+			"Microsoft VHDX %s disk v%u, %s\n",
+			type, header->version, disksize
+			);
+		}
+
+		if (in->log.count)
+			puts("+ Pending log, replayed in memory");
+	}
+		break;
 	case VDISK_FORMAT_QED:
 		if (flags & VVD_INFO_RAW) {
 			printf(
@@ -532,6 +607,110 @@ int vvd_info(VDISK *vd, uint32_t flags) {
 			printf("QEMU Enhanced Disk, %s\n", disksize);
 		}
 		break;
+	case VDISK_FORMAT_QCOW: {
+		QCOW_HDR *hdr = &vd->qcow->hdr;
+		if (flags & VVD_INFO_RAW) {
+			printf(
+			"disk format        : QCOW\n"
+			"version            : %u\n"
+			"cluster bits       : %u\n"
+			"L1 entries         : %u\n"
+			"L1 offset          : 0x%" PRIX64 "\n"
+			"refcount offset    : 0x%" PRIX64 "\n"
+			"refcount clusters  : %u\n"
+			"refcount order     : %u\n"
+			"snapshots          : %u\n"
+			"header size        : %u\n",
+			hdr->version,
+			hdr->cluster_bits,
+			hdr->l1_size,
+			hdr->l1_offset,
+			hdr->refcount_table_offset,
+			hdr->refcount_table_clusters,
+			hdr->refcount_order,
+			hdr->nb_snapshots,
+			hdr->header_length
+			);
+			if (hdr->version >= 3)
+				printf(
+				"features           : 0x%" PRIX64 "\n"
+				"compat features    : 0x%" PRIX64 "\n"
+				"autoclear features : 0x%" PRIX64 "\n",
+				hdr->incompatible_features,
+				hdr->compatible_features,
+				hdr->autoclear_features
+				);
+		} else {
+			bintostr(disksize, vd->capacity);
+			printf("QEMU Copy-On-Write v%u disk, %s\n", hdr->version, disksize);
+		}
+		if (hdr->version >= 3 && hdr->incompatible_features & QCOW_IF_DIRTY)
+			puts("+ Dirty, refcounts may be stale");
+	}
+		break;
+	case VDISK_FORMAT_PHDD: {
+		PHDD_HDR *hdr = &vd->phdd->hdr;
+		if (flags & VVD_INFO_RAW) {
+			printf(
+			"disk format        : Parallels\n"
+			"magic              : %.16s\n"
+			"version            : %u\n"
+			"chs                : %u/%u/%u\n"
+			"cluster size       : %" PRIu64 "\n"
+			"table entries      : %u\n"
+			"sectors            : %" PRIu64 "\n"
+			"data offset        : %u\n"
+			"flags              : 0x%X\n"
+			"extension offset   : %" PRIu64 "\n",
+			hdr->magic,
+			hdr->version,
+			hdr->cylinders, hdr->heads, hdr->sectorsPerTrack,
+			vd->phdd->in.csize,
+			hdr->number_entries,
+			hdr->sectors,
+			hdr->data_off,
+			hdr->flags,
+			hdr->ext_off
+			);
+		} else {
+			bintostr(disksize, vd->capacity);
+			printf("Parallels expanding disk, %s\n", disksize);
+		}
+		if (hdr->inuse == PHDD_INUSE)
+			puts("+ In use, image was not closed properly");
+	}
+		break;
+	case VDISK_FORMAT_BOCHS: {
+		BOCH_HDR *hdr = &vd->bochs->hdr;
+		BOCH_REDOLOG_HDR *redolog = &vd->bochs->redolog;
+		if (flags & VVD_INFO_RAW) {
+			printf(
+			"disk format        : Bochs\n"
+			"type               : %.16s\n"
+			"subtype            : %.16s\n"
+			"version            : 0x%08X\n"
+			"header size        : %u\n"
+			"catalog entries    : %u\n"
+			"bitmap size        : %u\n"
+			"extent size        : %u\n"
+			"timestamp          : 0x%08X\n"
+			"disk size          : %" PRIu64 "\n",
+			hdr->type,
+			hdr->subtype,
+			hdr->version,
+			hdr->hdrsize,
+			redolog->nentries,
+			redolog->bitmapsize,
+			redolog->extentsize,
+			redolog->timestamp,
+			redolog->disksize
+			);
+		} else {
+			bintostr(disksize, vd->capacity);
+			printf("Bochs %.16s redolog, %s\n", hdr->subtype, disksize);
+		}
+	}
+		break;
 	case VDISK_FORMAT_RAW: break; // No header info
 	default:
 		fputs("vvd_info: Format not supported\n", stderr);
@@ -546,8 +725,8 @@ int vvd_info(VDISK *vd, uint32_t flags) {
 	//
 
 	MBR mbr;
-	if (vdisk_read_sector(vd, &mbr, 0)) return EXIT_SUCCESS;
-	if (mbr.sig != MBR_SIG) return EXIT_SUCCESS;
+	if (vdisk_read_sector(vd, &mbr, 0)) goto L_CACHE;
+	if (mbr.sig != MBR_SIG) goto L_CACHE;
 	vvd_info_mbr(&mbr, flags);
 
 	//
@@ -560,14 +739,14 @@ int vvd_info(VDISK *vd, uint32_t flags) {
 		case 0xEE: // EFI GPT Protective
 		case 0xEF: // EFI System Partition
 			// Start of disk
-			if (vdisk_read_sector(vd, &mbr, 1)) return VVD_EOK;
+			if (vdisk_read_sector(vd, &mbr, 1)) goto L_CACHE;
 			if (((GPT*)&mbr)->sig == EFI_SIG) {
 				ebrlba = 2;
 				goto L_GPT_RDY;
 			}
 			// End of disk
 			ebrlba = BYTE_TO_SECTOR(vd->capacity) - 1;
-			if (vdisk_read_sector(vd, &mbr, ebrlba)) return VVD_EOK;
+			if (vdisk_read_sector(vd, &mbr, ebrlba)) goto L_CACHE;
 			if (((GPT*)&mbr)->sig == EFI_SIG) {
 				ebrlba -= ((GPT*)&mbr)->pt_entries; // typically 128
 				goto L_GPT_RDY;
@@ -580,6 +759,17 @@ int vvd_info(VDISK *vd, uint32_t flags) {
 		}
 	}
 
+L_CACHE:
+	if (vd->cache && flags & VVD_INFO_RAW)
+		printf(
+		"\n"
+		"block cache        : %u blocks, %"PRIu64" hits, %"PRIu64" misses\n"
+		"cache promotions   : %"PRIu64"\n"
+		"cache evictions    : %"PRIu64"\n",
+		vd->cache->count, vd->cache->hits, vd->cache->misses,
+		vd->cache->promotions, vd->cache->evictions
+		);
+
 	return EXIT_SUCCESS;
 }
 
@@ -588,88 +778,97 @@ int vvd_info(VDISK *vd, uint32_t flags) {
 //
 
 int vvd_map(VDISK *vd, uint32_t flags) {
-	char bsizestr[BINSTR_LENGTH]; // If used
+	static const char *states[] = { "unalloc", "zero", "data", "parent" };
+	VDISK_EXTENT *extents;
+	size_t count;
+
+	if (vdisk_get_extents(vd, 0, UINT64_MAX, &extents, &count)) {
+		vdisk_perror(vd);
+		return vd->err.num;
+	}
 
-	puts("vvd_map: to be implemented");
+	uint64_t bsize = vd->blksize;
 
-	/*switch (vd->format) {
-	case VDISK_FORMAT_VDI:
-		bcount = vd->vdiv1.blk_total;
-		bsize = vd->vdiv1.blocksize;
-		break;
-	case VDISK_FORMAT_VHD:
-		if (vd->vhdhdr.type != VHD_DISK_DYN) {
-			fputs("vvd_map: vdisk is not dynamic\n", stderr);
-			return VVD_EVDTYPE;
+	if (flags & VVD_MAP_CSV) {
+		puts("start,blocks,offset,state");
+		for (size_t i = 0; i < count; ++i) {
+			VDISK_EXTENT *e = extents + i;
+			printf("%"PRIu64",%"PRIu64",%"PRIu64",%s\n",
+				e->offset / bsize, (e->length + bsize - 1) / bsize,
+				e->position, states[e->state]);
 		}
-		bcount = vd->u32blockcount;
-		bsize = vd->vhddyn.blocksize;
-		break;
-	case VDISK_FORMAT_QED:
-		index64 = 1;
-		bcount = vd->u32blockcount;
-		bsize = vd->qedhdr.cluster_size;
-		break;
-	default:
-		fputs("vvd_map: unsupported format\n", stderr);
-		return VVD_EVDFORMAT;
+		free(extents);
+		return EXIT_SUCCESS;
+	}
+
+	// Count a break when the next data run does not follow the previous
+	// one within the file, allowing small gaps (e.g. VHD sector bitmaps)
+	uint64_t sizes[4] = { 0, 0, 0, 0 };
+	uint64_t runs = 0, breaks = 0, end = 0;
+	for (size_t i = 0; i < count; ++i) {
+		VDISK_EXTENT *e = extents + i;
+		sizes[e->state] += e->length;
+		if (e->state != VDISK_EXTENT_DATA)
+			continue;
+		if (runs++ && (e->position < end || e->position - end > 4096))
+			++breaks;
+		end = e->position + e->length;
 	}
 
+	char bsizestr[BINSTR_LENGTH];
+	char datastr[BINSTR_LENGTH], zerostr[BINSTR_LENGTH], freestr[BINSTR_LENGTH];
+	char parentstr[BINSTR_LENGTH];
 	bintostr(bsizestr, bsize);
-	size_t i = 0;
-	size_t bn;
-	if (index64) {
+	bintostr(datastr, sizes[VDISK_EXTENT_DATA]);
+	bintostr(parentstr, sizes[VDISK_EXTENT_PARENT]);
+	bintostr(zerostr, sizes[VDISK_EXTENT_ZERO]);
+	bintostr(freestr, sizes[VDISK_EXTENT_UNALLOC]);
+
+	printf(
+	"Allocation map: %"PRIu64" blocks of %s each, %zu runs\n"
+	"      start |     blocks |      file offset | state\n"
+	"------------+------------+------------------+--------\n",
+	vd->blkcount, bsizestr, count
+	);
+	for (size_t i = 0; i < count; ++i) {
+		VDISK_EXTENT *e = extents + i;
+		uint64_t start = e->offset / bsize;
+		uint64_t blocks = (e->length + bsize - 1) / bsize;
+		if (e->state == VDISK_EXTENT_DATA)
+			printf(" %10"PRIu64" | %10"PRIu64" | %16"PRIX64" | %s\n",
+				start, blocks, e->position, states[e->state]);
+		else
+			printf(" %10"PRIu64" | %10"PRIu64" | %16s | %s\n",
+				start, blocks, "", states[e->state]);
+	}
+	printf(
+	"\n"
+	"data               : %s\n"
+	"zero               : %s\n"
+	"unallocated        : %s\n"
+	"fragmentation      : %.1f%% (%"PRIu64" breaks in %"PRIu64" data runs)\n",
+	datastr, zerostr, freestr,
+	runs > 1 ? (double)breaks * 100.0 / (runs - 1) : 0.0, breaks, runs
+	);
+	if (sizes[VDISK_EXTENT_PARENT])
+		printf("in parent          : %s\n", parentstr);
+	if (vd->format == VDISK_FORMAT_QED)
 		printf(
-		"Allocation map: %u blocks to %s blocks\n"
-		" offset d |                0 |                1 |"
-			"                2 |                3 |\n"
-		"----------+------------------+------------------+"
-			"------------------+------------------+\n",
-		bcount, bsizestr
+		"L2 cache           : %u tables, %"PRIu64" hits, %"PRIu64" misses\n",
+		vd->qed->in.cache.count, vd->qed->in.cache.hits, vd->qed->in.cache.misses
 		);
-		bn = bcount - 4;
-		for (; i < bn; i += 4) {
-			printf(
-			" %8zu | %16"PRIX64" | %16"PRIX64" | %16"PRIX64" | %16"PRIX64" |\n",
-			i,
-			vd->u64block[i],     vd->u64block[i + 1],
-			vd->u64block[i + 2], vd->u64block[i + 3]
-			);
-		}
-		if (bcount - i > 0) { // Left over
-			printf(" %8zu |", i);
-			for (; i < bcount; ++i)
-				printf(" %16"PRIX64" |", vd->u64block[i]);
-			putchar('\n');
-		}
-	} else {
+	else if (vd->format == VDISK_FORMAT_VMDK && vd->vmdk->in.cache.count)
 		printf(
-		"Allocation map: %u blocks of %s each\n"
-		" offset d |        0 |        1 |        2 |        3 |"
-			"        4 |        5 |        6 |        7 |\n"
-		"----------+----------+----------+----------+----------+"
-			"----------+----------+----------+----------+\n",
-		bcount, bsizestr
+		"GT cache           : %u tables, %"PRIu64" hits, %"PRIu64" misses\n",
+		vd->vmdk->in.cache.count, vd->vmdk->in.cache.hits, vd->vmdk->in.cache.misses
+		);
+	else if (vd->format == VDISK_FORMAT_QCOW && vd->qcow->in.cache.count)
+		printf(
+		"L2 cache           : %u slices, %"PRIu64" hits, %"PRIu64" misses\n",
+		vd->qcow->in.cache.count, vd->qcow->in.cache.hits, vd->qcow->in.cache.misses
 		);
-		bn = bcount - 8;
-		for (; i < bn; i += 8) {
-			printf(
-			" %8zu | %8X | %8X | %8X | %8X | %8X | %8X | %8X | %8X |\n",
-			i,
-			vd->u32block[i],     vd->u32block[i + 1],
-			vd->u32block[i + 2], vd->u32block[i + 3],
-			vd->u32block[i + 4], vd->u32block[i + 5],
-			vd->u32block[i + 6], vd->u32block[i + 7]
-			);
-		}
-		if (bcount - i > 0) { // Left over
-			printf(" %8zu |", i);
-			for (; i < bcount; ++i)
-				printf(" %8X |", vd->u32block[i]);
-			putchar('\n');
-		}
-	}*/
 
+	free(extents);
 	return EXIT_SUCCESS;
 }
 
@@ -692,7 +891,6 @@ int vvd_new(const oschar *path, uint32_t format, uint64_t capacity, uint32_t fla
 //
 
 int vvd_compact(VDISK *vd, uint32_t flags) {
-	puts("vvd_compact: [warning] This function is still work in progress");
 	g_flags = flags;
 	if (vdisk_op_compact(vd, vvd_cb_progress)) {
 		vdisk_perror(vd);
@@ -700,3 +898,24 @@ int vvd_compact(VDISK *vd, uint32_t flags) {
 	}
 	return EXIT_SUCCESS;
 }
+
+//
+// vvd_convert
+//
+
+int vvd_convert(VDISK *vd, const oschar *path, uint32_t format, uint32_t cflags, uint32_t threads, uint32_t flags) {
+	VDISK vdout;
+	g_flags = flags;
+	if (vdisk_create(&vdout, path, format, vd->capacity, cflags)) {
+		vdisk_perror(&vdout);
+		return vdout.err.num;
+	}
+	if (vdisk_op_convert(vd, &vdout, threads, 0, vvd_cb_progress)) {
+		vdisk_perror(&vdout);
+		vdisk_close(&vdout);
+		return vdout.err.num;
+	}
+	printf("vvd_convert: converted to %s disk successfully\n", vdisk_str(&vdout));
+	vdisk_close(&vdout);
+	return EXIT_SUCCESS;
+}
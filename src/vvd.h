@@ -13,8 +13,8 @@ enum {
 	VVD_PROGRESS	= 0x10,
 	// vvd_info: Show raw information
 	VVD_INFO_RAW	= 0x10000,
-	// vvd_map flags
-	//VVD_MAP_	= 0x1000,
+	// vvd_map: Print comma-separated values
+	VVD_MAP_CSV	= 0x10000,
 	// vvd_compact flags
 	//VVD_COMPACT_CLEAN_EMPTY	= 0x10000,
 };
@@ -29,6 +29,11 @@ int vvd_info(VDISK *vd, uint32_t flags);
 
 /**
  * Print VDISK allocation map to stdout.
+ * 
+ * Allocation is printed as runs of blocks sharing the same state (data,
+ * zero, unallocated), with the file offset of data runs, followed by a
+ * summary and a fragmentation score. With VVD_MAP_CSV, only the runs are
+ * printed as comma-separated values.
  */
 int vvd_map(VDISK *vd, uint32_t flags);
 
@@ -45,3 +50,18 @@ int vvd_new(const oschar *vd, uint32_t format, uint64_t capacity, uint32_t flags
  * unallocated blocks from the VDISK.
  */
 int vvd_compact(VDISK *vd, uint32_t flags);
+
+/**
+ * Convert a VDISK into a new VDISK.
+ * 
+ * The output VDISK is created with the same capacity, then populated with
+ * the allocated, non-zero, blocks of the input VDISK.
+ * 
+ * \param vd Input VDISK
+ * \param path Output VDISK path
+ * \param format Output VDISK format (VDISK_FORMAT enum)
+ * \param cflags Output VDISK creation flags (see vdisk_create)
+ * \param threads Number of reader threads, 0 for default
+ * \param flags Generic vvd flags
+ */
+int vvd_convert(VDISK *vd, const oschar *path, uint32_t format, uint32_t cflags, uint32_t threads, uint32_t flags);